@@ -2,6 +2,7 @@
 #include <assert.h>
 
 #include "Buffer.h"
+#include "NumaAlloc.h"
 
 #ifndef DIE
 #define DIE(fmt, ...) do { fprintf(stderr, fmt, ##__VA_ARGS__); exit(1); } while(0)
@@ -12,7 +13,7 @@ Buffer initBuffer(size_t initSize) {
     if (initSize <= 0) initSize = 256;
     Buffer b = (_Buffer *) malloc(sizeof(_Buffer));
     if (b == NULL) { DIE("Could not allocate new Buffer!\n"); }
-    b->buf = (char*) malloc(initSize);
+    b->buf = (char*) allocNumaLocal(initSize); // on the node of the thread that owns the Buffer
     if (b->buf == NULL) { DIE("Could not allocate %ld bytes into Buffer!\n", initSize); }
     b->len = 0;
     b->size = initSize;
@@ -26,11 +27,12 @@ size_t growBuffer(Buffer b, size_t appendSize) {
     assert(b->size > 0);
     size_t requiredSize = b->len + appendSize + 1;
     if (requiredSize >= b->size) {
+        size_t oldSize = b->size;
         while (requiredSize > b->size) {
             b->size *= 2;
         }
         assert(b->size >= requiredSize);
-        b->buf = (char*) realloc(b->buf, b->size);
+        b->buf = (char*) reallocNuma(b->buf, oldSize, b->size);
         if (b->buf == NULL)  { DIE("Could not reallocate %ld bytes into Buffer!", b->size); }
         b->buf[b->len] = '\0';
     }
@@ -48,7 +50,7 @@ void resetBuffer(Buffer b) {
 // destroys a Buffer
 void freeBuffer(Buffer b) {
     if (b == NULL) return;
-    free(b->buf);
+    freeNuma(b->buf, b->size);
     b->buf = NULL;
     b->len = b->size = 0;
     free(b);
@@ -7,16 +7,33 @@
 #include <time.h>
 #include <stdarg.h>
 #include <string.h>
-#include <time.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "NumaAlloc.h"
 
 #ifdef __UPC__
   #include <upc.h>
 #elif defined _OPENMP
   #include <omp.h>
+  #ifdef USE_MPI
+    #include <mpi.h>
+  #endif
 #elif defined USE_MPI
   #include <mpi.h>
+#elif defined USE_PTHREADS
+  #include <pthread.h>
+#else
+  #warning "No parallelism has been chosen at compile time... did you want OpenMP (cc -fopenmp), MPI (mpicc -DUSE_MPI), pthreads (cc -pthread -DUSE_PTHREADS) or UPC (upcc)?"
+#endif
+
+// storage class of per-thread statics that OpenMP threadprivate does not cover
+#if defined USE_PTHREADS && !defined _OPENMP && !defined USE_MPI && !defined __UPC__
+  #define _CP_THREAD_LOCAL __thread
 #else
-  #warn "No parallelism has been chosen at compile time... did you want OpenMP (cc -fopenmp), MPI (mpicc -DUSE_MPI) or UPC (upcc)?"
+  #define _CP_THREAD_LOCAL
 #endif
 
 #if defined (__cplusplus)
@@ -24,6 +41,9 @@ extern "C" {
 #endif
 
 
+// every thread releases its region timers (and their perf counters) in FINALIZE
+static inline void _freeMyTimers();
+
 /* First defined the EXIT_FUNC that will be used */
 #ifdef __UPC__
   /* UPC */
@@ -33,26 +53,31 @@ extern "C" {
 
   #define EXIT_FUNC(code) upc_global_exit(code)
   #define INIT(argc, argv) { /* noop */ }
-  #define FINALIZE() { /* noop */ }
+  #define FINALIZE() { _freeMyTimers(); }
 #else
   #ifdef MPI_VERSION
-    /* MPI */
+    #define EXIT_FUNC(code) do { MPI_Abort(MPI_COMM_WORLD, code); exit(code); } while (0)
     #ifdef _OPENMP
-    #error "You can not currently specify OpenMP AND MPI"
+      /* Hybrid MPI ranks x OpenMP threads */
+      #define INIT(argc, argv) __hybrid_init(&argc, &argv); _Pragma("omp parallel") { __pin_threads(MYLOCALTHREAD);
+      #define FINALIZE() _freeMyTimers(); } MPI_Finalize()
+    #else
+      /* MPI */
+      #define INIT(argc, argv) do { MPI_Init(&argc, &argv); __pin_threads(-1); } while (0)
+      #define FINALIZE() do { _freeMyTimers(); MPI_Finalize(); } while (0)
     #endif
-
-    #define EXIT_FUNC(code) do { MPI_Abort(MPI_COMM_WORLD, code); exit(code); } while (0)
-    #define INIT(argc, argv) MPI_Init(&argc, &argv)
-    #define FINALIZE() MPI_Finalize()
   #else
     /* OpenMP */
     #define EXIT_FUNC(x) exit(x)
     #ifdef _OPENMP
-      #define INIT(argc, argv) _Pragma("omp parallel") {
-      #define FINALIZE() }
+      #define INIT(argc, argv) _Pragma("omp parallel") { __pin_threads(MYLOCALTHREAD);
+      #define FINALIZE() _freeMyTimers(); }
+    #elif defined USE_PTHREADS
+      #define INIT(argc, argv) __pthreads_init(argc, argv); {
+      #define FINALIZE() _freeMyTimers(); __pthreads_finalize(); }
     #else
       #define INIT(argc, argv) {
-      #define FINALIZE() }
+      #define FINALIZE() _freeMyTimers(); }
     #endif
   #endif
 #endif
@@ -66,6 +91,12 @@ static void writeMyLog(int level, const char *fmt, ...);
 #define LOG(level, fmt, ...) do { if (VERBOSE >= level) { writeMyLog(level, fmt, ##__VA_ARGS__); }  } while (0)
 #endif
 
+#ifndef COLOR_NORM
+#define COLOR_NORM   "\x1B[0m"
+#define COLOR_RED   "\x1B[91m"
+#define COLOR_GREEN  "\x1B[32m"
+#endif
+
 #ifndef DIE
 static inline int *hasMyLog();
 static inline void closeMyLog();
@@ -92,6 +123,80 @@ static inline void closeMyLog();
     } while (0)
 #endif
 
+/*
+ * Clocks
+ *
+ * __get_monotonic_seconds() uses clock_gettime(CLOCK_MONOTONIC) (nanosecond resolution,
+ * never goes backwards) and falls back to gettimeofday where that is not available.
+ * CYCLES() reads the cheapest raw tick counter of the cpu (rdtsc on x86, cntvct_el0 on aarch64,
+ * nanoseconds otherwise) for hot-path instrumentation; CYCLES_TO_SECONDS converts a
+ * difference of two CYCLES() readings.
+ */
+static inline double __get_monotonic_seconds() {
+#if defined(_POSIX_TIMERS) && _POSIX_TIMERS > 0 && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + ts.tv_nsec / (double) 1000000000.0;
+#else
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long) tv.tv_usec + 1000000 * (long long) tv.tv_sec) / (double) 1000000.0;
+#endif
+}
+
+static inline uint64_t __get_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (v));
+    return v;
+#else
+    return (uint64_t) (__get_monotonic_seconds() * 1000000000.0);
+#endif
+}
+
+// 1 if CYCLES() ticks at a constant rate on every core
+static inline int __has_constant_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t a, b, c, d;
+    __asm__ __volatile__ ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (0x80000000));
+    if (a < 0x80000007) return 0;
+    __asm__ __volatile__ ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (0x80000007));
+    return (d >> 8) & 1; // invariant TSC
+#else
+    return 1;
+#endif
+}
+
+// calibrated once against the monotonic clock (~10ms)
+static inline double __get_seconds_per_cycle() {
+    static volatile double secondsPerCycle = 0.0;
+    if (secondsPerCycle == 0.0) {
+#if defined(__aarch64__)
+        uint64_t freq;
+        __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r" (freq));
+        secondsPerCycle = 1.0 / (double) freq;
+#elif defined(__x86_64__) || defined(__i386__)
+        double t0 = __get_monotonic_seconds(), t1;
+        uint64_t c0 = __get_cycles(), c1;
+        do {
+            t1 = __get_monotonic_seconds();
+            c1 = __get_cycles();
+        } while (t1 - t0 < 0.01);
+        secondsPerCycle = (t1 - t0) / (double) (c1 - c0);
+#else
+        secondsPerCycle = 1.0 / 1000000000.0;
+#endif
+    }
+    return secondsPerCycle;
+}
+
+#define CYCLES() __get_cycles()
+#define CYCLES_TO_SECONDS(c) ((double) (c) * __get_seconds_per_cycle())
+
 #ifdef __UPC__
 
   // UPC 
@@ -102,6 +207,14 @@ static inline void closeMyLog();
   #define BARRIER upc_barrier
   #define NOW() UPC_TICKS_TO_SECS( UPC_TICKS_NOW() )
 
+  // every UPC thread is its own rank
+  #define THREAD_BARRIER do { } while (0)
+  #define RANK_BARRIER upc_barrier
+  #define RANKS THREADS
+  #define MYRANK MYTHREAD
+  #define LOCALTHREADS 1
+  #define MYLOCALTHREAD 0
+
 #else // NOT UPC
 
   #ifdef MPI_VERSION
@@ -110,6 +223,71 @@ static inline void closeMyLog();
     #pragma message "Using MPI CommonParallel.h"
 
     #define CHECK_MPI(x) CHECK_ERR(x, MPI_SUCCESS)
+
+  #ifdef _OPENMP
+    /*
+     * Hybrid: every rank runs the same number of OpenMP threads.  THREADS is ranks x threads
+     * and MYTHREAD = MYRANK * LOCALTHREADS + MYLOCALTHREAD, so the threads of a rank are contiguous.
+     * Only the master thread (MYLOCALTHREAD == 0) makes MPI communication calls.
+     */
+    #pragma message "Using hybrid MPI+OpenMP CommonParallel.h"
+    #include "ThreadBarrier.h"
+
+    static void __hybrid_init(int *argc, char ***argv) {
+        int provided;
+        MPI_Init_thread(argc, argv, MPI_THREAD_SERIALIZED, &provided);
+        if (provided < MPI_THREAD_SERIALIZED) {
+            fprintf(stderr, "MPI does not provide MPI_THREAD_SERIALIZED, which the hybrid MPI+OpenMP mode requires\n");
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+    static inline int __get_RANKS() {
+        static int size = -1;
+        if (size < 0) {
+            #pragma omp critical(_mpi_query)
+            MPI_Comm_size(MPI_COMM_WORLD, &size);
+        }
+        return size;
+    }
+    static inline int __get_MYRANK() {
+        static int rank = -1;
+        if (rank < 0) {
+            #pragma omp critical(_mpi_query)
+            MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        }
+        return rank;
+    }
+    static inline int __get_THREADS() {
+        return __get_RANKS() * omp_get_num_threads();
+    }
+    static inline int __get_MYTHREAD() {
+        return __get_MYRANK() * omp_get_num_threads() + omp_get_thread_num();
+    }
+    static inline void __thread_barrier() {
+        #pragma omp barrier
+    }
+    // MPI_COMM_WORLD errors are fatal, and MYTHREAD for CHECK_MPI is not defined yet
+    static inline void __rank_barrier() {
+        #pragma omp master
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    static inline void __barrier(const char * file, int line) {
+        LOG(3, "Starting barrier at %d %s\n", line, file);
+        #pragma omp barrier
+        #pragma omp master
+        MPI_Barrier(MPI_COMM_WORLD);
+        #pragma omp barrier
+    }
+    #define BARRIER __barrier(__FILE__, __LINE__)
+    #define THREAD_BARRIER __thread_barrier()
+    #define RANK_BARRIER __rank_barrier()
+    #define RANKS (__get_RANKS())
+    #define MYRANK (__get_MYRANK())
+    #define LOCALTHREADS (omp_get_num_threads())
+    #define MYLOCALTHREAD (omp_get_thread_num())
+    #define NOW() MPI_Wtime()
+
+  #else
     static inline int __get_THREADS() {
         static int size = -1;
         if (size < 0)
@@ -124,6 +302,7 @@ static inline void closeMyLog();
     }
     #define BARRIER do { LOG(3, "Starting barrier at %d %s\n", __LINE__, __FILE__); CHECK_MPI(MPI_Barrier(MPI_COMM_WORLD)); } while (0)
     #define NOW() MPI_Wtime()
+  #endif
 
   #else
     // OpenMP or fake it!
@@ -132,6 +311,79 @@ static inline void closeMyLog();
       #include <omp.h>
       #pragma message "Using OpenMP in CommonParallel.h"
       // OpenMP, ensure omp.h is loaded
+      #include "ThreadBarrier.h"
+
+    #elif defined USE_PTHREADS
+      #pragma message "Using pthreads in CommonParallel.h"
+
+      /*
+       * pthreads: INIT starts the threads SPMD style, like mpirun does for MPI ranks.
+       * Thread 0 is the calling thread and every other thread re-enters main(), where
+       * its INIT is a no-op, so code before INIT runs once per thread.  FINALIZE waits
+       * for all threads, then the others exit and thread 0 joins them.
+       * The number of threads comes from PTHREADS_NUM_THREADS, else OMP_NUM_THREADS, else
+       * the number of online cpus.
+       * BARRIER is THREAD_BARRIER_ALGORITHM from ThreadBarrier.h, by default the spin-then-futex barrier.
+       * The team and the thread id are weak symbols so that every object file sees the same ones.
+       */
+      #include "ThreadBarrier.h"
+
+      typedef struct {
+          int numThreads, argc;
+          char **argv;
+          pthread_t *threads;
+          ThreadBarrier barrier;
+          ThreadSplitBarrier splitBarrier;
+      } _PthreadTeam;
+
+      __attribute__((weak)) _PthreadTeam __pthread_team;
+      __attribute__((weak)) __thread int __pthread_id = -1;
+
+      int main(int argc, char **argv);
+
+      static void __pin_threads(int slot);
+
+      static void *__pthread_main(void *id) {
+          __pthread_id = (int) (intptr_t) id;
+          __pin_threads(__pthread_id);
+          main(__pthread_team.argc, __pthread_team.argv);
+          return NULL;
+      }
+
+      static void __pthreads_init(int argc, char **argv) {
+          if (__pthread_id >= 0) return; // a started thread re-entering main
+          const char *env = getenv("PTHREADS_NUM_THREADS");
+          if (env == NULL) env = getenv("OMP_NUM_THREADS");
+          int i, numThreads = env != NULL ? atoi(env) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+          if (numThreads < 1) numThreads = 1;
+          __pthread_team.numThreads = numThreads;
+          __pthread_team.argc = argc;
+          __pthread_team.argv = argv;
+          __pthread_team.barrier = initThreadBarrier(numThreads, parseThreadBarrierAlgorithm(getenv("THREAD_BARRIER_ALGORITHM")));
+          __pthread_team.splitBarrier = initThreadSplitBarrier(numThreads);
+          __pthread_team.threads = (pthread_t*) calloc(numThreads, sizeof(pthread_t));
+          if (__pthread_team.threads == NULL) { fprintf(stderr, "Could not allocate %d pthreads\n", numThreads); exit(1); }
+          __pthread_id = 0;
+          for(i = 1; i < numThreads; i++) {
+              int err = pthread_create(__pthread_team.threads + i, NULL, __pthread_main, (void*) (intptr_t) i);
+              if (err != 0) { fprintf(stderr, "Could not start pthread %d of %d: %s\n", i, numThreads, strerror(err)); exit(1); }
+          }
+          __pin_threads(0); // after the others started with the whole cpu set
+      }
+
+      static void __pthreads_finalize() {
+          int i;
+          waitThreadBarrier(__pthread_team.barrier, __pthread_id);
+          if (__pthread_id != 0) pthread_exit(NULL);
+          for(i = 1; i < __pthread_team.numThreads; i++) pthread_join(__pthread_team.threads[i], NULL);
+          free(__pthread_team.threads);
+          __pthread_team.threads = NULL;
+          freeThreadBarrier(__pthread_team.barrier);
+          __pthread_team.barrier = NULL;
+          freeThreadSplitBarrier(__pthread_team.splitBarrier);
+          __pthread_team.splitBarrier = NULL;
+          __pthread_team.numThreads = 1;
+      }
 
     #else
 
@@ -147,6 +399,20 @@ static inline void closeMyLog();
 
     #endif
 
+  #if defined USE_PTHREADS && !defined _OPENMP
+    static inline int __get_THREADS() {
+        return __pthread_team.numThreads > 0 ? __pthread_team.numThreads : 1;
+    }
+
+    static inline int __get_MYTHREAD() {
+        return __pthread_id > 0 ? __pthread_id : 0;
+    }
+
+    static inline void __barrier(const char * file, int line) {
+         LOG(2, "Barrier: %s:%d-%d\n", file, line, __get_MYTHREAD());
+         if (__pthread_id >= 0) waitThreadBarrier(__pthread_team.barrier, __pthread_id);
+    }
+  #else
     static inline int __get_THREADS() { 
         return omp_get_num_threads();
     }
@@ -155,15 +421,67 @@ static inline void closeMyLog();
          return omp_get_thread_num();
     }
 
+   #ifdef _OPENMP
+    /*
+     * BARRIER is the native omp barrier unless THREAD_BARRIER_ALGORITHM names one from ThreadBarrier.h.
+     * That barrier is made by the first BARRIER of each team, and again whenever the team size changes.
+     */
+    __attribute__((weak)) ThreadBarrier __omp_team_barrier = NULL;
+    __attribute__((weak)) int __omp_barrier_algorithm = -2;
+
+    static inline void __barrier(const char * file, int line) {
+         LOG(2, "Barrier: %s:%d-%d\n", file, line, __get_MYTHREAD());
+         int algorithm = __atomic_load_n(&__omp_barrier_algorithm, __ATOMIC_RELAXED);
+         if (algorithm == -2) {
+             algorithm = parseThreadBarrierAlgorithm(getenv("THREAD_BARRIER_ALGORITHM"));
+             __atomic_store_n(&__omp_barrier_algorithm, algorithm, __ATOMIC_RELAXED);
+         }
+         if (algorithm < 0 || !omp_in_parallel()) {
+             #pragma omp barrier
+             return;
+         }
+         ThreadBarrier b = __omp_team_barrier;
+         if (b == NULL || b->numThreads != omp_get_num_threads()) {
+             // every thread of the team sees the same mismatch, so all of them get here
+             #pragma omp barrier
+             #pragma omp single
+             {
+                 freeThreadBarrier(__omp_team_barrier);
+                 __omp_team_barrier = initThreadBarrier(omp_get_num_threads(), algorithm);
+             }
+             return; // the single ended with a barrier
+         }
+         waitThreadBarrier(b, omp_get_thread_num());
+    }
+   #else
     static inline void __barrier(const char * file, int line) {
-         LOG(1, "Barrier: %s:%d-%d\n", file, line, __get_MYTHREAD());
-         #pragma omp barrier
-         LOG(2, "Past Barrier %s:%d-%d\n", __get_MYTHREAD(),file, line, __get_MYTHREAD());
+         LOG(2, "Barrier: %s:%d-%d\n", file, line, __get_MYTHREAD());
     }
+   #endif
+  #endif
     static inline double __get_seconds() {
-        struct timeval tv;
-        gettimeofday(&tv,NULL);
-        return ((long long) tv.tv_usec + 1000000 * (long long) tv.tv_sec) / (double) 1000000.0;
+    #ifdef USE_TSC_CLOCK
+        // CYCLES() scaled by the calibrated rate and anchored to the monotonic clock
+        static double secondsBase = 0.0;
+        static uint64_t cyclesBase = 0;
+        static int useCycles = -1;
+        if (useCycles < 0) {
+            #pragma omp critical(_calibrate_cycles)
+            if (useCycles < 0) {
+                if (__has_constant_cycles()) {
+                    __get_seconds_per_cycle();
+                    cyclesBase = __get_cycles();
+                    secondsBase = __get_monotonic_seconds();
+                    useCycles = 1;
+                } else {
+                    LOG(1, "No invariant cycle counter, NOW() is using the monotonic clock\n");
+                    useCycles = 0;
+                }
+            }
+        }
+        if (useCycles) return secondsBase + CYCLES_TO_SECONDS( __get_cycles() - cyclesBase );
+    #endif
+        return __get_monotonic_seconds();
     }
 
     #define BARRIER __barrier(__FILE__, __LINE__)
@@ -181,16 +499,34 @@ static inline void closeMyLog();
   #define THREADS (__get_THREADS())
   #define MYTHREAD (__get_MYTHREAD())
 
+  /*
+   * Levels of the hierarchy: RANKS processes (MYRANK) of LOCALTHREADS threads (MYLOCALTHREAD) each.
+   * THREAD_BARRIER synchronizes the threads of one rank, RANK_BARRIER the ranks, BARRIER all threads.
+   */
+  #ifndef RANKS
+    #ifdef MPI_VERSION
+      #define THREAD_BARRIER do { } while (0)
+      #define RANK_BARRIER BARRIER
+      #define RANKS THREADS
+      #define MYRANK MYTHREAD
+      #define LOCALTHREADS 1
+      #define MYLOCALTHREAD 0
+    #else
+      #define THREAD_BARRIER BARRIER
+      #define RANK_BARRIER do { } while (0)
+      #define RANKS 1
+      #define MYRANK 0
+      #define LOCALTHREADS THREADS
+      #define MYLOCALTHREAD MYTHREAD
+    #endif
+  #endif
+
 #endif
 
 
 #ifndef _MESSAGE_MACROS
   #define _MESSAGE_MACROS
 
-  #define COLOR_NORM   "\x1B[0m"
-  #define COLOR_RED   "\x1B[91m"
-  #define COLOR_GREEN  "\x1B[32m"
-
   static inline int *hasMyLog() {
     static int _log = 0;
     return &_log;
@@ -210,9 +546,9 @@ static inline void closeMyLog();
       }
       return f2;
     #else
-      static FILE2 *_mylog = NULL;
+      static _CP_THREAD_LOCAL FILE2 *_mylog = NULL;
       
-      #ifdef MPI_VERSION
+      #if defined MPI_VERSION && !defined _OPENMP
         if(_mylog == NULL) {
           _mylog = calloc(1, sizeof(FILE2));
           _mylog->f = stderr;
@@ -309,6 +645,880 @@ static inline void closeMyLog();
 #endif // _MESSAGE_MACROS
 
 
+/*
+ * Collective operations
+ *
+ * Every thread must call these in the same order.  REDUCE, ALLREDUCE and EXSCAN work in place
+ * on count elements of a CollType:
+ *   REDUCE(buf, count, type, op, root)   - result in buf on root only, other buffers unchanged
+ *   ALLREDUCE(buf, count, type, op)      - result in buf on every thread
+ *   EXSCAN(buf, count, type, op)         - buf becomes the reduction over all lower threads
+ *                                          (the identity of op on thread 0), e.g. partition offsets
+ * and the byte oriented operations copy raw memory:
+ *   BROADCAST(buf, bytes, root)
+ *   GATHER(sendbuf, recvbuf, bytes, root)     - recvbuf holds THREADS*bytes on root only
+ *   ALLGATHER(sendbuf, recvbuf, bytes)        - recvbuf holds THREADS*bytes everywhere
+ *   ALLTOALL(sendbuf, recvbuf, bytes)         - block t of sendbuf goes to thread t, which receives
+ *                                               it as block MYTHREAD of recvbuf (THREADS*bytes each)
+ *
+ * MPI maps straight onto the MPI collectives.  OpenMP publishes a pointer per thread and
+ * combines them up a binary tree (log2(THREADS) barriers) instead of a critical section.
+ * UPC does the same over a per-thread block of shared scratch memory.  Hybrid MPI+OpenMP
+ * combines the threads of each rank, then the ranks, then shares the result with the threads.
+ * THREAD_REDUCE etc. are the thread level halves on their own.
+ */
+#include <limits.h>
+#include <float.h>
+
+typedef enum { COLL_INT, COLL_INT64, COLL_UINT64, COLL_DOUBLE } CollType;
+typedef enum { COLL_SUM, COLL_MIN, COLL_MAX } CollOp;
+
+static inline size_t _collTypeSize(CollType type) {
+    switch(type) {
+        case COLL_INT: return sizeof(int);
+        case COLL_INT64: return sizeof(int64_t);
+        case COLL_UINT64: return sizeof(uint64_t);
+        case COLL_DOUBLE: return sizeof(double);
+    }
+    return 0;
+}
+
+#define _COLL_COMBINE(T) \
+    do { \
+        T *a = (T*) inout; const T *b = (const T*) in; \
+        switch(op) { \
+            case COLL_SUM: for(i = 0; i < count; i++) a[i] += b[i]; break; \
+            case COLL_MIN: for(i = 0; i < count; i++) if (b[i] < a[i]) a[i] = b[i]; break; \
+            case COLL_MAX: for(i = 0; i < count; i++) if (b[i] > a[i]) a[i] = b[i]; break; \
+        } \
+    } while (0)
+
+// inout = inout op in
+static void _collCombine(void *inout, const void *in, int count, CollType type, CollOp op) {
+    int i;
+    switch(type) {
+        case COLL_INT: _COLL_COMBINE(int); break;
+        case COLL_INT64: _COLL_COMBINE(int64_t); break;
+        case COLL_UINT64: _COLL_COMBINE(uint64_t); break;
+        case COLL_DOUBLE: _COLL_COMBINE(double); break;
+    }
+}
+
+#define _COLL_IDENTITY(T, minVal, maxVal) \
+    do { \
+        T *a = (T*) buf; \
+        for(i = 0; i < count; i++) a[i] = op == COLL_SUM ? (T) 0 : (op == COLL_MIN ? maxVal : minVal); \
+    } while (0)
+
+static void _collIdentity(void *buf, int count, CollType type, CollOp op) {
+    int i;
+    switch(type) {
+        case COLL_INT: _COLL_IDENTITY(int, INT_MIN, INT_MAX); break;
+        case COLL_INT64: _COLL_IDENTITY(int64_t, INT64_MIN, INT64_MAX); break;
+        case COLL_UINT64: _COLL_IDENTITY(uint64_t, 0, UINT64_MAX); break;
+        case COLL_DOUBLE: _COLL_IDENTITY(double, -DBL_MAX, DBL_MAX); break;
+    }
+}
+
+#ifdef __UPC__
+
+  // one block of scratch per thread, grown collectively as needed
+  static shared [] char *_collScratch(int thread, size_t bytes) {
+      static shared void *scratch = NULL;
+      static size_t capacity = 0;
+      if (bytes > capacity) {
+          if (scratch != NULL) { upc_barrier; if (!MYTHREAD) upc_free(scratch); }
+          capacity = bytes < 4096 ? 4096 : bytes;
+          scratch = upc_all_alloc(THREADS, capacity);
+          if (scratch == NULL) DIE("Could not allocate %lld bytes of collective scratch\n", (long long) capacity);
+      }
+      return (shared [] char *) (((shared char *) scratch) + thread);
+  }
+
+  static void __collReduce(void *buf, int count, CollType type, CollOp op, int root, int all) {
+      size_t bytes = count * _collTypeSize(type);
+      shared [] char *mine = _collScratch(MYTHREAD, bytes);
+      char *local = (char*) mine; // affinity to MYTHREAD
+      char *tmp = (char*) malloc(bytes);
+      if (tmp == NULL) DIE("Could not allocate %lld bytes for a reduction\n", (long long) bytes);
+      int me = (MYTHREAD - root + THREADS) % THREADS, s;
+      memcpy(local, buf, bytes);
+      upc_barrier;
+      for(s = 1; s < THREADS; s <<= 1) {
+          if (me % (2*s) == 0 && me + s < THREADS) {
+              upc_memget(tmp, _collScratch((root + me + s) % THREADS, bytes), bytes);
+              _collCombine(local, tmp, count, type, op);
+          }
+          upc_barrier;
+      }
+      if (all) upc_memget(buf, _collScratch(root, bytes), bytes);
+      else if (MYTHREAD == root) memcpy(buf, local, bytes);
+      upc_barrier;
+      free(tmp);
+  }
+
+  static void __collExscan(void *buf, int count, CollType type, CollOp op) {
+      size_t bytes = count * _collTypeSize(type);
+      char *tmp = (char*) malloc(bytes);
+      if (tmp == NULL) DIE("Could not allocate %lld bytes for a scan\n", (long long) bytes);
+      int t;
+      memcpy((char*) _collScratch(MYTHREAD, bytes), buf, bytes);
+      upc_barrier;
+      _collIdentity(buf, count, type, op);
+      for(t = 0; t < MYTHREAD; t++) {
+          upc_memget(tmp, _collScratch(t, bytes), bytes);
+          _collCombine(buf, tmp, count, type, op);
+      }
+      upc_barrier;
+      free(tmp);
+  }
+
+  static void __collBroadcast(void *buf, size_t bytes, int root) {
+      shared [] char *src = _collScratch(root, bytes);
+      if (MYTHREAD == root) memcpy((char*) src, buf, bytes);
+      upc_barrier;
+      if (MYTHREAD != root) upc_memget(buf, src, bytes);
+      upc_barrier;
+  }
+
+  static void __collGather(const void *sendbuf, void *recvbuf, size_t bytes, int root, int all) {
+      int t;
+      memcpy((char*) _collScratch(MYTHREAD, bytes), sendbuf, bytes);
+      upc_barrier;
+      if (all || MYTHREAD == root) {
+          for(t = 0; t < THREADS; t++) upc_memget(((char*) recvbuf) + t * bytes, _collScratch(t, bytes), bytes);
+      }
+      upc_barrier;
+  }
+
+  static void __collAlltoall(const void *sendbuf, void *recvbuf, size_t bytes) {
+      int t;
+      shared [] char *mine = _collScratch(MYTHREAD, bytes * THREADS);
+      memcpy((char*) mine, sendbuf, bytes * THREADS);
+      upc_barrier;
+      for(t = 0; t < THREADS; t++) upc_memget(((char*) recvbuf) + t * bytes, _collScratch(t, bytes * THREADS) + MYTHREAD * bytes, bytes);
+      upc_barrier;
+  }
+
+#else // NOT UPC
+
+  #if defined _OPENMP || !defined MPI_VERSION
+
+    /*
+     * Thread level collectives between the LOCALTHREADS threads of this process.
+     * Each thread publishes one pointer and the values are combined up a binary tree.
+     */
+    #ifndef MAX_COLL_THREADS
+    #define MAX_COLL_THREADS 4096
+    #endif
+
+    // each thread publishes one pointer here for the duration of a collective.
+    // A weak symbol, so that every object file of the program uses the same slots
+    __attribute__((weak)) void *__coll_slots[MAX_COLL_THREADS];
+
+    static inline void **_collSlots() {
+        if (LOCALTHREADS > MAX_COLL_THREADS) DIE("Collectives support at most %d threads, increase MAX_COLL_THREADS\n", MAX_COLL_THREADS);
+        return __coll_slots;
+    }
+
+    static void __threadReduce(void *buf, int count, CollType type, CollOp op, int root, int all) {
+        void **slots = _collSlots();
+        size_t bytes = count * _collTypeSize(type);
+        char *tmp = (char*) malloc(bytes);
+        if (tmp == NULL) DIE("Could not allocate %lld bytes for a reduction\n", (long long) bytes);
+        int nthreads = LOCALTHREADS, myThread = MYLOCALTHREAD;
+        int me = (myThread - root + nthreads) % nthreads, s;
+        memcpy(tmp, buf, bytes);
+        slots[myThread] = tmp;
+        THREAD_BARRIER;
+        for(s = 1; s < nthreads; s <<= 1) {
+            if (me % (2*s) == 0 && me + s < nthreads) _collCombine(tmp, slots[(root + me + s) % nthreads], count, type, op);
+            THREAD_BARRIER;
+        }
+        if (all || myThread == root) memcpy(buf, slots[root], bytes);
+        THREAD_BARRIER;
+        free(tmp);
+    }
+
+    static void __threadExscan(void *buf, int count, CollType type, CollOp op) {
+        void **slots = _collSlots();
+        size_t bytes = count * _collTypeSize(type);
+        char *tmp = (char*) malloc(bytes);
+        if (tmp == NULL) DIE("Could not allocate %lld bytes for a scan\n", (long long) bytes);
+        int t, myThread = MYLOCALTHREAD;
+        memcpy(tmp, buf, bytes);
+        slots[myThread] = tmp;
+        THREAD_BARRIER;
+        _collIdentity(buf, count, type, op);
+        for(t = 0; t < myThread; t++) _collCombine(buf, slots[t], count, type, op);
+        THREAD_BARRIER;
+        free(tmp);
+    }
+
+    static void __threadBroadcast(void *buf, size_t bytes, int root) {
+        void **slots = _collSlots();
+        int myThread = MYLOCALTHREAD;
+        if (myThread == root) slots[root] = buf;
+        THREAD_BARRIER;
+        if (myThread != root) memcpy(buf, slots[root], bytes);
+        THREAD_BARRIER;
+    }
+
+    static void __threadGather(const void *sendbuf, void *recvbuf, size_t bytes, int root, int all) {
+        void **slots = _collSlots();
+        int t, nthreads = LOCALTHREADS, myThread = MYLOCALTHREAD;
+        slots[myThread] = (void*) sendbuf;
+        THREAD_BARRIER;
+        if (all || myThread == root) {
+            for(t = 0; t < nthreads; t++) memcpy(((char*) recvbuf) + t * bytes, slots[t], bytes);
+        }
+        THREAD_BARRIER;
+    }
+
+    static void __threadAlltoall(const void *sendbuf, void *recvbuf, size_t bytes) {
+        void **slots = _collSlots();
+        int t, nthreads = LOCALTHREADS, myThread = MYLOCALTHREAD;
+        slots[myThread] = (void*) sendbuf;
+        THREAD_BARRIER;
+        for(t = 0; t < nthreads; t++) memcpy(((char*) recvbuf) + t * bytes, ((char*) slots[t]) + myThread * bytes, bytes);
+        THREAD_BARRIER;
+    }
+
+  #endif
+
+  #ifdef MPI_VERSION
+
+    static inline MPI_Datatype _collMPIType(CollType type) {
+        switch(type) {
+            case COLL_INT: return MPI_INT;
+            case COLL_INT64: return MPI_INT64_T;
+            case COLL_UINT64: return MPI_UINT64_T;
+            case COLL_DOUBLE: return MPI_DOUBLE;
+        }
+        return MPI_DATATYPE_NULL;
+    }
+    static inline MPI_Op _collMPIOp(CollOp op) {
+        return op == COLL_SUM ? MPI_SUM : (op == COLL_MIN ? MPI_MIN : MPI_MAX);
+    }
+
+    // collectives between ranks, made by a single thread of each rank
+    static void __rankReduce(void *buf, int count, CollType type, CollOp op, int root, int all) {
+        if (all) {
+            CHECK_MPI( MPI_Allreduce(MPI_IN_PLACE, buf, count, _collMPIType(type), _collMPIOp(op), MPI_COMM_WORLD) );
+        } else if (MYRANK == root) {
+            CHECK_MPI( MPI_Reduce(MPI_IN_PLACE, buf, count, _collMPIType(type), _collMPIOp(op), root, MPI_COMM_WORLD) );
+        } else {
+            CHECK_MPI( MPI_Reduce(buf, NULL, count, _collMPIType(type), _collMPIOp(op), root, MPI_COMM_WORLD) );
+        }
+    }
+
+    static void __rankExscan(void *buf, int count, CollType type, CollOp op) {
+        CHECK_MPI( MPI_Exscan(MPI_IN_PLACE, buf, count, _collMPIType(type), _collMPIOp(op), MPI_COMM_WORLD) );
+        if (!MYRANK) _collIdentity(buf, count, type, op); // undefined on rank 0
+    }
+
+    static void __rankBroadcast(void *buf, size_t bytes, int root) {
+        CHECK_MPI( MPI_Bcast(buf, bytes, MPI_BYTE, root, MPI_COMM_WORLD) );
+    }
+
+    static void __rankGather(const void *sendbuf, void *recvbuf, size_t bytes, int root, int all) {
+        if (all) {
+            CHECK_MPI( MPI_Allgather((void*) sendbuf, bytes, MPI_BYTE, recvbuf, bytes, MPI_BYTE, MPI_COMM_WORLD) );
+        } else {
+            CHECK_MPI( MPI_Gather((void*) sendbuf, bytes, MPI_BYTE, recvbuf, bytes, MPI_BYTE, root, MPI_COMM_WORLD) );
+        }
+    }
+
+    static void __rankAlltoall(const void *sendbuf, void *recvbuf, size_t bytes) {
+        CHECK_MPI( MPI_Alltoall((void*) sendbuf, bytes, MPI_BYTE, recvbuf, bytes, MPI_BYTE, MPI_COMM_WORLD) );
+    }
+
+  #endif
+
+  #if defined MPI_VERSION && defined _OPENMP
+
+    /*
+     * Hybrid collectives: combine the threads of each rank first, then let the
+     * master threads (MYLOCALTHREAD == 0) communicate, then share the result locally.
+     */
+    static void *_collMalloc(size_t bytes) {
+        void *tmp = malloc(bytes > 0 ? bytes : 1);
+        if (tmp == NULL) DIE("Could not allocate %lld bytes for a collective\n", (long long) bytes);
+        return tmp;
+    }
+
+    static void __collReduce(void *buf, int count, CollType type, CollOp op, int root, int all) {
+        size_t bytes = count * _collTypeSize(type);
+        int rootRank = root / LOCALTHREADS, rootThread = root % LOCALTHREADS;
+        char *tmp = (char*) _collMalloc(bytes);
+        memcpy(tmp, buf, bytes);
+        __threadReduce(tmp, count, type, op, 0, 0);
+        if (MYLOCALTHREAD == 0) __rankReduce(tmp, count, type, op, rootRank, all);
+        if (all) {
+            __threadBroadcast(tmp, bytes, 0);
+            memcpy(buf, tmp, bytes);
+        } else if (MYRANK == rootRank) {
+            __threadBroadcast(tmp, bytes, 0);
+            if (MYLOCALTHREAD == rootThread) memcpy(buf, tmp, bytes);
+        }
+        free(tmp);
+    }
+
+    static void __collExscan(void *buf, int count, CollType type, CollOp op) {
+        size_t bytes = count * _collTypeSize(type);
+        char *rankTotal = (char*) _collMalloc(bytes);
+        memcpy(rankTotal, buf, bytes);
+        __threadReduce(rankTotal, count, type, op, 0, 0);
+        __threadExscan(buf, count, type, op);
+        if (MYLOCALTHREAD == 0) __rankExscan(rankTotal, count, type, op); // now the prefix of the lower ranks
+        __threadBroadcast(rankTotal, bytes, 0);
+        _collCombine(buf, rankTotal, count, type, op);
+        free(rankTotal);
+    }
+
+    static void __collBroadcast(void *buf, size_t bytes, int root) {
+        int rootRank = root / LOCALTHREADS, rootThread = root % LOCALTHREADS;
+        if (MYRANK == rootRank) __threadBroadcast(buf, bytes, rootThread);
+        if (MYLOCALTHREAD == 0) __rankBroadcast(buf, bytes, rootRank);
+        if (MYRANK != rootRank) __threadBroadcast(buf, bytes, 0);
+    }
+
+    static void __collGather(const void *sendbuf, void *recvbuf, size_t bytes, int root, int all) {
+        int rootRank = root / LOCALTHREADS, rootThread = root % LOCALTHREADS, nthreads = LOCALTHREADS;
+        size_t rankBytes = bytes * nthreads;
+        char *mine = (char*) _collMalloc(rankBytes), *result = NULL;
+        if (all || MYRANK == rootRank) result = (char*) _collMalloc(rankBytes * RANKS);
+        __threadGather(sendbuf, mine, bytes, 0, 0);
+        if (MYLOCALTHREAD == 0) __rankGather(mine, result, rankBytes, rootRank, all);
+        if (all || MYRANK == rootRank) {
+            __threadBroadcast(result, rankBytes * RANKS, 0);
+            if (all || MYLOCALTHREAD == rootThread) memcpy(recvbuf, result, rankBytes * RANKS);
+            free(result);
+        }
+        free(mine);
+    }
+
+    // the master regroups the blocks of its threads by destination rank, and scatters what it receives
+    static void __collAlltoall(const void *sendbuf, void *recvbuf, size_t bytes) {
+        int nthreads = LOCALTHREADS, ranks = RANKS, r, s, d;
+        size_t threadBytes = bytes * nthreads * ranks, rankBlock = bytes * nthreads * nthreads;
+        char *mine = NULL, *packed = NULL, *result = NULL;
+        if (MYLOCALTHREAD == 0) {
+            mine = (char*) _collMalloc(threadBytes * nthreads);
+            packed = (char*) _collMalloc(rankBlock * ranks);
+            result = (char*) _collMalloc(rankBlock * ranks);
+        }
+        __threadGather(sendbuf, mine, threadBytes, 0, 0);
+        if (MYLOCALTHREAD == 0) {
+            // mine is [source thread][destination rank][destination thread], packed is [destination rank][source thread][destination thread]
+            for(s = 0; s < nthreads; s++) {
+                for(r = 0; r < ranks; r++) memcpy(packed + r * rankBlock + s * bytes * nthreads, mine + s * threadBytes + r * bytes * nthreads, bytes * nthreads);
+            }
+            __rankAlltoall(packed, result, rankBlock);
+        }
+        __threadBroadcast(&result, sizeof(char*), 0);
+        // result is [source rank][source thread][destination thread]
+        for(r = 0; r < ranks; r++) {
+            for(s = 0; s < nthreads; s++) {
+                d = r * nthreads + s;
+                memcpy(((char*) recvbuf) + d * bytes, result + r * rankBlock + (s * nthreads + MYLOCALTHREAD) * bytes, bytes);
+            }
+        }
+        THREAD_BARRIER;
+        if (MYLOCALTHREAD == 0) {
+            free(mine);
+            free(packed);
+            free(result);
+        }
+    }
+
+  #elif defined MPI_VERSION
+
+    #define __collReduce __rankReduce
+    #define __collExscan __rankExscan
+    #define __collBroadcast __rankBroadcast
+    #define __collGather __rankGather
+    #define __collAlltoall __rankAlltoall
+
+  #else
+
+    #define __collReduce __threadReduce
+    #define __collExscan __threadExscan
+    #define __collBroadcast __threadBroadcast
+    #define __collGather __threadGather
+    #define __collAlltoall __threadAlltoall
+
+  #endif
+
+#endif
+
+#define REDUCE(buf, count, type, op, root) __collReduce(buf, count, type, op, root, 0)
+#define ALLREDUCE(buf, count, type, op) __collReduce(buf, count, type, op, 0, 1)
+#define EXSCAN(buf, count, type, op) __collExscan(buf, count, type, op)
+#define BROADCAST(buf, bytes, root) __collBroadcast(buf, bytes, root)
+#define GATHER(sendbuf, recvbuf, bytes, root) __collGather(sendbuf, recvbuf, bytes, root, 0)
+#define ALLGATHER(sendbuf, recvbuf, bytes) __collGather(sendbuf, recvbuf, bytes, 0, 1)
+#define ALLTOALL(sendbuf, recvbuf, bytes) __collAlltoall(sendbuf, recvbuf, bytes)
+
+// the same between the threads of one rank only (root is a MYLOCALTHREAD)
+#if defined _OPENMP || !(defined MPI_VERSION || defined __UPC__)
+  #define THREAD_REDUCE(buf, count, type, op, root) __threadReduce(buf, count, type, op, root, 0)
+  #define THREAD_ALLREDUCE(buf, count, type, op) __threadReduce(buf, count, type, op, 0, 1)
+  #define THREAD_EXSCAN(buf, count, type, op) __threadExscan(buf, count, type, op)
+  #define THREAD_BROADCAST(buf, bytes, root) __threadBroadcast(buf, bytes, root)
+  #define THREAD_GATHER(sendbuf, recvbuf, bytes, root) __threadGather(sendbuf, recvbuf, bytes, root, 0)
+  #define THREAD_ALLGATHER(sendbuf, recvbuf, bytes) __threadGather(sendbuf, recvbuf, bytes, 0, 1)
+  #define THREAD_ALLTOALL(sendbuf, recvbuf, bytes) __threadAlltoall(sendbuf, recvbuf, bytes)
+#else
+  #define THREAD_REDUCE(buf, count, type, op, root) do { } while (0)
+  #define THREAD_ALLREDUCE(buf, count, type, op) do { } while (0)
+  #define THREAD_EXSCAN(buf, count, type, op) _collIdentity(buf, count, type, op)
+  #define THREAD_BROADCAST(buf, bytes, root) do { } while (0)
+  #define THREAD_GATHER(sendbuf, recvbuf, bytes, root) memcpy(recvbuf, sendbuf, bytes)
+  #define THREAD_ALLGATHER(sendbuf, recvbuf, bytes) memcpy(recvbuf, sendbuf, bytes)
+  #define THREAD_ALLTOALL(sendbuf, recvbuf, bytes) memcpy(recvbuf, sendbuf, bytes)
+#endif
+
+
+/*
+ * Thread pinning
+ *
+ * With PIN_THREADS=1 in the environment INIT pins every thread to its own cpu, taken in order from the
+ * cpus it may run on (pinThreadNuma of NumaAlloc.h), so that memory it touches first stays on its node.
+ * OpenMP and pthreads threads take the MYLOCALTHREAD'th cpu, MPI ranks the cpu of their rank on the node
+ * and hybrid threads the MYLOCALTHREAD'th cpu of what their rank was bound to by mpirun.
+ * UPC threads are left to the binding of upcrun.
+ */
+#ifndef __UPC__
+static void __pin_threads(int slot) {
+    const char *env = getenv("PIN_THREADS");
+    if (env == NULL || atoi(env) == 0) return;
+  #if defined MPI_VERSION && !defined _OPENMP
+    // every rank sees the same environment, so they all split
+    MPI_Comm nodeComm;
+    CHECK_MPI( MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &nodeComm) );
+    CHECK_MPI( MPI_Comm_rank(nodeComm, &slot) );
+    CHECK_MPI( MPI_Comm_free(&nodeComm) );
+  #endif
+    int cpu = pinThreadNuma(slot);
+    if (cpu < 0) LOG(1, "Thread %d: could not be pinned\n", MYTHREAD);
+    else LOG(2, "Thread %d: pinned to cpu %d on NUMA node %d\n", MYTHREAD, cpu, getNumaNode());
+}
+#endif
+
+/*
+ * Split-phase barrier with a payload
+ *
+ *   BARRIER_NOTIFY(value)   - arrive, contributing an int64_t
+ *   BARRIER_TRY(result)     - nonzero once every thread has arrived, then *result (an int64_t *) is the sum
+ *   BARRIER_WAIT(result)    - BARRIER_TRY until it succeeds
+ * Work between the notify and a successful try overlaps the barrier, e.g. serving requests until every
+ * thread reports that nothing is pending.  Each thread must complete a split barrier before it notifies
+ * the next one, and must not call a blocking collective in between.
+ * MPI uses MPI_Iallreduce and threads the epoch counters of ThreadSplitBarrier.  Hybrid MPI+OpenMP
+ * combines the threads of each rank, then the master thread runs the MPI_Iallreduce and releases the
+ * others.  UPC has no portable non-blocking barrier, so there BARRIER_TRY waits in upc_wait; UPC code
+ * that needs a real one has NBTreeBarrier in upc_nb_utils.h.
+ */
+#ifdef __UPC__
+
+  // epoch e sums the values in column e % 2: no thread writes column e % 2 again until every thread has read it
+  static shared [1] int64_t _splitBarrierValues[2 * THREADS];
+  static int _splitBarrierEpoch = 0;
+
+  static inline void __splitBarrierNotify(int64_t value) {
+      _splitBarrierValues[(_splitBarrierEpoch % 2) * THREADS + MYTHREAD] = value;
+      upc_notify;
+  }
+
+  static inline int __splitBarrierTry(int64_t *result) {
+      int t, column = (_splitBarrierEpoch++ % 2) * THREADS;
+      int64_t sum = 0;
+      upc_wait;
+      for(t = 0; t < THREADS; t++) sum += _splitBarrierValues[column + t];
+      if (result != NULL) *result = sum;
+      return 1;
+  }
+
+#elif defined MPI_VERSION && !defined _OPENMP
+
+  static MPI_Request _splitBarrierRequest = MPI_REQUEST_NULL;
+  static int64_t _splitBarrierValue, _splitBarrierResult;
+
+  static inline void __splitBarrierNotify(int64_t value) {
+      _splitBarrierValue = value;
+      CHECK_MPI( MPI_Iallreduce(&_splitBarrierValue, &_splitBarrierResult, 1, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD, &_splitBarrierRequest) );
+  }
+
+  static inline int __splitBarrierTry(int64_t *result) {
+      int flag;
+      CHECK_MPI( MPI_Test(&_splitBarrierRequest, &flag, MPI_STATUS_IGNORE) );
+      if (flag && result != NULL) *result = _splitBarrierResult;
+      return flag;
+  }
+
+#else
+
+  #if defined USE_PTHREADS && !defined _OPENMP
+    static inline ThreadSplitBarrier __get_split_thread_barrier() {
+        return __pthread_team.splitBarrier;
+    }
+  #elif defined _OPENMP
+    // made by the first BARRIER_NOTIFY of each team, and again whenever the team size changes
+    __attribute__((weak)) ThreadSplitBarrier __omp_split_barrier = NULL;
+
+    static inline ThreadSplitBarrier __get_split_thread_barrier() {
+        ThreadSplitBarrier b = __atomic_load_n(&__omp_split_barrier, __ATOMIC_ACQUIRE);
+        if (b == NULL || b->numThreads != omp_get_num_threads()) {
+            #pragma omp critical(_split_barrier)
+            {
+                b = __omp_split_barrier;
+                if (b == NULL || b->numThreads != omp_get_num_threads()) {
+                    freeThreadSplitBarrier(b);
+                    b = initThreadSplitBarrier(omp_get_num_threads());
+                    __atomic_store_n(&__omp_split_barrier, b, __ATOMIC_RELEASE);
+                }
+            }
+        }
+        return b;
+    }
+  #endif
+
+  #if defined MPI_VERSION
+    // the master thread's MPI_Iallreduce of the rank's sum, released to the other threads by epoch
+    typedef struct {
+        MPI_Request request;
+        int64_t value, result;
+        int started;
+        int released;
+    } _SplitBarrierRank;
+    __attribute__((weak)) _SplitBarrierRank __split_barrier_rank = { MPI_REQUEST_NULL, 0, 0, 0, 0 };
+
+    static inline void __splitBarrierNotify(int64_t value) {
+        notifyThreadSplitBarrier(__get_split_thread_barrier(), MYLOCALTHREAD, value);
+    }
+
+    static inline int __splitBarrierTry(int64_t *result) {
+        ThreadSplitBarrier b = __get_split_thread_barrier();
+        _SplitBarrierRank *rank = &__split_barrier_rank;
+        int epoch = b->slots[MYLOCALTHREAD].epoch, flag;
+        if (MYLOCALTHREAD == 0) {
+            if (!rank->started) {
+                if (!tryThreadSplitBarrier(b, 0, &(rank->value))) return 0;
+                CHECK_MPI( MPI_Iallreduce(&(rank->value), &(rank->result), 1, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD, &(rank->request)) );
+                rank->started = 1;
+            }
+            CHECK_MPI( MPI_Test(&(rank->request), &flag, MPI_STATUS_IGNORE) );
+            if (!flag) return 0;
+            rank->started = 0;
+            __atomic_store_n(&(rank->released), b->slots[0].epoch, __ATOMIC_RELEASE);
+        } else {
+            if (__atomic_load_n(&(rank->released), __ATOMIC_ACQUIRE) != epoch + 1) return 0;
+            flag = tryThreadSplitBarrier(b, MYLOCALTHREAD, NULL);
+            assert(flag);
+        }
+        if (result != NULL) *result = rank->result;
+        return 1;
+    }
+  #elif defined USE_PTHREADS || defined _OPENMP
+    static inline void __splitBarrierNotify(int64_t value) {
+        notifyThreadSplitBarrier(__get_split_thread_barrier(), MYTHREAD, value);
+    }
+
+    static inline int __splitBarrierTry(int64_t *result) {
+        return tryThreadSplitBarrier(__get_split_thread_barrier(), MYTHREAD, result);
+    }
+  #else
+    static int64_t _splitBarrierValue;
+
+    static inline void __splitBarrierNotify(int64_t value) {
+        _splitBarrierValue = value;
+    }
+
+    static inline int __splitBarrierTry(int64_t *result) {
+        if (result != NULL) *result = _splitBarrierValue;
+        return 1;
+    }
+  #endif
+
+#endif
+
+#define BARRIER_NOTIFY(value) __splitBarrierNotify(value)
+#define BARRIER_TRY(result) __splitBarrierTry(result)
+static inline void __splitBarrierWait(int64_t *result) {
+    int spins = 0;
+    while (!__splitBarrierTry(result)) {
+        if (++spins % 1000 == 0) sched_yield(); // let oversubscribed threads arrive
+    }
+}
+#define BARRIER_WAIT(result) __splitBarrierWait(result)
+
+
+/*
+ * Hierarchical region timers
+ *
+ * TIMER_START("name") / TIMER_STOP("name") bracket a named region and may be nested.
+ * A region is identified by its name and its enclosing region, so "read" inside "file1"
+ * and "read" inside "file2" are accumulated separately.  Time is accumulated per thread.
+ * TIMER_REPORT() is collective: the threads agree on the list of regions, reduce the count and
+ * the min, max and sum of the seconds spent in each region with ALLREDUCE, and thread 0 prints
+ * count, min, avg, max and imbalance (max/avg).
+ * Compile with -DNO_TIMERS to remove all timer code.
+ *
+ * With -DUSE_PERF_COUNTERS every region also accumulates the hardware counters of
+ * PerfCounters.h (cycles, instructions, cache, branch and dTLB misses) for the calling
+ * thread, and the report adds IPC and misses per 1000 instructions summed over all threads.
+ * Each start/stop then costs a read() system call.  When perf events are not permitted
+ * the counters read as zero and the report marks them n/a.
+ * A thread opens its counters on its first TIMER_START and FINALIZE closes them.
+ */
+#ifdef NO_TIMERS
+
+  #define TIMER_START(name) do { } while (0)
+  #define TIMER_STOP(name) do { } while (0)
+  #define TIMER_REPORT() do { } while (0)
+  static inline void _freeMyTimers() { }
+
+#else
+
+  #ifndef MAX_TIMER_REGIONS
+  #define MAX_TIMER_REGIONS 64
+  #endif
+  #ifndef MAX_TIMER_DEPTH
+  #define MAX_TIMER_DEPTH 16
+  #endif
+  #define TIMER_NAME_LEN 48
+
+  #ifdef USE_PERF_COUNTERS
+    #include "PerfCounters.h"
+  #endif
+
+  typedef struct {
+      char name[TIMER_NAME_LEN];
+      int parent, depth; // parent is the index of the enclosing region, -1 at the top level
+      long long count;
+      double total, start;
+    #ifdef USE_PERF_COUNTERS
+      PerfCounts counters, startCounters;
+    #endif
+  } _TimerRegion;
+
+  typedef struct {
+      int numRegions, depth;
+      int stack[MAX_TIMER_DEPTH];
+      _TimerRegion regions[MAX_TIMER_REGIONS];
+    #ifdef USE_PERF_COUNTERS
+      int perfOpened, perfAvailable;
+      PerfCounterGroup perf;
+    #endif
+  } _TimerTable;
+
+  #ifdef __UPC__
+  static inline _TimerTable *_getMyTimers() {
+      // private statics are per-thread in UPC
+      static _TimerTable _mytimers;
+      return &_mytimers;
+  }
+  #else
+  static inline _TimerTable **_getMyTimersSlot() {
+      static _CP_THREAD_LOCAL _TimerTable *_mytimers = NULL;
+      #if !defined(MPI_VERSION) || defined(_OPENMP)
+        #pragma omp threadprivate(_mytimers)
+      #endif
+      return &_mytimers;
+  }
+  static inline _TimerTable *_getMyTimers() {
+      _TimerTable **_mytimers = _getMyTimersSlot();
+      if (*_mytimers == NULL) {
+          *_mytimers = (_TimerTable*) calloc(1, sizeof(_TimerTable));
+          if (*_mytimers == NULL) DIE("Could not allocate %lld bytes for timers\n", (long long) sizeof(_TimerTable));
+      }
+      return *_mytimers;
+  }
+  #endif
+
+  // closes the perf counters of the calling thread and frees its timers
+  static inline void _freeMyTimers() {
+    #ifdef __UPC__
+      _TimerTable *t = _getMyTimers();
+    #else
+      _TimerTable *t = *_getMyTimersSlot();
+      if (t == NULL) return;
+    #endif
+    #ifdef USE_PERF_COUNTERS
+      if (t->perfOpened) closePerfCounters(&(t->perf));
+      t->perfOpened = t->perfAvailable = 0;
+    #endif
+    #ifndef __UPC__
+      free(t);
+      *_getMyTimersSlot() = NULL;
+    #endif
+  }
+
+  static inline int _findTimerRegion(_TimerTable *t, const char *name, int parent) {
+      int i;
+      for(i = 0; i < t->numRegions; i++) {
+          if (t->regions[i].parent == parent && strncmp(t->regions[i].name, name, TIMER_NAME_LEN-1) == 0) return i;
+      }
+      if (t->numRegions >= MAX_TIMER_REGIONS) DIE("Too many timer regions (%d), increase MAX_TIMER_REGIONS\n", t->numRegions);
+      _TimerRegion *r = t->regions + t->numRegions;
+      strncpy(r->name, name, TIMER_NAME_LEN-1);
+      r->name[TIMER_NAME_LEN-1] = '\0';
+      r->parent = parent;
+      r->depth = t->depth;
+      r->count = 0;
+      r->total = 0.0;
+    #ifdef USE_PERF_COUNTERS
+      memset(&(r->counters), 0, sizeof(PerfCounts));
+    #endif
+      return t->numRegions++;
+  }
+
+  static inline void _startTimer(const char *name) {
+      _TimerTable *t = _getMyTimers();
+      if (t->depth >= MAX_TIMER_DEPTH) DIE("TIMER_START(%s) nested too deeply, increase MAX_TIMER_DEPTH\n", name);
+      int i = _findTimerRegion(t, name, t->depth ? t->stack[t->depth-1] : -1);
+      t->stack[t->depth++] = i;
+    #ifdef USE_PERF_COUNTERS
+      if (!t->perfOpened) {
+          t->perfOpened = 1;
+          t->perfAvailable = openPerfCounters(&(t->perf));
+          if (!t->perfAvailable) LOG(1, "perf_event_open is not permitted, timer regions will not have hardware counters\n");
+      }
+      readPerfCounters(&(t->perf), &(t->regions[i].startCounters));
+    #endif
+      t->regions[i].start = NOW();
+  }
+
+  static inline void _stopTimer(const char *name) {
+      double now = NOW();
+      _TimerTable *t = _getMyTimers();
+      if (t->depth == 0) DIE("TIMER_STOP(%s) without a TIMER_START\n", name);
+      _TimerRegion *r = t->regions + t->stack[--(t->depth)];
+      if (strncmp(r->name, name, TIMER_NAME_LEN-1) != 0) DIE("TIMER_STOP(%s) does not match the open region %s\n", name, r->name);
+      r->total += now - r->start;
+      r->count++;
+    #ifdef USE_PERF_COUNTERS
+      PerfCounts c;
+      int j;
+      readPerfCounters(&(t->perf), &c);
+      for(j = 0; j < NUM_PERF_COUNTERS; j++) r->counters.v[j] += c.v[j] - r->startCounters.v[j];
+    #endif
+  }
+
+  // writes "outer/inner/name" into buf
+  static void _getTimerPath(_TimerTable *t, int i, char *buf, int len) {
+      if (t->regions[i].parent < 0) {
+          snprintf(buf, len, "%s", t->regions[i].name);
+      } else {
+          char parentPath[MAX_TIMER_DEPTH * TIMER_NAME_LEN];
+          _getTimerPath(t, t->regions[i].parent, parentPath, MAX_TIMER_DEPTH * TIMER_NAME_LEN);
+          snprintf(buf, len, "%s/%s", parentPath, t->regions[i].name);
+      }
+  }
+
+  // a region as every thread knows it in the report: its path, and the name and depth it is printed with
+  typedef struct {
+      char path[MAX_TIMER_DEPTH * TIMER_NAME_LEN], name[TIMER_NAME_LEN];
+      int depth;
+  } _ReportedRegion;
+
+  // collective: every thread ends up with the same list of the regions of any thread, in the order thread 0
+  // entered its regions followed by the regions only later threads entered, and mine[i] set to my region for
+  // reported[i] (or -1).  One round per region: the lowest thread with an unlisted region broadcasts its path
+  static int _listTimerRegions(_TimerTable *t, _ReportedRegion *reported, int *mine) {
+      char path[MAX_TIMER_DEPTH * TIMER_NAME_LEN];
+      int listed[MAX_TIMER_REGIONS], numReported = 0, i;
+      for(i = 0; i < t->numRegions; i++) listed[i] = 0;
+      while (1) {
+          int next = -1, root = THREADS;
+          for(i = 0; i < t->numRegions && next < 0; i++) if (!listed[i]) next = i;
+          if (next >= 0) root = MYTHREAD;
+          ALLREDUCE(&root, 1, COLL_INT, COLL_MIN);
+          if (root == THREADS) break;
+          _ReportedRegion r;
+          if (MYTHREAD == root) {
+              _getTimerPath(t, next, r.path, sizeof(r.path));
+              strcpy(r.name, t->regions[next].name);
+              r.depth = t->regions[next].depth;
+          }
+          BROADCAST(&r, sizeof(_ReportedRegion), root);
+          if (numReported == MAX_TIMER_REGIONS) DIE("Too many timer regions to report %s, increase MAX_TIMER_REGIONS\n", r.path);
+          mine[numReported] = -1;
+          for(i = 0; i < t->numRegions; i++) {
+              if (listed[i]) continue;
+              _getTimerPath(t, i, path, sizeof(path));
+              if (strcmp(path, r.path) == 0) { listed[i] = 1; mine[numReported] = i; break; }
+          }
+          reported[numReported++] = r;
+      }
+      return numReported;
+  }
+
+  // collective: reduces count, min, max and sum of the seconds of each region and thread 0 prints them
+  static void _reportTimers() {
+      _TimerTable *t = _getMyTimers();
+      if (t->depth != 0) WARN("TIMER_REPORT called with %d open regions\n", t->depth);
+      _ReportedRegion reported[MAX_TIMER_REGIONS];
+      int mine[MAX_TIMER_REGIONS], numReported = _listTimerRegions(t, reported, mine), m;
+      long long count[MAX_TIMER_REGIONS];
+      double min[MAX_TIMER_REGIONS], max[MAX_TIMER_REGIONS], sum[MAX_TIMER_REGIONS];
+      for(m = 0; m < numReported; m++) {
+          // a thread that never entered a region spent 0 seconds in it
+          count[m] = mine[m] < 0 ? 0 : t->regions[mine[m]].count;
+          min[m] = max[m] = sum[m] = mine[m] < 0 ? 0.0 : t->regions[mine[m]].total;
+      }
+      if (numReported) {
+          ALLREDUCE(count, numReported, COLL_INT64, COLL_SUM);
+          ALLREDUCE(min, numReported, COLL_DOUBLE, COLL_MIN);
+          ALLREDUCE(max, numReported, COLL_DOUBLE, COLL_MAX);
+          ALLREDUCE(sum, numReported, COLL_DOUBLE, COLL_SUM);
+      }
+    #ifdef USE_PERF_COUNTERS
+      PerfCounts counters[MAX_TIMER_REGIONS];
+      int withPerf = t->perfAvailable ? 1 : 0;
+      for(m = 0; m < numReported; m++) {
+          if (mine[m] < 0) memset(counters + m, 0, sizeof(PerfCounts));
+          else counters[m] = t->regions[mine[m]].counters;
+      }
+      if (numReported) ALLREDUCE(counters, numReported * NUM_PERF_COUNTERS, COLL_UINT64, COLL_SUM);
+      ALLREDUCE(&withPerf, 1, COLL_INT, COLL_SUM);
+    #endif
+      if (MYTHREAD) return;
+      FILE *f = getMyLog();
+      fprintf(f, "Timer report over %d threads (seconds)\n%-40s %10s %10s %10s %10s %9s\n", THREADS, "region", "count", "min", "avg", "max", "max/avg");
+      for(m = 0; m < numReported; m++) {
+          _ReportedRegion *r = reported + m;
+          double avg = sum[m] / THREADS;
+          fprintf(f, "%*s%-*s %10lld %10.6f %10.6f %10.6f %9.3f\n", 2*r->depth, "", 40 - 2*r->depth, r->name,
+                  count[m], min[m], avg, max[m], avg > 0.0 ? max[m] / avg : 1.0);
+      }
+    #ifdef USE_PERF_COUNTERS
+      fprintf(f, "Hardware counters summed over %d of %d threads (per 1000 instructions)\n%-40s %8s %12s %12s %12s\n",
+              withPerf, THREADS, "region", "IPC", "cache-miss", "branch-miss", "dTLB-miss");
+      for(m = 0; m < numReported; m++) {
+          _ReportedRegion *r = reported + m;
+          uint64_t *v = counters[m].v;
+          if (v[PERF_INSTRUCTIONS] == 0) {
+              fprintf(f, "%*s%-*s %8s %12s %12s %12s\n", 2*r->depth, "", 40 - 2*r->depth, r->name, "n/a", "n/a", "n/a", "n/a");
+              continue;
+          }
+          double kinst = v[PERF_INSTRUCTIONS] / 1000.0;
+          fprintf(f, "%*s%-*s %8.3f %12.3f %12.3f %12.3f\n", 2*r->depth, "", 40 - 2*r->depth, r->name,
+                  v[PERF_CYCLES] ? (double) v[PERF_INSTRUCTIONS] / v[PERF_CYCLES] : 0.0,
+                  v[PERF_CACHE_MISSES] / kinst, v[PERF_BRANCH_MISSES] / kinst, v[PERF_DTLB_MISSES] / kinst);
+      }
+    #endif
+      fflush(f);
+  }
+
+  #define TIMER_START(name) _startTimer(name)
+  #define TIMER_STOP(name) _stopTimer(name)
+  #define TIMER_REPORT() _reportTimers()
+
+#endif // NO_TIMERS
+
+
 #if defined (__cplusplus)
 }
 #endif
@@ -0,0 +1,367 @@
+#ifndef DIST_HASH_MAP_H_
+#define DIST_HASH_MAP_H_
+
+/*
+ * Distributed hash map of 64 bit keys to 64 bit values, on top of CommonParallel.h and SharedHeap.h
+ *
+ * Every key has one owner thread, chosen by its hash, and only the owner touches the open addressing
+ * (linear probing) table that holds it, so no table operation needs an atomic.
+ * updateDistHashMap(map, key, value) combines value into the key's entry with the op of the map
+ * (DIST_HASH_ADD counts k-mers).  Updates of keys owned by another thread wait in a batch per
+ * destination: a full batch reserves room in the owner's inbox, a SharedHeap of inboxSize entries on
+ * the owner, with one ATOMIC_FETCHADD and is put there in one SHARED_MEMPUT.  When an inbox is full the
+ * batch keeps growing until the next flushDistHashMap.
+ * flushDistHashMap(map) is collective: it runs rounds of shipping the batches, a BARRIER and every
+ * owner applying its inbox, until no thread has anything left.  Updates are only visible after it.
+ * lookupDistHashMap(map, keys, values, found, n) is a collective bulk lookup: the queries go to their
+ * owners in batches like the updates, and the answers come back the same way.
+ * The entries of a thread's own table are visited with nextLocalDistHashEntry.
+ *
+ * The key DIST_HASH_EMPTY_KEY is reserved.  In hybrid MPI+OpenMP builds SharedHeap has one owner per
+ * rank, not per thread, so the map is only for the UPC, MPI, OpenMP, pthreads and serial backends.
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CommonParallel.h"
+#include "SharedHeap.h"
+
+#if defined MPI_VERSION && defined _OPENMP
+#error "DistHashMap.h needs a SharedHeap owner per thread, which the hybrid MPI+OpenMP mode does not have"
+#endif
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+#ifndef DIST_HASH_BATCH_SIZE
+#define DIST_HASH_BATCH_SIZE 1024
+#endif
+#ifndef DIST_HASH_INBOX_SIZE
+#define DIST_HASH_INBOX_SIZE (1 << 16)
+#endif
+
+#define DIST_HASH_EMPTY_KEY UINT64_MAX
+// a lookup query carries the thread and the index of the key that asked
+#define DIST_HASH_QUERY_INDEX_BITS 40
+#define DIST_HASH_QUERY_INDEX_MASK ((((uint64_t) 1) << DIST_HASH_QUERY_INDEX_BITS) - 1)
+#define DIST_HASH_FOUND_BIT (((uint64_t) 1) << 63)
+
+typedef enum { DIST_HASH_ADD, DIST_HASH_SET, DIST_HASH_MAX } DistHashOp;
+
+typedef struct {
+  uint64_t key, value;
+} DistHashEntry;
+
+// the batch of entries waiting for one destination
+typedef struct {
+  DistHashEntry *entries;
+  size_t count, max;
+  int full; // the owner's inbox had no room, wait for the next flush
+} _DistHashOutbox;
+
+typedef struct _DistHashMap *DistHashMap;
+typedef void (*_DistHashApply)(DistHashMap map, const DistHashEntry *entries, size_t count);
+
+struct _DistHashMap {
+  DistHashEntry *table; // capacity is a power of 2
+  size_t capacity, size;
+  DistHashOp op;
+  size_t batchSize, inboxSize;
+  SharedHeap *inboxes;  // one per thread, owned by that thread
+  SharedPtr *inboxCounts, *inboxEntries;
+  _DistHashOutbox *outboxes, *replies; // one per thread
+  uint64_t *lookupValues; // of the lookup in progress
+  char *lookupFound;
+  size_t lookupCount, lookupHits;
+};
+
+// the murmur3 finalizer
+static inline uint64_t _hashDistHashMap(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+// the owner comes from the high bits and the slot from the low bits of the hash
+static inline int getDistHashOwner(uint64_t key) {
+  return (int) ((_hashDistHashMap(key) >> 32) % THREADS);
+}
+
+static DistHashEntry *_allocDistHashTable(size_t capacity) {
+  DistHashEntry *table = (DistHashEntry *) malloc(capacity * sizeof(DistHashEntry));
+  size_t i;
+  if (table == NULL) DIE("Could not allocate a DistHashMap table of %lld entries\n", (long long) capacity);
+  for(i = 0; i < capacity; i++) table[i].key = DIST_HASH_EMPTY_KEY;
+  return table;
+}
+
+// the slot of key, or the empty slot where it belongs
+static inline DistHashEntry *_findDistHashEntry(DistHashEntry *table, size_t capacity, uint64_t key) {
+  size_t mask = capacity - 1, slot = _hashDistHashMap(key) & mask;
+  while (table[slot].key != key && table[slot].key != DIST_HASH_EMPTY_KEY) slot = (slot + 1) & mask;
+  return table + slot;
+}
+
+// doubles the table
+static void _growDistHashMap(DistHashMap map) {
+  size_t i, capacity = map->capacity * 2;
+  DistHashEntry *table = _allocDistHashTable(capacity);
+  for(i = 0; i < map->capacity; i++) {
+    if (map->table[i].key != DIST_HASH_EMPTY_KEY) *_findDistHashEntry(table, capacity, map->table[i].key) = map->table[i];
+  }
+  free(map->table);
+  map->table = table;
+  map->capacity = capacity;
+  LOG(2, "Thread %d: grew DistHashMap to %lld entries\n", MYTHREAD, (long long) capacity);
+}
+
+// combines value into the local entry of key, keeping the load at most 70%
+static inline void _updateLocalDistHashMap(DistHashMap map, uint64_t key, uint64_t value) {
+  DistHashEntry *entry = _findDistHashEntry(map->table, map->capacity, key);
+  if (entry->key == DIST_HASH_EMPTY_KEY) {
+    if (10 * (map->size + 1) > 7 * map->capacity) {
+      _growDistHashMap(map);
+      entry = _findDistHashEntry(map->table, map->capacity, key);
+    }
+    entry->key = key;
+    entry->value = value;
+    map->size++;
+    return;
+  }
+  switch(map->op) {
+    case DIST_HASH_ADD: entry->value += value; break;
+    case DIST_HASH_SET: entry->value = value; break;
+    case DIST_HASH_MAX: if (value > entry->value) entry->value = value; break;
+  }
+}
+
+static void _applyUpdatesDistHashMap(DistHashMap map, const DistHashEntry *entries, size_t count) {
+  size_t i;
+  for(i = 0; i < count; i++) _updateLocalDistHashMap(map, entries[i].key, entries[i].value);
+}
+
+static inline void _pushDistHashOutbox(_DistHashOutbox *outbox, uint64_t key, uint64_t value) {
+  if (outbox->count == outbox->max) {
+    outbox->max *= 2;
+    outbox->entries = (DistHashEntry *) realloc(outbox->entries, outbox->max * sizeof(DistHashEntry));
+    if (outbox->entries == NULL) DIE("Could not grow a DistHashMap batch to %lld entries\n", (long long) outbox->max);
+  }
+  outbox->entries[outbox->count].key = key;
+  outbox->entries[outbox->count].value = value;
+  outbox->count++;
+}
+
+// moves as much of the batch as fits into the owner's inbox
+static void _shipDistHashOutbox(DistHashMap map, _DistHashOutbox *outbox, int owner) {
+  size_t count = outbox->count, fits;
+  if (count == 0 || outbox->full) return;
+  uint64_t start = ATOMIC_FETCHADD(map->inboxCounts[owner], count);
+  if (start >= map->inboxSize) {
+    outbox->full = 1;
+    return;
+  }
+  fits = map->inboxSize - start < count ? map->inboxSize - start : count;
+  SHARED_MEMPUT(SHARED_PTR_ADD(map->inboxEntries[owner], start * sizeof(DistHashEntry)), outbox->entries, fits * sizeof(DistHashEntry));
+  if (fits < count) {
+    memmove(outbox->entries, outbox->entries + fits, (count - fits) * sizeof(DistHashEntry));
+    outbox->full = 1;
+  }
+  outbox->count = count - fits;
+}
+
+// collective: delivers every batch of outboxes and applies them on their owners
+static void _drainDistHashMap(DistHashMap map, _DistHashOutbox *outboxes, _DistHashApply apply) {
+  int t;
+  uint64_t pending;
+  do {
+    for(t = 0; t < THREADS; t++) _shipDistHashOutbox(map, outboxes + t, t);
+    for(t = 0; t < THREADS; t++) SHARED_HEAP_FLUSH(map->inboxes[t]);
+    BARRIER;
+    // nobody reserves in the inboxes until the ALLREDUCE below
+    uint64_t count = ATOMIC_SWAP(map->inboxCounts[MYTHREAD], 0);
+    if (count > map->inboxSize) count = map->inboxSize;
+    if (count > 0) apply(map, (const DistHashEntry *) SHARED_PTR_LOCAL(map->inboxEntries[MYTHREAD]), count);
+    pending = 0;
+    for(t = 0; t < THREADS; t++) {
+      pending += outboxes[t].count;
+      outboxes[t].full = 0;
+    }
+    ALLREDUCE(&pending, 1, COLL_UINT64, COLL_SUM);
+  } while (pending > 0);
+}
+
+/* collective: room for about expectedKeys keys per thread, batches of batchSize entries and inboxes
+ * of inboxSize entries (0 for DIST_HASH_BATCH_SIZE and DIST_HASH_INBOX_SIZE) */
+static DistHashMap initDistHashMap(size_t expectedKeys, DistHashOp op, size_t batchSize, size_t inboxSize) {
+  DistHashMap map = (DistHashMap) calloc(1, sizeof(struct _DistHashMap));
+  int t;
+  if (map == NULL) DIE("Could not allocate a DistHashMap\n");
+  map->capacity = 16;
+  while (10 * expectedKeys > 7 * map->capacity) map->capacity *= 2;
+  map->table = _allocDistHashTable(map->capacity);
+  map->op = op;
+  map->batchSize = batchSize > 0 ? batchSize : DIST_HASH_BATCH_SIZE;
+  map->inboxSize = inboxSize > 0 ? inboxSize : DIST_HASH_INBOX_SIZE;
+  if (map->inboxSize < map->batchSize) map->inboxSize = map->batchSize;
+  map->inboxes = (SharedHeap *) calloc(THREADS, sizeof(SharedHeap));
+  map->inboxCounts = (SharedPtr *) calloc(THREADS, sizeof(SharedPtr));
+  map->inboxEntries = (SharedPtr *) calloc(THREADS, sizeof(SharedPtr));
+  map->outboxes = (_DistHashOutbox *) calloc(THREADS, sizeof(_DistHashOutbox));
+  map->replies = (_DistHashOutbox *) calloc(THREADS, sizeof(_DistHashOutbox));
+  if (map->inboxes == NULL || map->inboxCounts == NULL || map->inboxEntries == NULL || map->outboxes == NULL || map->replies == NULL)
+    DIE("Could not allocate a DistHashMap for %d threads\n", THREADS);
+  for(t = 0; t < THREADS; t++) {
+    map->outboxes[t].max = map->replies[t].max = map->batchSize;
+    map->outboxes[t].entries = (DistHashEntry *) malloc(map->batchSize * sizeof(DistHashEntry));
+    map->replies[t].entries = (DistHashEntry *) malloc(map->batchSize * sizeof(DistHashEntry));
+    if (map->outboxes[t].entries == NULL || map->replies[t].entries == NULL) DIE("Could not allocate the DistHashMap batches\n");
+  }
+
+  // the inbox of each thread is its counter followed by the entries
+  for(t = 0; t < THREADS; t++) {
+    size_t blocks = map->inboxSize + 1;
+    INIT_SHARED_HEAP(inbox, blocks, sizeof(DistHashEntry), t);
+    SharedPtr counter, entries;
+    if (MYTHREAD == t) {
+      ALLOC_FROM_SHARED_HEAP(inbox, char, c, sizeof(DistHashEntry));
+      ALLOC_FROM_SHARED_HEAP(inbox, char, e, map->inboxSize * sizeof(DistHashEntry));
+      ATOMIC_SWAP(c, 0);
+      counter = c;
+      entries = e;
+    }
+    BROADCAST_SHARED_PTR(inbox, counter, t);
+    BROADCAST_SHARED_PTR(inbox, entries, t);
+    map->inboxes[t] = inbox;
+    map->inboxCounts[t] = counter;
+    map->inboxEntries[t] = entries;
+  }
+  BARRIER;
+  return map;
+}
+
+/* collective */
+static void freeDistHashMap(DistHashMap map) {
+  int t;
+  assert(map != NULL);
+  for(t = 0; t < THREADS; t++) {
+    SharedHeap inbox = map->inboxes[t];
+    FREE_SHARED_HEAP(inbox);
+    free(map->outboxes[t].entries);
+    free(map->replies[t].entries);
+  }
+  free(map->inboxes);
+  free(map->inboxCounts);
+  free(map->inboxEntries);
+  free(map->outboxes);
+  free(map->replies);
+  free(map->table);
+  free(map);
+}
+
+// combines value into key with the op of the map, visible after the next flushDistHashMap
+static inline void updateDistHashMap(DistHashMap map, uint64_t key, uint64_t value) {
+  int owner = getDistHashOwner(key);
+  if (key == DIST_HASH_EMPTY_KEY) DIE("DIST_HASH_EMPTY_KEY can not be stored in a DistHashMap\n");
+  if (owner == MYTHREAD) {
+    _updateLocalDistHashMap(map, key, value);
+    return;
+  }
+  _DistHashOutbox *outbox = map->outboxes + owner;
+  _pushDistHashOutbox(outbox, key, value);
+  if (outbox->count >= map->batchSize) _shipDistHashOutbox(map, outbox, owner);
+}
+
+/* collective: applies every update made before it */
+static void flushDistHashMap(DistHashMap map) {
+  _drainDistHashMap(map, map->outboxes, _applyUpdatesDistHashMap);
+}
+
+// the owner answers queries into the replies, which go back after all the queries are answered
+static void _answerQueriesDistHashMap(DistHashMap map, const DistHashEntry *entries, size_t count) {
+  size_t i;
+  for(i = 0; i < count; i++) {
+    DistHashEntry *entry = _findDistHashEntry(map->table, map->capacity, entries[i].key);
+    uint64_t index = entries[i].value & DIST_HASH_QUERY_INDEX_MASK;
+    int thread = (int) (entries[i].value >> DIST_HASH_QUERY_INDEX_BITS);
+    if (entry->key == DIST_HASH_EMPTY_KEY) _pushDistHashOutbox(map->replies + thread, index, 0);
+    else _pushDistHashOutbox(map->replies + thread, index | DIST_HASH_FOUND_BIT, entry->value);
+  }
+}
+
+static void _applyRepliesDistHashMap(DistHashMap map, const DistHashEntry *entries, size_t count) {
+  size_t i;
+  for(i = 0; i < count; i++) {
+    uint64_t index = entries[i].key & ~DIST_HASH_FOUND_BIT;
+    assert(index < map->lookupCount);
+    int hit = (entries[i].key & DIST_HASH_FOUND_BIT) != 0;
+    map->lookupValues[index] = entries[i].value;
+    if (map->lookupFound != NULL) map->lookupFound[index] = hit;
+    map->lookupHits += hit;
+  }
+}
+
+/* collective: values[i] of keys[i] (0 when missing, and found[i] says which, unless found is NULL)
+ * after flushing the pending updates, returns how many of the n keys were found */
+static size_t lookupDistHashMap(DistHashMap map, const uint64_t *keys, uint64_t *values, char *found, size_t n) {
+  size_t i, numFound;
+  if (n > DIST_HASH_QUERY_INDEX_MASK) DIE("Can not look up more than %lld keys at once\n", (long long) DIST_HASH_QUERY_INDEX_MASK);
+  flushDistHashMap(map);
+  map->lookupValues = values;
+  map->lookupFound = found;
+  map->lookupCount = n;
+  map->lookupHits = 0;
+  for(i = 0; i < n; i++) {
+    int owner = getDistHashOwner(keys[i]);
+    if (owner == MYTHREAD) {
+      DistHashEntry *entry = _findDistHashEntry(map->table, map->capacity, keys[i]);
+      values[i] = entry->key == DIST_HASH_EMPTY_KEY ? 0 : entry->value;
+      if (found != NULL) found[i] = entry->key != DIST_HASH_EMPTY_KEY;
+      map->lookupHits += entry->key != DIST_HASH_EMPTY_KEY;
+      continue;
+    }
+    _DistHashOutbox *outbox = map->outboxes + owner;
+    _pushDistHashOutbox(outbox, keys[i], (((uint64_t) MYTHREAD) << DIST_HASH_QUERY_INDEX_BITS) | i);
+    if (outbox->count >= map->batchSize) _shipDistHashOutbox(map, outbox, owner);
+  }
+  _drainDistHashMap(map, map->outboxes, _answerQueriesDistHashMap);
+  _drainDistHashMap(map, map->replies, _applyRepliesDistHashMap);
+  numFound = map->lookupHits;
+  map->lookupValues = NULL;
+  map->lookupFound = NULL;
+  map->lookupCount = map->lookupHits = 0;
+  return numFound;
+}
+
+// the number of keys this thread owns
+static inline size_t getLocalDistHashMapSize(DistHashMap map) {
+  return map->size;
+}
+
+/* collective: the number of keys in the map */
+static uint64_t getDistHashMapSize(DistHashMap map) {
+  uint64_t size = map->size;
+  ALLREDUCE(&size, 1, COLL_UINT64, COLL_SUM);
+  return size;
+}
+
+// visits the entries this thread owns: start with *iter = 0, returns NULL after the last one
+static inline DistHashEntry *nextLocalDistHashEntry(DistHashMap map, size_t *iter) {
+  while (*iter < map->capacity) {
+    DistHashEntry *entry = map->table + (*iter)++;
+    if (entry->key != DIST_HASH_EMPTY_KEY) return entry;
+  }
+  return NULL;
+}
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif // DIST_HASH_MAP_H_
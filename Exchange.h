@@ -0,0 +1,252 @@
+#ifndef EXCHANGE_H_
+#define EXCHANGE_H_
+
+/*
+ * All to all personalized exchange of fixed size records, streamed in rounds under a memory cap
+ *
+ * pushExchange(ex, thread) returns room for one record to thread in that destination's send buffer.
+ * exchangeRound(ex, moreInput, &received, &count) is collective: every thread tells every other one how
+ * many records it has for it (ALLTOALL), each receiver grants at most memoryCap bytes in total, taking
+ * the senders in an order that rotates every round, and tells the senders where their records go
+ * (ALLTOALL), then the granted records move in one bulk transfer:
+ *   MPI          MPI_Alltoallv
+ *   UPC          upc_memput straight into the receiver's shared buffer, then upc_barrier
+ *   OpenMP etc.  memcpy straight into the receiver's buffer, then BARRIER
+ * What was not granted stays for the next round.  received holds count records, grouped by sender in
+ * thread order, until the next round.  exchangeRound returns nonzero while any thread still has
+ * records to send or passed moreInput, so the caller keeps pushing until isExchangeFull and calls
+ * rounds until it returns 0:
+ *   do {
+ *     while (i < n && !isExchangeFull(ex)) memcpy(pushExchange(ex, owner(i)), records + i, size);
+ *     more = exchangeRound(ex, i < n, &received, &count);
+ *     ... use the count records of received ...
+ *   } while (more);
+ * The send buffers are full once they hold memoryCap bytes, but pushExchange still grows them.
+ * In hybrid MPI+OpenMP builds only the master thread makes MPI calls, which the bulk transfer does
+ * not allow for, so the exchange is only for the UPC, MPI, OpenMP, pthreads and serial backends.
+ */
+
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CommonParallel.h"
+
+#if defined MPI_VERSION && defined _OPENMP
+#error "Exchange.h does not support the hybrid MPI+OpenMP mode"
+#endif
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+#ifndef EXCHANGE_MEMORY_CAP
+#define EXCHANGE_MEMORY_CAP (16 << 20)
+#endif
+
+// what a receiver grants one sender in a round
+typedef struct {
+  uint64_t count, offset; // records, and where they go in the receiver's buffer
+} _ExchangeGrant;
+
+// the records waiting for one destination
+typedef struct {
+  char *records;
+  size_t count, max;
+} _ExchangeBuffer;
+
+typedef struct _Exchange *Exchange;
+struct _Exchange {
+  size_t recordSize, memoryCap, capRecords, used; // used bytes of the send buffers
+  int round;
+  _ExchangeBuffer *buffers; // one per thread
+  uint64_t *counts, *incoming;  // records for each thread, and from each thread
+  _ExchangeGrant *grants, *granted; // to each sender, and from each receiver
+#ifdef __UPC__
+  shared [] char *received;
+  shared [] char **receivers; // the buffer of every thread
+#else
+  char *received;
+  #ifdef MPI_VERSION
+    char *packed;
+    size_t packedMax;
+    int *sendCounts, *sendDispls, *recvCounts, *recvDispls;
+  #else
+    char **receivers;
+  #endif
+#endif
+};
+
+/* collective: records of recordSize bytes, at most memoryCap bytes (0 for EXCHANGE_MEMORY_CAP) received per round */
+static Exchange initExchange(size_t recordSize, size_t memoryCap) {
+  Exchange ex = (Exchange) calloc(1, sizeof(struct _Exchange));
+  if (ex == NULL || recordSize == 0) DIE("Could not allocate an Exchange of %lld byte records\n", (long long) recordSize);
+  ex->recordSize = recordSize;
+  ex->memoryCap = memoryCap > 0 ? memoryCap : EXCHANGE_MEMORY_CAP;
+  ex->capRecords = ex->memoryCap / recordSize > 0 ? ex->memoryCap / recordSize : 1;
+  ex->buffers = (_ExchangeBuffer *) calloc(THREADS, sizeof(_ExchangeBuffer));
+  ex->counts = (uint64_t *) calloc(THREADS, sizeof(uint64_t));
+  ex->incoming = (uint64_t *) calloc(THREADS, sizeof(uint64_t));
+  ex->grants = (_ExchangeGrant *) calloc(THREADS, sizeof(_ExchangeGrant));
+  ex->granted = (_ExchangeGrant *) calloc(THREADS, sizeof(_ExchangeGrant));
+  if (ex->buffers == NULL || ex->counts == NULL || ex->incoming == NULL || ex->grants == NULL || ex->granted == NULL)
+    DIE("Could not allocate an Exchange for %d threads\n", THREADS);
+#ifdef __UPC__
+  ex->received = (shared [] char *) upc_alloc(ex->capRecords * recordSize);
+  ex->receivers = (shared [] char **) malloc(THREADS * sizeof(shared [] char *));
+  if (ex->received == NULL || ex->receivers == NULL) DIE("Could not allocate %lld bytes for an Exchange\n", (long long) ex->memoryCap);
+  ALLGATHER(&(ex->received), ex->receivers, sizeof(shared [] char *));
+#else
+  ex->received = (char *) allocNumaLocal(ex->capRecords * recordSize); // senders write it, on the receiver's node
+  if (ex->received == NULL) DIE("Could not allocate %lld bytes for an Exchange\n", (long long) ex->memoryCap);
+  #ifdef MPI_VERSION
+    ex->packedMax = ex->capRecords * recordSize;
+    ex->packed = (char *) malloc(ex->packedMax);
+    ex->sendCounts = (int *) calloc(4 * THREADS, sizeof(int));
+    if (ex->packed == NULL || ex->sendCounts == NULL) DIE("Could not allocate %lld bytes for an Exchange\n", (long long) ex->memoryCap);
+    ex->sendDispls = ex->sendCounts + THREADS;
+    ex->recvCounts = ex->sendDispls + THREADS;
+    ex->recvDispls = ex->recvCounts + THREADS;
+    if (ex->capRecords * recordSize > INT_MAX) DIE("The memory cap of an Exchange must be below %d bytes with MPI\n", INT_MAX);
+  #else
+    ex->receivers = (char **) malloc(THREADS * sizeof(char *));
+    if (ex->receivers == NULL) DIE("Could not allocate an Exchange for %d threads\n", THREADS);
+    ALLGATHER(&(ex->received), ex->receivers, sizeof(char *));
+  #endif
+#endif
+  return ex;
+}
+
+/* collective */
+static void freeExchange(Exchange ex) {
+  int t;
+  assert(ex != NULL);
+  BARRIER; // nobody is still putting into the buffers
+  for(t = 0; t < THREADS; t++) free(ex->buffers[t].records);
+#ifdef __UPC__
+  upc_free(ex->received);
+  free(ex->receivers);
+#else
+  freeNuma(ex->received, ex->capRecords * ex->recordSize);
+  #ifdef MPI_VERSION
+    free(ex->packed);
+    free(ex->sendCounts);
+  #else
+    free(ex->receivers);
+  #endif
+#endif
+  free(ex->buffers);
+  free(ex->counts);
+  free(ex->incoming);
+  free(ex->grants);
+  free(ex->granted);
+  free(ex);
+}
+
+// room for one record to thread, valid until the next push or round
+static inline void *pushExchange(Exchange ex, int thread) {
+  _ExchangeBuffer *buffer = ex->buffers + thread;
+  assert(thread >= 0 && thread < THREADS);
+  if (buffer->count == buffer->max) {
+    buffer->max = buffer->max > 0 ? 2 * buffer->max : 64;
+    buffer->records = (char *) realloc(buffer->records, buffer->max * ex->recordSize);
+    if (buffer->records == NULL) DIE("Could not grow an Exchange buffer to %lld records\n", (long long) buffer->max);
+  }
+  ex->used += ex->recordSize;
+  return buffer->records + ex->recordSize * buffer->count++;
+}
+
+// the send buffers hold memoryCap bytes
+static inline int isExchangeFull(Exchange ex) {
+  return ex->used >= ex->memoryCap;
+}
+
+// grants up to capRecords, starting from a sender that moves every round so that none is starved
+static size_t _grantExchange(Exchange ex) {
+  size_t remaining = ex->capRecords, offset = 0;
+  int i, t;
+  for(i = 0; i < THREADS; i++) {
+    t = (MYTHREAD + ex->round + i) % THREADS;
+    ex->grants[t].count = ex->incoming[t] < remaining ? ex->incoming[t] : remaining;
+    remaining -= ex->grants[t].count;
+  }
+  // in thread order in the buffer
+  for(t = 0; t < THREADS; t++) {
+    ex->grants[t].offset = offset;
+    offset += ex->grants[t].count;
+  }
+  return offset;
+}
+
+// drops the first count records of a send buffer
+static void _consumeExchangeBuffer(Exchange ex, _ExchangeBuffer *buffer, size_t count) {
+  if (count == 0) return;
+  if (count < buffer->count) memmove(buffer->records, buffer->records + count * ex->recordSize, (buffer->count - count) * ex->recordSize);
+  buffer->count -= count;
+  ex->used -= count * ex->recordSize;
+}
+
+/* collective: one round of the exchange, returns nonzero while any thread has more to send */
+static int exchangeRound(Exchange ex, int moreInput, void **received, size_t *count) {
+  int t, more;
+  size_t numReceived;
+  for(t = 0; t < THREADS; t++) ex->counts[t] = ex->buffers[t].count;
+  ALLTOALL(ex->counts, ex->incoming, sizeof(uint64_t));
+  numReceived = _grantExchange(ex);
+  ALLTOALL(ex->grants, ex->granted, sizeof(_ExchangeGrant));
+
+#ifdef MPI_VERSION
+  // every receiver grants up to memoryCap, so what this thread sends can add up to more
+  size_t packed = 0;
+  for(t = 0; t < THREADS; t++) packed += ex->granted[t].count * ex->recordSize;
+  if (packed > INT_MAX) DIE("Thread %d: can not send %lld bytes in one MPI_Alltoallv, lower the memory cap of the Exchange\n", MYTHREAD, (long long) packed);
+  if (packed > ex->packedMax) {
+    ex->packedMax = packed;
+    free(ex->packed);
+    if ((ex->packed = (char *) malloc(packed)) == NULL) DIE("Could not allocate %lld bytes for an Exchange\n", (long long) packed);
+  }
+  packed = 0;
+  for(t = 0; t < THREADS; t++) {
+    size_t bytes = ex->granted[t].count * ex->recordSize;
+    memcpy(ex->packed + packed, ex->buffers[t].records, bytes);
+    ex->sendCounts[t] = (int) bytes;
+    ex->sendDispls[t] = (int) packed;
+    ex->recvCounts[t] = (int) (ex->grants[t].count * ex->recordSize);
+    ex->recvDispls[t] = (int) (ex->grants[t].offset * ex->recordSize);
+    packed += bytes;
+  }
+  CHECK_MPI( MPI_Alltoallv(ex->packed, ex->sendCounts, ex->sendDispls, MPI_BYTE, ex->received, ex->recvCounts, ex->recvDispls, MPI_BYTE, MPI_COMM_WORLD) );
+#else
+  // start with the next thread so that not everyone writes to thread 0 at once
+  for(t = 1; t <= THREADS; t++) {
+    int dest = (MYTHREAD + t) % THREADS;
+    size_t bytes = ex->granted[dest].count * ex->recordSize;
+    if (bytes == 0) continue;
+  #ifdef __UPC__
+    upc_memput(ex->receivers[dest] + ex->granted[dest].offset * ex->recordSize, ex->buffers[dest].records, bytes);
+  #else
+    memcpy(ex->receivers[dest] + ex->granted[dest].offset * ex->recordSize, ex->buffers[dest].records, bytes);
+  #endif
+  }
+  BARRIER;
+#endif
+
+  more = moreInput != 0;
+  for(t = 0; t < THREADS; t++) {
+    _consumeExchangeBuffer(ex, ex->buffers + t, ex->granted[t].count);
+    if (ex->buffers[t].count > 0) more = 1;
+  }
+  ALLREDUCE(&more, 1, COLL_INT, COLL_MAX);
+  ex->round++;
+  *received = (void *) (char *) ex->received;
+  *count = numReceived;
+  return more;
+}
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif // EXCHANGE_H_
@@ -22,7 +22,7 @@ size_t get_file_size(const char *fname)
     return s.st_size;
 }
 
-FileMap initFileMap(const char *filename, const char *mode, int myPartition, int numPartitions) {
+static FileMap openFileMap(const char *filename, const char *mode) {
     FileMap fm = (FileMap) calloc(sizeof(_FileMap), 1);
     if (!fm) DIE("Could not calloc a FileMap");
     fm->filesize = get_file_size(filename);
@@ -32,12 +32,12 @@ FileMap initFileMap(const char *filename, const char *mode, int myPartition, int
     fm->filename = strdup(filename);
     fm->myPartition = 0;
     fm->numPartitions = 0;
-    if (numPartitions > 1) {
-        setMyPartitionFileMap(fm, myPartition, numPartitions);
-    } else {
-        fm->myStart = 0;
-        fm->myEnd = fm->filesize;
-    }
+    fm->myStart = 0;
+    fm->myEnd = fm->filesize;
+    return fm;
+}
+
+static void mmapFileMap(FileMap fm) {
 #ifdef NO_MMAP
     fm->addr = NULL;
 #else
@@ -45,10 +45,29 @@ FileMap initFileMap(const char *filename, const char *mode, int myPartition, int
     size_t size = fm->myEnd - fm->myStart;
     if (size > 0) {
         fm->addr = mmap(NULL, size + fm->blockOffset, PROT_READ, MAP_FILE | MAP_SHARED, fileno(fm->fh), fm->myStart - fm->blockOffset);
+        // start readahead from the owning thread, so the page cache of its window is allocated on its NUMA node
+        if (fm->addr != MAP_FAILED) posix_madvise(fm->addr, size + fm->blockOffset, POSIX_MADV_WILLNEED);
     } else {
         fm->addr = NULL;
     }
 #endif
+}
+
+FileMap initFileMap(const char *filename, const char *mode, int myPartition, int numPartitions) {
+    FileMap fm = openFileMap(filename, mode);
+    if (numPartitions > 1) {
+        setMyPartitionFileMap(fm, myPartition, numPartitions);
+    }
+    mmapFileMap(fm);
+    return fm;
+}
+
+FileMap initHierarchicalFileMap(const char *filename, const char *mode, int myRank, int numRanks, int myThread, int numThreads) {
+    FileMap fm = openFileMap(filename, mode);
+    if (numRanks * numThreads > 1) {
+        setMyHierarchicalPartitionFileMap(fm, myRank, numRanks, myThread, numThreads);
+    }
+    mmapFileMap(fm);
     return fm;
 }
 
@@ -81,40 +100,38 @@ int closeFileMap(FileMap fm) {
     return ret;
 }
 
-void setMyPartitionFileMap(FileMap fm, int myPartition, int numPartitions) {
-    assert(fm != NULL);
-    assert(fm->filesize > 0);
-    if (myPartition != fm->myPartition || numPartitions != fm->numPartitions) {
-        size_t blockSize = (fm->filesize + numPartitions - 1) / numPartitions;
-        fm->myStart = blockSize * myPartition;
-        fm->myEnd = fm->myStart + blockSize;
-        assert(fm->myStart <= fm->filesize);
-        if (fm->myStart >= fm->filesize) {
-            fm->myStart = fm->filesize;
-        }
-        if (fm->myEnd >= fm->filesize) {
-            fm->myEnd = fm->filesize;
-        }
-        if (myPartition < numPartitions-1 && fm->myEnd < fm->filesize) {
-            seekFileMap(fm, fm->myEnd);
-            // read next line
-            fgetsFileMap(fm);
-            fm->myEnd = fm->myPos - 1;
-        }
+// sets myStart and myEnd to the line aligned partition of the bytes from rangeStart to rangeEnd
+static void setPartitionRangeFileMap(FileMap fm, size_t rangeStart, size_t rangeEnd, int myPartition, int numPartitions) {
+    size_t blockSize = (rangeEnd - rangeStart + numPartitions - 1) / numPartitions;
+    fm->myStart = rangeStart + blockSize * myPartition;
+    fm->myEnd = fm->myStart + blockSize;
+    assert(fm->myStart <= fm->filesize);
+    if (fm->myStart >= rangeEnd) {
+        fm->myStart = rangeEnd;
+    }
+    if (fm->myEnd >= rangeEnd) {
+        fm->myEnd = rangeEnd;
+    }
+    if (myPartition < numPartitions-1 && fm->myEnd < rangeEnd) {
+        seekFileMap(fm, fm->myEnd);
+        // read next line
+        fgetsFileMap(fm);
+        fm->myEnd = fm->myPos - 1;
+    }
 
-        if (myPartition && fm->myStart < fm->myEnd) {
-            seekFileMap(fm, fm->myStart);
-            // read next line
-            fgetsFileMap(fm);
-            fm->myStart = fm->myPos;
-        } else if (myPartition == 0) {
-            assert(fm->myStart == 0);
-        } else {
-            fm->myStart = fm->myPos = fm->myEnd;
-        }
-        fm->myPartition = myPartition;
-        fm->numPartitions = numPartitions;
+    if (myPartition && fm->myStart < fm->myEnd) {
+        seekFileMap(fm, fm->myStart);
+        // read next line
+        fgetsFileMap(fm);
+        fm->myStart = fm->myPos;
+    } else if (myPartition == 0) {
+        assert(fm->myStart == rangeStart);
+    } else {
+        fm->myStart = fm->myPos = fm->myEnd;
     }
+}
+
+static void advisePartitionFileMap(FileMap fm) {
     seekFileMap(fm, fm->myStart);
     size_t offset = fm->myStart % BLOCK_SIZE;
     size_t adviseStart = fm->myStart - offset, adviseLen = fm->myEnd - fm->myStart + offset;
@@ -135,6 +152,36 @@ void setMyPartitionFileMap(FileMap fm, int myPartition, int numPartitions) {
 #endif
 }
 
+void setMyPartitionFileMap(FileMap fm, int myPartition, int numPartitions) {
+    assert(fm != NULL);
+    assert(fm->filesize > 0);
+    if (myPartition != fm->myPartition || numPartitions != fm->numPartitions) {
+        setPartitionRangeFileMap(fm, 0, fm->filesize, myPartition, numPartitions);
+        fm->myPartition = myPartition;
+        fm->numPartitions = numPartitions;
+    }
+    advisePartitionFileMap(fm);
+}
+
+// splits the file between the ranks first and then the rank's range between its threads
+void setMyHierarchicalPartitionFileMap(FileMap fm, int myRank, int numRanks, int myThread, int numThreads) {
+    assert(fm != NULL);
+    assert(fm->filesize > 0);
+    int myPartition = myRank * numThreads + myThread, numPartitions = numRanks * numThreads;
+    if (myPartition != fm->myPartition || numPartitions != fm->numPartitions) {
+        setPartitionRangeFileMap(fm, 0, fm->filesize, myRank, numRanks);
+        size_t rankStart = fm->myStart, rankEnd = fm->myEnd;
+        if (rankStart < rankEnd) {
+            setPartitionRangeFileMap(fm, rankStart, rankEnd, myThread, numThreads);
+        } else {
+            fm->myStart = fm->myEnd = rankEnd;
+        }
+        fm->myPartition = myPartition;
+        fm->numPartitions = numPartitions;
+    }
+    advisePartitionFileMap(fm);
+}
+
 size_t haveMoreFileMap(FileMap fm) {
    if (fm->myPos > fm->myEnd) {
        // reached last line, update myEnd to the current position
@@ -20,6 +20,7 @@ typedef _FileMap *FileMap;
 size_t get_file_size(const char *fname);
 
 FileMap initFileMap(const char *filename, const char *mode, int partition, int numPartitions);
+FileMap initHierarchicalFileMap(const char *filename, const char *mode, int rank, int numRanks, int thread, int numThreads);
 void freeFileMap(FileMap *pfm);
 
 //
@@ -27,6 +28,7 @@ void releaseMmapFileMap(FileMap fm);
 int closeFileMap(FileMap fm);
 
 void setMyPartitionFileMap(FileMap fm, int partition, int numPartitions);
+void setMyHierarchicalPartitionFileMap(FileMap fm, int rank, int numRanks, int thread, int numThreads);
 
 size_t haveMoreFileMap(FileMap fm);
 
@@ -0,0 +1,168 @@
+#ifndef NUMA_ALLOC_H_
+#define NUMA_ALLOC_H_
+
+/*
+ * NUMA placement of the memory a thread owns, and thread pinning
+ *
+ * allocNumaLocal(bytes) returns memory on the NUMA node of the calling thread and allocNumaOnNode(bytes, node)
+ * on another node.  With -DUSE_LIBNUMA (and -lnuma) they are numa_alloc_local and numa_alloc_onnode.
+ * Otherwise they map fresh anonymous pages.  When node is the caller's own the caller touches every page
+ * first, so that the default first touch policy of the kernel puts them there, and pages for another
+ * node are bound to it with the mbind system call (preferred, so a full node does not fail the
+ * allocation), whichever thread writes them first.  Where mbind is not allowed they stay with the first
+ * writer.  Allocations below NUMA_ALLOC_MIN_SIZE are plain malloc, which already keeps per-thread arenas.
+ * reallocNuma and freeNuma need the size that was allocated.  reallocNuma grows mapped memory with mremap
+ * (numa_realloc with libnuma) instead of copying it, and the caller touches the pages it adds.
+ * getNumaNode() is the node of the cpu the calling thread is running on, which only stays meaningful
+ * when threads are pinned: pinThreadNuma(slot) pins the calling thread to the slot'th cpu it is allowed
+ * to run on (wrapping around) and returns that cpu, or -1 where threads can not be pinned.
+ * This header does not depend on CommonParallel.h, so the UPC heaps can use it too.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+  #include <sys/mman.h>
+  #include <sys/syscall.h>
+#endif
+#ifdef USE_LIBNUMA
+  #include <numa.h>
+#endif
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+#ifndef NUMA_ALLOC_MIN_SIZE
+#define NUMA_ALLOC_MIN_SIZE (1 << 16)
+#endif
+
+// from numaif.h, which comes with libnuma
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+// from sys/mman.h, which only defines it with _GNU_SOURCE
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE 1
+#endif
+
+static inline int getNumaNode() {
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return (int) node;
+#endif
+  return 0;
+}
+
+// writes one byte of every page, only for memory that holds nothing yet
+static inline void touchNumaPages(void *ptr, size_t bytes) {
+  volatile char *p = (volatile char *) ptr;
+  size_t i, page = (size_t) sysconf(_SC_PAGESIZE);
+  for(i = 0; i < bytes; i += page) p[i] = 0;
+}
+
+static inline void *allocNumaOnNode(size_t bytes, int node) {
+  void *ptr;
+  if (bytes < NUMA_ALLOC_MIN_SIZE) return malloc(bytes);
+#ifdef USE_LIBNUMA
+  if (numa_available() >= 0) return numa_alloc_onnode(bytes, node);
+#endif
+#ifdef __linux__
+  ptr = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED) return NULL;
+  if (node == getNumaNode()) {
+    touchNumaPages(ptr, bytes);
+  } else if (node >= 0 && node < 1024) {
+  #ifdef SYS_mbind
+    unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, ptr, bytes, MPOL_PREFERRED, mask, 8 * sizeof(mask), 0); // nothing is touched yet, so a failure only loses the placement
+  #endif
+  }
+#else
+  ptr = malloc(bytes);
+#endif
+  return ptr;
+}
+
+static inline void *allocNumaLocal(size_t bytes) {
+#ifdef USE_LIBNUMA
+  if (bytes >= NUMA_ALLOC_MIN_SIZE && numa_available() >= 0) return numa_alloc_local(bytes);
+#endif
+  return allocNumaOnNode(bytes, getNumaNode());
+}
+
+static inline void freeNuma(void *ptr, size_t bytes) {
+  if (ptr == NULL) return;
+  if (bytes < NUMA_ALLOC_MIN_SIZE) {
+    free(ptr);
+    return;
+  }
+#ifdef USE_LIBNUMA
+  if (numa_available() >= 0) {
+    numa_free(ptr, bytes);
+    return;
+  }
+#endif
+#ifdef __linux__
+  munmap(ptr, bytes);
+#else
+  free(ptr);
+#endif
+}
+
+// keeps the first oldBytes, the new memory is on the caller's node.
+// Mapped memory is remapped in place or moved by the kernel without a copy, and the caller touches the new pages
+static inline void *reallocNuma(void *ptr, size_t oldBytes, size_t bytes) {
+  if (ptr == NULL) return allocNumaLocal(bytes);
+  if (oldBytes < NUMA_ALLOC_MIN_SIZE && bytes < NUMA_ALLOC_MIN_SIZE) return realloc(ptr, bytes);
+  if (oldBytes >= NUMA_ALLOC_MIN_SIZE && bytes >= NUMA_ALLOC_MIN_SIZE) {
+#ifdef USE_LIBNUMA
+    if (numa_available() >= 0) return numa_realloc(ptr, oldBytes, bytes);
+#endif
+#if defined(__linux__) && defined(SYS_mremap)
+    void *remapped = (void *) syscall(SYS_mremap, ptr, oldBytes, bytes, MREMAP_MAYMOVE);
+    if (remapped == MAP_FAILED) return NULL;
+    size_t page = (size_t) sysconf(_SC_PAGESIZE), tail = (oldBytes + page - 1) / page * page;
+    if (bytes > tail) touchNumaPages((char *) remapped + tail, bytes - tail);
+    return remapped;
+#endif
+  }
+  void *moved = allocNumaLocal(bytes);
+  if (moved == NULL) return NULL;
+  memcpy(moved, ptr, oldBytes < bytes ? oldBytes : bytes);
+  freeNuma(ptr, oldBytes);
+  return moved;
+}
+
+// through the raw system calls, as the cpu_set_t macros need _GNU_SOURCE before every include
+static inline int pinThreadNuma(int slot) {
+#if defined(__linux__) && defined(SYS_sched_getaffinity)
+  unsigned long allowed[1024 / (8 * sizeof(unsigned long))], pinned[1024 / (8 * sizeof(unsigned long))];
+  const int bits = 8 * sizeof(unsigned long);
+  int cpu, n = 0, count = 0;
+  memset(allowed, 0, sizeof(allowed));
+  if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) < 0) return -1;
+  for(cpu = 0; cpu < 1024; cpu++) count += (allowed[cpu / bits] >> (cpu % bits)) & 1;
+  if (count == 0) return -1;
+  slot %= count;
+  for(cpu = 0; cpu < 1024; cpu++) {
+    if (!((allowed[cpu / bits] >> (cpu % bits)) & 1)) continue;
+    if (n++ < slot) continue;
+    memset(pinned, 0, sizeof(pinned));
+    pinned[cpu / bits] = 1UL << (cpu % bits);
+    return syscall(SYS_sched_setaffinity, 0, sizeof(pinned), pinned) == 0 ? cpu : -1;
+  }
+#endif
+  return -1;
+}
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif // NUMA_ALLOC_H_
@@ -0,0 +1,116 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+/*
+ * Per-thread hardware performance counters through Linux perf_event_open.
+ *
+ * openPerfCounters() opens one group of counters that measures only the calling thread
+ * (user space only, so it works with perf_event_paranoid <= 2).  Events the kernel or the
+ * hardware refuses are skipped, and if none can be opened the group is simply unavailable:
+ * readPerfCounters() then returns zeros.  Nothing here ever aborts.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
+  #include <sys/ioctl.h>
+#endif
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_MISSES, PERF_BRANCH_MISSES, PERF_DTLB_MISSES, NUM_PERF_COUNTERS };
+
+typedef struct {
+    uint64_t v[NUM_PERF_COUNTERS];
+} PerfCounts;
+
+typedef struct {
+    int fd[NUM_PERF_COUNTERS];    // -1 when that event could not be opened
+    int slot[NUM_PERF_COUNTERS];  // position of each event in the group read, -1 if absent
+    int leader, numOpen;
+} PerfCounterGroup;
+
+static inline const char *getPerfCounterName(int i) {
+    static const char *names[NUM_PERF_COUNTERS] = { "cycles", "instructions", "cache-misses", "branch-misses", "dTLB-misses" };
+    return names[i];
+}
+
+// returns the number of counters opened, 0 if perf events are not permitted or supported
+static inline int openPerfCounters(PerfCounterGroup *g) {
+    int i;
+    g->leader = -1;
+    g->numOpen = 0;
+    for(i = 0; i < NUM_PERF_COUNTERS; i++) { g->fd[i] = -1; g->slot[i] = -1; }
+#ifdef __linux__
+    for(i = 0; i < NUM_PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        switch(i) {
+            case PERF_CYCLES: attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+            case PERF_INSTRUCTIONS: attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+            case PERF_CACHE_MISSES: attr.config = PERF_COUNT_HW_CACHE_MISSES; break;
+            case PERF_BRANCH_MISSES: attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+            case PERF_DTLB_MISSES:
+                attr.type = PERF_TYPE_HW_CACHE;
+                attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+                break;
+        }
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.disabled = (g->leader < 0); // the leader starts the whole group
+        int fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, g->leader, 0);
+        if (fd < 0) continue;
+        if (g->leader < 0) g->leader = fd;
+        g->fd[i] = fd;
+        g->slot[i] = g->numOpen++;
+    }
+    if (g->leader >= 0) {
+        ioctl(g->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(g->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+    return g->numOpen;
+}
+
+// cumulative counts since openPerfCounters, scaled up if the kernel had to multiplex the group
+static inline void readPerfCounters(PerfCounterGroup *g, PerfCounts *c) {
+    int i;
+    memset(c, 0, sizeof(PerfCounts));
+#ifdef __linux__
+    if (g->leader < 0) return;
+    uint64_t buf[3 + NUM_PERF_COUNTERS]; // nr, time_enabled, time_running, values[nr]
+    if (read(g->leader, buf, sizeof(buf)) < (ssize_t) (3 * sizeof(uint64_t))) return;
+    double scale = (buf[2] > 0 && buf[2] < buf[1]) ? (double) buf[1] / (double) buf[2] : 1.0;
+    for(i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (g->slot[i] >= 0 && (uint64_t) g->slot[i] < buf[0])
+            c->v[i] = (uint64_t) (buf[3 + g->slot[i]] * scale);
+    }
+#endif
+}
+
+static inline void closePerfCounters(PerfCounterGroup *g) {
+    int i;
+    for(i = 0; i < NUM_PERF_COUNTERS; i++) {
+        if (g->fd[i] >= 0 && g->fd[i] != g->leader) close(g->fd[i]);
+        g->fd[i] = -1;
+        g->slot[i] = -1;
+    }
+    if (g->leader >= 0) close(g->leader);
+    g->leader = -1;
+    g->numOpen = 0;
+}
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif // PERF_COUNTERS_H_
@@ -5,16 +5,6 @@
 
 #include "CommonParallel.h"
 
-#ifdef __UPC__
-  #include <upc.h>
-#elif defined _OPENMP
-  #include <omp.h>
-#elif defined USE_MPI
-  #include <mpi.h>
-#else
-  #warn "No parallelism has been chosen at compile time... did you want OpenMP (cc -fopenmp), MPI (mpicc -DUSE_MPI) or UPC (upcc)?"
-#endif
-
 #if defined (__cplusplus)
 extern "C" {
 #endif
@@ -24,6 +14,36 @@ extern "C" {
 #endif
 // round up to nearest word
 #define ALIGNED_MEM_SIZE(s) ( ((size_t) s + (MEM_ALIGN_SIZE - 1)) & ~((size_t) (MEM_ALIGN_SIZE - 1)) )
+// round up to a 128 bit word
+#define ALIGNED_ATOMIC128_SIZE(s) ( ((size_t) (s) + 15) & ~((size_t) 15) )
+
+/*
+ * Atomics on 8 byte aligned 64 bit words of a SharedHeap, all returning the previous value:
+ *   ATOMIC_FETCHADD(ptr, val), ATOMIC_FETCHAND, ATOMIC_FETCHOR, ATOMIC_FETCHXOR, ATOMIC_SWAP(ptr, val)
+ *   ATOMIC_CSWAP(ptr, oldval, newval)
+ * The _NB forms take a uint64_t *result and return a SharedAtomicHandle; *result is only valid after
+ * ATOMIC_WAIT(handle).  Only MPI completes them later, elsewhere they are done on return.
+ * 128 bit atomics on 16 byte aligned pairs of words also take the heap (every allocation of 16 bytes or
+ * more is 16 byte aligned where that matters, on the shared memory backend):
+ *   ATOMIC_CSWAP128(sharedHeap, ptr, oldval, newval), ATOMIC_SWAP128(sharedHeap, ptr, val), ATOMIC_READ128(sharedHeap, ptr)
+ * They are lock free on the shared memory backend, but UPC and MPI have no 128 bit atomics so they
+ * hold a lock word in the heap: there they are only atomic with respect to other 128 bit atomics
+ * on the same heap.
+ *
+ * Non-blocking transfers return a SharedMemHandle; neither buffer may be touched until it completes:
+ *   SharedMemHandle h = SHARED_MEMGET_NB(dst, src, size), SHARED_MEMPUT_NB(dst, src, size)
+ *   SHARED_MEM_WAIT(h), SHARED_MEM_TEST(h) (nonzero once complete), SHARED_MEM_WAITALL(handles, n)
+ * They are not ordered with respect to each other, nor to blocking transfers still in flight.
+ * A completed put has only left its buffer: like blocking puts it reaches the heap on SHARED_HEAP_FLUSH.
+ *
+ * SHARED_PTR_LOCAL(ptr) is a private char * to the memory of ptr, for the thread whose heap holds it.
+ * What other threads put there can be read through it once they flushed and all passed a BARRIER.
+ */
+typedef struct {
+  uint64_t lo, hi;
+} SharedAtomic128;
+
+enum { SHARED_ATOMIC_ADD, SHARED_ATOMIC_AND, SHARED_ATOMIC_OR, SHARED_ATOMIC_XOR, SHARED_ATOMIC_SWAP, SHARED_ATOMIC_CSWAP };
 
 #ifdef __UPC__
 
@@ -31,40 +51,96 @@ extern "C" {
   #include <upc.h>
   #include "upc_compatiblity.h"
 
-  #define ATOMIC_FETCHADD UPC_ATOMIC_FADD_I64
-  #define ATOMIC_CSWAP UPC_ATOMIC_CSWAP_I64
+  #define ATOMIC_FETCHADD(ptr, val) UPC_ATOMIC_FADD_I64((shared UPC_INT64_T *) (ptr), val)
+  #define ATOMIC_FETCHAND(ptr, val) UPC_ATOMIC_FAND_I64((shared UPC_INT64_T *) (ptr), val)
+  #define ATOMIC_FETCHOR(ptr, val) UPC_ATOMIC_FOR_I64((shared UPC_INT64_T *) (ptr), val)
+  #define ATOMIC_FETCHXOR(ptr, val) UPC_ATOMIC_FXOR_I64((shared UPC_INT64_T *) (ptr), val)
+  #define ATOMIC_SWAP(ptr, val) UPC_ATOMIC_SWAP_I64((shared UPC_INT64_T *) (ptr), val)
+  #define ATOMIC_CSWAP(ptr, oldval, newval) UPC_ATOMIC_CSWAP_I64((shared UPC_INT64_T *) (ptr), oldval, newval)
+
+  // the UPC atomics are blocking
+  typedef int SharedAtomicHandle;
+  #define ATOMIC_FETCHADD_NB(ptr, val, result) (*(result) = ATOMIC_FETCHADD(ptr, val), 0)
+  #define ATOMIC_FETCHAND_NB(ptr, val, result) (*(result) = ATOMIC_FETCHAND(ptr, val), 0)
+  #define ATOMIC_FETCHOR_NB(ptr, val, result) (*(result) = ATOMIC_FETCHOR(ptr, val), 0)
+  #define ATOMIC_FETCHXOR_NB(ptr, val, result) (*(result) = ATOMIC_FETCHXOR(ptr, val), 0)
+  #define ATOMIC_SWAP_NB(ptr, val, result) (*(result) = ATOMIC_SWAP(ptr, val), 0)
+  #define ATOMIC_CSWAP_NB(ptr, oldval, newval, result) (*(result) = ATOMIC_CSWAP(ptr, oldval, newval), 0)
+  #define ATOMIC_WAIT(handle) ((void) (handle))
 
   typedef struct {
     size_t size, idx;
+    UPC_INT64_T lock128;
     // data of length size is assumed immediately after this data structure
   } _SharedHeap;
   typedef shared _SharedHeap *SharedHeap;
   typedef shared char * SharedPtr;
 
+  static SharedAtomic128 __shared_atomic_op128(SharedHeap sharedHeap, SharedPtr ptr, int op, SharedAtomic128 val, SharedAtomic128 cmp) {
+    SharedAtomic128 old;
+    while (UPC_ATOMIC_CSWAP_I64(&(sharedHeap->lock128), 0, MYTHREAD + 1) != 0) UPC_POLL;
+    upc_memget(&old, ptr, sizeof(SharedAtomic128));
+    if (op == SHARED_ATOMIC_SWAP || (old.lo == cmp.lo && old.hi == cmp.hi)) upc_memput(ptr, &val, sizeof(SharedAtomic128));
+    upc_fence;
+    UPC_ATOMIC_SWAP_I64(&(sharedHeap->lock128), 0);
+    return old;
+  }
+
   static SharedPtr __alloc_from_SharedHeap(SharedHeap sharedHeap, size_t size) {
     size = ALIGNED_MEM_SIZE(size);
-    size_t idx = ATOMIC_FETCHADD(&(sharedHeap->idx), size); \
-    if (idx + size > sharedHeap->size) DIE("Thread %d: attempt to allocate past size of SharedHeap (%lld of %lld)\n", (long long idx), (long long) sharedHeap->size);
+    size_t idx = ATOMIC_FETCHADD(&(sharedHeap->idx), size);
+    if (idx + size > sharedHeap->size) DIE("Thread %d: attempt to allocate past size of SharedHeap (%lld of %lld)\n", MYTHREAD, (long long) idx, (long long) sharedHeap->size);
     SharedPtr data = (SharedPtr) sharedHeap;
     return data + idx + ALIGNED_MEM_SIZE( sizeof(_SharedHeap) );
   }
 
-  /* only MYTHREAD == rank will alloate the blocks of memory */
+  /* collective: MYTHREAD == rank allocates the blocks of memory and every thread gets the heap */
   #define INIT_SHARED_HEAP(sharedHeap, blocks, bytes, rank) \
     SharedHeap sharedHeap = NULL; \
-    if (MYTHREAD == rank) { \
-      size_t align_bytes = ALIGNED_MEM_SIZE(bytes); \
-      sharedHeap = (SharedHeap) upc_alloc(blocks * align_bytes + ALIGNED_MEM_SIZE( sizeof(_SharedHeap) ) ); \
-      if (sharedHeap == NULL) DIE("Thread %d: could not allocate %ld bytes for SharedHeap\n", MYTHREAD, blocks * align_bytes); \
-      sharedHeap->size = blocks * align_bytes; \
-      sharedHeap->idx = 0; \
-      upc_fence; \
+    do { \
+      if (MYTHREAD == rank) { \
+        size_t align_bytes = ALIGNED_MEM_SIZE(bytes); \
+        sharedHeap = (SharedHeap) upc_alloc((blocks) * align_bytes + ALIGNED_MEM_SIZE( sizeof(_SharedHeap) ) ); \
+        if (sharedHeap == NULL) DIE("Thread %d: could not allocate %ld bytes for SharedHeap\n", MYTHREAD, (long) ((blocks) * align_bytes)); \
+        sharedHeap->size = (blocks) * align_bytes; \
+        sharedHeap->idx = 0; \
+        sharedHeap->lock128 = 0; \
+        upc_fence; \
+      } \
+      BROADCAST(&sharedHeap, sizeof(SharedHeap), rank); \
     } while (0)
 
-  #define FREE_SHARED_HEAP(sharedHeap) { upc_free(sharedHeap); sharedHeap = NULL; } while(0)
-  #define ALLOC_FROM_SHARED_HEAP(sharedHeap, type, varname, count) shared type *varname = (shared type *) __alloc_from_SharedHeap(sharedHeap, sizeof(type) * count)
+  #define INIT_SHARED_HEAP_SLABS(sharedHeap, blocks, bytes, rank, slabSize) INIT_SHARED_HEAP(sharedHeap, blocks, bytes, rank)
+
+  /* collective */
+  #define FREE_SHARED_HEAP(sharedHeap) \
+    do { \
+      upc_barrier; \
+      if (upc_threadof(sharedHeap) == MYTHREAD) upc_free(sharedHeap); \
+      sharedHeap = NULL; \
+    } while(0)
+  #define ALLOC_FROM_SHARED_HEAP(sharedHeap, type, varname, count) shared type *varname = (shared type *) __alloc_from_SharedHeap(sharedHeap, sizeof(type) * (count))
   #define SHARED_MEMGET(dst, src, size) upc_memget(dst, src, size)
   #define SHARED_MEMPUT(dst, src, size) upc_memput(dst, src, size) 
+  #define SHARED_HEAP_FLUSH(sharedHeap) upc_fence
+
+  #ifdef UPC_HANDLE_T
+    typedef UPC_HANDLE_T SharedMemHandle;
+    #define SHARED_MEMGET_NB(dst, src, size) UPC_MEMGET_NB(dst, src, size)
+    #define SHARED_MEMPUT_NB(dst, src, size) UPC_MEMPUT_NB(dst, src, size)
+    #define SHARED_MEM_WAIT(handle) UPC_SYNC(handle)
+    #define SHARED_MEM_TEST(handle) UPC_SYNC_ATTEMPT(handle)
+  #else
+    typedef int SharedMemHandle;
+    #define SHARED_MEMGET_NB(dst, src, size) (upc_memget(dst, src, size), 0)
+    #define SHARED_MEMPUT_NB(dst, src, size) (upc_memput(dst, src, size), 0)
+    #define SHARED_MEM_WAIT(handle) ((void) (handle))
+    #define SHARED_MEM_TEST(handle) ((void) (handle), 1)
+  #endif
+  #define SHARED_MEM_WAITALL(handles, n) do { int _i; for(_i = 0; _i < (n); _i++) SHARED_MEM_WAIT((handles)[_i]); } while (0)
+  #define BROADCAST_SHARED_PTR(sharedHeap, ptr, root) BROADCAST(&(ptr), sizeof(SharedPtr), root)
+  #define SHARED_PTR_ADD(ptr, bytes) ((ptr) + (bytes))
+  #define SHARED_PTR_LOCAL(ptr) ((char *) (ptr))
 
 #else // NOT UPC
 
@@ -72,133 +148,657 @@ extern "C" {
     // // MPI, ensure mpi.h is loaded
     #include <mpi.h>
 
-    struct {
-      size_t size, idx;
-      MPI_Win win;
-      int rank;
-      // data is assumed to be immediately following this data structure
+    /*
+     * The owner's window holds the allocation index and the 128 bit atomics lock followed by the data.  Every rank keeps
+     * the window in one passive target epoch (MPI_Win_lock_all) from INIT to FREE, so an atomic is
+     * one MPI_Fetch_and_op and one flush.  With INIT_SHARED_HEAP_SLABS ranks reserve slabs of slabSize
+     * bytes, like the threads of the shared memory heap below, and a slab that does not fit in what is
+     * left of the heap is cut down to the allocation.  The heap cannot grow, so the unused tail of each
+     * rank's last slab must be included in its size; INIT_SHARED_HEAP does not use slabs.
+     * SHARED_MEMPUT copies the source into a staging buffer, merges puts to adjacent offsets and
+     * does not wait for them: they are flushed together when the buffer fills, before the next
+     * SHARED_MEMGET from the heap, on SHARED_HEAP_FLUSH and on FREE_SHARED_HEAP.  Puts are only
+     * guaranteed to be visible to other ranks after SHARED_HEAP_FLUSH and a BARRIER.
+     * Ranks on the owner's node map the heap with MPI_Win_allocate_shared and use plain loads and
+     * stores instead of RMA.  Atomics stay on MPI_Fetch_and_op unless the whole job is on one node,
+     * because C11 atomics are not atomic with respect to RMA atomics from other nodes.
+     * The world window is always made with MPI_Win_create, over the node window's memory on the owner's
+     * node and over MPI_Alloc_mem elsewhere, so that ranks on every node make the same collective call.
+     * -DNO_SHARED_HEAP_NODE_WINDOW uses RMA for every rank.
+     * rank is an MPI rank.  In hybrid builds MPI is MPI_THREAD_SERIALIZED, so only one thread
+     * per rank may use a heap at a time.
+     */
+    #include <stdatomic.h>
+    #ifndef SHARED_HEAP_SLAB_SIZE
+    #define SHARED_HEAP_SLAB_SIZE 65536
+    #endif
+    #ifndef SHARED_HEAP_STAGING_SIZE
+    #define SHARED_HEAP_STAGING_SIZE (1 << 20)
+    #endif
+    // the allocation index and the lock word of the 128 bit atomics
+    #define SHARED_HEAP_HEADER_SIZE ALIGNED_MEM_SIZE( 2 * sizeof(uint64_t) )
+
+    typedef struct {
+      size_t size, slabSize, slabNext, slabEnd;
+      MPI_Win win, nodeWin; // nodeWin only on the owner's node
+      int rank, localAtomics;
+      char *base;  // this rank's part of the window, only the owner's holds the heap (from MPI_Alloc_mem without nodeWin)
+      char *local; // the owner's window, when it is on this node
+      char *staging;
+      size_t stagingUsed, runStart, runOffset, runLength; // the merged put that is not issued yet
+      int pendingRma; // SHARED_MEMPUT_NB requests only complete locally, so they still need a flush
     } _SharedHeap;
     typedef _SharedHeap *SharedHeap;
-    struct {
+    typedef struct {
       SharedHeap heap;
-      size_t offset;
+      size_t offset; // in the owner's window
     } SharedPtr;
 
-    static size_t __shared_atomic_fetchadd(SharedPtr ptr, size_t val) {
-      size_t oldVal;
-      CHECK_MPI( MPI_Win_lock( MPI_LOCK_EXCLUSIVE, ptr.heap->rank, 0, ptr.heap->win) );
-      CHECK_MPI( MPI_Fetch_and_op( &val, &oldVal, MPI_LONG_LONG_INT, ptr.heap->rank, ptr.offset, MPI_SUM, ptr.heap->win ) );
-      CHECK_MPI( MPI_Win_unlock( ptr.heap->rank, ptr.heap->win ) );
-      return oldVal;  
+    static void __flush_SharedHeap(SharedHeap sharedHeap);
+    static void __issue_SharedHeap(SharedHeap sharedHeap);
+    static void __shared_memput(SharedPtr dst, const void *src, size_t size);
+    static void __shared_memget(void *dst, SharedPtr src, size_t size);
+
+    static inline uint64_t __shared_atomic_local(_Atomic uint64_t *p, int op, uint64_t val, uint64_t cmp) {
+      switch(op) {
+        case SHARED_ATOMIC_ADD: return atomic_fetch_add(p, val);
+        case SHARED_ATOMIC_AND: return atomic_fetch_and(p, val);
+        case SHARED_ATOMIC_OR: return atomic_fetch_or(p, val);
+        case SHARED_ATOMIC_XOR: return atomic_fetch_xor(p, val);
+        case SHARED_ATOMIC_SWAP: return atomic_exchange(p, val);
+        default: atomic_compare_exchange_strong(p, &cmp, val); return cmp;
+      }
+    }
+
+    static void __shared_atomic_issue(SharedPtr ptr, int op, const uint64_t *val, const uint64_t *cmp, uint64_t *result) {
+      static const MPI_Op ops[] = { MPI_SUM, MPI_BAND, MPI_BOR, MPI_BXOR, MPI_REPLACE };
+      if (op == SHARED_ATOMIC_CSWAP) CHECK_MPI( MPI_Compare_and_swap(val, cmp, result, MPI_UINT64_T, ptr.heap->rank, ptr.offset, ptr.heap->win) );
+      else CHECK_MPI( MPI_Fetch_and_op(val, result, MPI_UINT64_T, ptr.heap->rank, ptr.offset, ops[op], ptr.heap->win) );
+    }
+
+    static uint64_t __shared_atomic_op(SharedPtr ptr, int op, uint64_t val, uint64_t cmp) {
+      if (ptr.heap->localAtomics) return __shared_atomic_local((_Atomic uint64_t *) (ptr.heap->local + ptr.offset), op, val, cmp);
+      uint64_t oldVal;
+      __shared_atomic_issue(ptr, op, &val, &cmp, &oldVal);
+      CHECK_MPI( MPI_Win_flush( ptr.heap->rank, ptr.heap->win ) );
+      return oldVal;
+    }
+
+    // completes with the next flush of the heap, the operands wait in the staging buffer until then
+    typedef SharedHeap SharedAtomicHandle;
+    static SharedAtomicHandle __shared_atomic_nb(SharedPtr ptr, int op, uint64_t val, uint64_t cmp, uint64_t *result) {
+      SharedHeap sharedHeap = ptr.heap;
+      if (sharedHeap->localAtomics) {
+        *result = __shared_atomic_local((_Atomic uint64_t *) (sharedHeap->local + ptr.offset), op, val, cmp);
+        return NULL;
+      }
+      if (sharedHeap->stagingUsed + 2 * sizeof(uint64_t) > SHARED_HEAP_STAGING_SIZE) __flush_SharedHeap(sharedHeap);
+      __issue_SharedHeap(sharedHeap);
+      uint64_t *operands = (uint64_t *) (sharedHeap->staging + sharedHeap->stagingUsed);
+      memcpy(operands, &val, sizeof(uint64_t));
+      memcpy(operands + 1, &cmp, sizeof(uint64_t));
+      sharedHeap->stagingUsed += 2 * sizeof(uint64_t);
+      __shared_atomic_issue(ptr, op, operands, operands + 1, result);
+      return sharedHeap;
+    }
+    #define ATOMIC_WAIT(handle) do { SharedAtomicHandle _h = (handle); if (_h != NULL) __flush_SharedHeap(_h); } while (0)
+
+    static SharedAtomic128 __shared_atomic_op128(SharedHeap sharedHeap, SharedPtr ptr, int op, SharedAtomic128 val, SharedAtomic128 cmp) {
+      SharedPtr lock = { sharedHeap, sizeof(uint64_t) };
+      SharedAtomic128 old;
+      while (__shared_atomic_op(lock, SHARED_ATOMIC_CSWAP, MYRANK + 1, 0) != 0);
+      __shared_memget(&old, ptr, sizeof(SharedAtomic128));
+      if (op == SHARED_ATOMIC_SWAP || (old.lo == cmp.lo && old.hi == cmp.hi)) __shared_memput(ptr, &val, sizeof(SharedAtomic128));
+      __flush_SharedHeap(sharedHeap);
+      __shared_atomic_op(lock, SHARED_ATOMIC_SWAP, 0, 0);
+      return old;
+    }
+
+    // returns the offset in the window of count bytes, the reservation may be cut short at the end of the heap but not below minSize
+    // idx is advanced by compare and swap so it never passes the end and a short reservation leaves the rest to other ranks
+    static size_t __reserve_SharedHeap(SharedHeap sharedHeap, size_t minSize, size_t count, size_t *end) {
+      SharedPtr idx = { sharedHeap, 0 };
+      size_t offset = __shared_atomic_op(idx, SHARED_ATOMIC_ADD, 0, 0), seen;
+      while (1) {
+        if (offset + minSize > sharedHeap->size) DIE("Could not allocate %lld bytes from SharedHeap (on rank %d)\n", (long long) minSize, sharedHeap->rank);
+        size_t granted = offset + count <= sharedHeap->size ? count : minSize;
+        if ((seen = __shared_atomic_op(idx, SHARED_ATOMIC_CSWAP, offset + granted, offset)) == offset) {
+          *end = SHARED_HEAP_HEADER_SIZE + offset + granted;
+          return SHARED_HEAP_HEADER_SIZE + offset;
+        }
+        offset = seen;
+      }
     }
-    #define ATOMIC_FETCHADD __shared_atomic_fetchadd
-    #define ATOMIC_CSWAP TODO
+
     static SharedPtr __alloc_from_SharedHeap(SharedHeap sharedHeap, size_t size) {
       assert(sharedHeap);
       size = ALIGNED_MEM_SIZE(size);
       SharedPtr ptr;
+      size_t end;
       ptr.heap = sharedHeap;
-      ptr.offset = ((char *) &(sharedHeap->idx)) - ((char *) sharedHeap);
-      ptr.offset = ATOMIC_FETCHADD(ptr, size);
-      if (ptr.offset + size > sharedHeap->size) DIE("Could not allocate %ld bytes from SharedHeap (on thread %d)\n", size, sharedHeap->rank);
+      if (sharedHeap->slabNext + size > sharedHeap->slabEnd) {
+        if (size > sharedHeap->slabSize / 4) {
+          ptr.offset = __reserve_SharedHeap(sharedHeap, size, size, &end);
+          return ptr;
+        }
+        sharedHeap->slabNext = __reserve_SharedHeap(sharedHeap, size, sharedHeap->slabSize, &end);
+        sharedHeap->slabEnd = end;
+      }
+      ptr.offset = sharedHeap->slabNext;
+      sharedHeap->slabNext += size;
       return ptr;
     }
-    static void __shared_memput(SharedPtr dst, char *src, size_t size) {
-      CHECK_MPI( MPI_Put(src, size, MPI_BYTE, dst.heap->rank, dst.offset, size, MPI_BYTE, dst.heap->win) );
-      CHECK_MPI( MPI_Win_flush( dst.heap->rank, dst.heap->win ) );
-    } 
-    static void __shared_memget(char *dst, SharedPtr src, size_t size) {
-      CHECK_MPI( MPI_Get(dst, size, MPI_BYTE, dst.heap->rank, dst.offset, size, MPI_BYTE, dst.heap->win) );
-    } 
-
-    /* only MYTHREAD == rank will allocate the blocks of memory */ 
-    #define INIT_SHARED_HEAP(sharedHeap, blocks, bytes, rank) \
-      SharedHeap sharedHeap; \
-      { \
-        size_t align_bytes = blocks * ALIGNED_MEM_SIZE(bytes); \
-        size_t alloc_bytes = (MYTHREAD == rank ? align_bytes : 0) + ALIGNED_MEM_SIZE( sizeof(_SharedHeap) ); \
-        CHECK_MPI( MPI_Alloc_mem(alloc_bytes, MPI_INFO_NULL, sharedHeap) ); \
-        if (sharedHeap == NULL) DIE("Thread %d: could not allocate %ld bytes for SharedHeap\n", MYTHREAD, blocks * align_bytes); \
-        sharedHeap->size = align_bytes; \
-        sharedHeap->idx = 0; \
-        sharedHeap->rank = rank; \
-        CHECK_MPI( MPI_Win_create( sharedHeap, MYTHREAD == rank ? alloc_bytes : 0, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &(sharedHeap->win) ); ); \
-      } while (0)
 
+    static void __issue_SharedHeap(SharedHeap sharedHeap) {
+      if (sharedHeap->runLength == 0) return;
+      CHECK_MPI( MPI_Put(sharedHeap->staging + sharedHeap->runStart, sharedHeap->runLength, MPI_BYTE, sharedHeap->rank, sharedHeap->runOffset, sharedHeap->runLength, MPI_BYTE, sharedHeap->win) );
+      sharedHeap->runLength = 0;
+    }
+
+    static void __flush_SharedHeap(SharedHeap sharedHeap) {
+      if (sharedHeap->local != NULL) {
+        // make this rank's stores visible to RMA from other nodes
+        atomic_thread_fence(memory_order_seq_cst);
+        CHECK_MPI( MPI_Win_sync(sharedHeap->win) );
+      }
+      if (sharedHeap->stagingUsed == 0 && !sharedHeap->pendingRma) return;
+      __issue_SharedHeap(sharedHeap);
+      CHECK_MPI( MPI_Win_flush( sharedHeap->rank, sharedHeap->win ) );
+      sharedHeap->stagingUsed = 0;
+      sharedHeap->pendingRma = 0;
+    }
+
+    static void __shared_memput(SharedPtr dst, const void *src, size_t size) {
+      SharedHeap sharedHeap = dst.heap;
+      if (sharedHeap->local != NULL) {
+        memcpy(sharedHeap->local + dst.offset, src, size);
+        return;
+      }
+      if (size > SHARED_HEAP_STAGING_SIZE / 2) {
+        __flush_SharedHeap(sharedHeap);
+        CHECK_MPI( MPI_Put(src, size, MPI_BYTE, sharedHeap->rank, dst.offset, size, MPI_BYTE, sharedHeap->win) );
+        CHECK_MPI( MPI_Win_flush( sharedHeap->rank, sharedHeap->win ) );
+        return;
+      }
+      if (sharedHeap->stagingUsed + size > SHARED_HEAP_STAGING_SIZE) __flush_SharedHeap(sharedHeap);
+      if (sharedHeap->runLength == 0 || dst.offset != sharedHeap->runOffset + sharedHeap->runLength
+          || sharedHeap->runStart + sharedHeap->runLength != sharedHeap->stagingUsed) {
+        __issue_SharedHeap(sharedHeap);
+        sharedHeap->runStart = sharedHeap->stagingUsed;
+        sharedHeap->runOffset = dst.offset;
+      }
+      memcpy(sharedHeap->staging + sharedHeap->stagingUsed, src, size);
+      sharedHeap->stagingUsed += size;
+      sharedHeap->runLength += size;
+    }
+
+    static void __shared_memget(void *dst, SharedPtr src, size_t size) {
+      if (src.heap->local != NULL) {
+        memcpy(dst, src.heap->local + src.offset, size);
+        return;
+      }
+      __flush_SharedHeap(src.heap);
+      CHECK_MPI( MPI_Get(dst, size, MPI_BYTE, src.heap->rank, src.offset, size, MPI_BYTE, src.heap->win) );
+      CHECK_MPI( MPI_Win_flush( src.heap->rank, src.heap->win ) );
+    }
+
+    // the ranks sharing this node, made once, and the owner's rank in it (MPI_UNDEFINED when it is on another node)
+    static MPI_Comm __get_SharedHeapNodeComm(int owner, int *ownerOnNode) {
+      static MPI_Comm nodeComm = MPI_COMM_NULL;
+      MPI_Group worldGroup, nodeGroup;
+      if (nodeComm == MPI_COMM_NULL) CHECK_MPI( MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, MYRANK, MPI_INFO_NULL, &nodeComm) );
+      CHECK_MPI( MPI_Comm_group(MPI_COMM_WORLD, &worldGroup) );
+      CHECK_MPI( MPI_Comm_group(nodeComm, &nodeGroup) );
+      CHECK_MPI( MPI_Group_translate_ranks(worldGroup, 1, &owner, nodeGroup, ownerOnNode) );
+      CHECK_MPI( MPI_Group_free(&worldGroup) );
+      CHECK_MPI( MPI_Group_free(&nodeGroup) );
+      return nodeComm;
+    }
+
+    // request based RMA inside the lock_all epoch, plain copies on the owner's node
+    typedef MPI_Request SharedMemHandle;
+    static SharedMemHandle __shared_memget_nb(void *dst, SharedPtr src, size_t size) {
+      MPI_Request request = MPI_REQUEST_NULL;
+      if (src.heap->local != NULL) {
+        memcpy(dst, src.heap->local + src.offset, size);
+        return request;
+      }
+      __flush_SharedHeap(src.heap);
+      CHECK_MPI( MPI_Rget(dst, size, MPI_BYTE, src.heap->rank, src.offset, size, MPI_BYTE, src.heap->win, &request) );
+      return request;
+    }
+    static SharedMemHandle __shared_memput_nb(SharedPtr dst, const void *src, size_t size) {
+      MPI_Request request = MPI_REQUEST_NULL;
+      if (dst.heap->local != NULL) {
+        memcpy(dst.heap->local + dst.offset, src, size);
+        return request;
+      }
+      __issue_SharedHeap(dst.heap);
+      CHECK_MPI( MPI_Rput(src, size, MPI_BYTE, dst.heap->rank, dst.offset, size, MPI_BYTE, dst.heap->win, &request) );
+      dst.heap->pendingRma = 1;
+      return request;
+    }
+    static inline int __shared_mem_test(SharedMemHandle *handle) {
+      int flag;
+      CHECK_MPI( MPI_Test(handle, &flag, MPI_STATUS_IGNORE) );
+      return flag;
+    }
+
+    static SharedHeap __init_SharedHeap(size_t alignedBytes, int rank, size_t slabSize) {
+      SharedHeap sharedHeap = (SharedHeap) calloc(1, sizeof(_SharedHeap));
+      if (sharedHeap == NULL || (sharedHeap->staging = (char *) malloc(SHARED_HEAP_STAGING_SIZE)) == NULL) DIE("Could not allocate a SharedHeap\n");
+      sharedHeap->size = alignedBytes;
+      sharedHeap->slabSize = ALIGNED_MEM_SIZE( slabSize > 0 ? slabSize : MEM_ALIGN_SIZE );
+      sharedHeap->rank = rank;
+      MPI_Aint winSize = MYRANK == rank ? SHARED_HEAP_HEADER_SIZE + alignedBytes : 0;
+      int nodeSize, worldSize, ownerOnNode;
+      MPI_Comm nodeComm = __get_SharedHeapNodeComm(rank, &ownerOnNode);
+      CHECK_MPI( MPI_Comm_size(nodeComm, &nodeSize) );
+      CHECK_MPI( MPI_Comm_size(MPI_COMM_WORLD, &worldSize) );
+      sharedHeap->nodeWin = MPI_WIN_NULL;
+      #ifdef NO_SHARED_HEAP_NODE_WINDOW
+      ownerOnNode = MPI_UNDEFINED; // RMA even on the owner's node
+      #endif
+      if (ownerOnNode != MPI_UNDEFINED) {
+        // the owner's node shares its segment, and the world window exposes the same memory to RMA
+        MPI_Aint querySize;
+        int dispUnit;
+        CHECK_MPI( MPI_Win_allocate_shared(winSize, 1, MPI_INFO_NULL, nodeComm, &(sharedHeap->base), &(sharedHeap->nodeWin)) );
+        CHECK_MPI( MPI_Win_shared_query(sharedHeap->nodeWin, ownerOnNode, &querySize, &dispUnit, &(sharedHeap->local)) );
+        CHECK_MPI( MPI_Win_lock_all(MPI_MODE_NOCHECK, sharedHeap->nodeWin) );
+        CHECK_MPI( MPI_Win_create(sharedHeap->base, winSize, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &(sharedHeap->win)) );
+        sharedHeap->localAtomics = nodeSize == worldSize;
+      } else {
+        // the same collective as on the owner's node, where the memory comes from the node window
+        sharedHeap->base = NULL;
+        if (winSize > 0) CHECK_MPI( MPI_Alloc_mem(winSize, MPI_INFO_NULL, &(sharedHeap->base)) );
+        CHECK_MPI( MPI_Win_create(sharedHeap->base, winSize, 1, MPI_INFO_NULL, MPI_COMM_WORLD, &(sharedHeap->win)) );
+      }
+      CHECK_MPI( MPI_Win_lock_all(MPI_MODE_NOCHECK, sharedHeap->win) );
+      if (MYRANK == rank) {
+        memset(sharedHeap->base, 0, SHARED_HEAP_HEADER_SIZE);
+        CHECK_MPI( MPI_Win_sync(sharedHeap->win) );
+      }
+      CHECK_MPI( MPI_Barrier(MPI_COMM_WORLD) );
+      return sharedHeap;
+    }
+
+    static void __free_SharedHeap(SharedHeap sharedHeap) {
+      __flush_SharedHeap(sharedHeap);
+      CHECK_MPI( MPI_Win_unlock_all(sharedHeap->win) );
+      CHECK_MPI( MPI_Win_free(&(sharedHeap->win)) );
+      if (sharedHeap->nodeWin != MPI_WIN_NULL) {
+        CHECK_MPI( MPI_Win_unlock_all(sharedHeap->nodeWin) );
+        CHECK_MPI( MPI_Win_free(&(sharedHeap->nodeWin)) );
+      } else if (sharedHeap->base != NULL) {
+        CHECK_MPI( MPI_Free_mem(sharedHeap->base) );
+      }
+      free(sharedHeap->staging);
+      free(sharedHeap);
+    }
+
+    /* collective: only rank holds the blocks of memory */
+    #define INIT_SHARED_HEAP_SLABS(sharedHeap, blocks, bytes, rank, slabSize) \
+      SharedHeap sharedHeap = __init_SharedHeap(ALIGNED_MEM_SIZE( bytes ) * (blocks), rank, slabSize)
+    #define INIT_SHARED_HEAP(sharedHeap, blocks, bytes, rank) INIT_SHARED_HEAP_SLABS(sharedHeap, blocks, bytes, rank, 0)
+
+    /* collective */
     #define FREE_SHARED_HEAP(sharedHeap) \
-    { \
-      if (sharedHeap->idx != 0) assert( MYTHREAD == sharedHeap->rank); /* only 1 rank has allocation */ \
-      CHECK_MPI( MPI_Win_free(&(sharedHeap->win)) ); \
-      CHECK_MPI( MPI_Free_mem( sharedHeap ) ); \
-      sharedHeap = NULL; \
-    } while(0)
+      do { \
+        __free_SharedHeap(sharedHeap); \
+        sharedHeap = NULL; \
+      } while(0)
 
     #define ALLOC_FROM_SHARED_HEAP(sharedHeap, type, varname, count) \
-      SharedPtr varname = __alloc_from_SharedHeap(sharedHeap, sizeof(type) * count)
+      SharedPtr varname = __alloc_from_SharedHeap(sharedHeap, sizeof(type) * (count))
 
     #define SHARED_MEMPUT(dst, src, size) __shared_memput(dst, src, size)
     #define SHARED_MEMGET(dst, src, size) __shared_memget(dst, src, size)
+    #define SHARED_HEAP_FLUSH(sharedHeap) __flush_SharedHeap(sharedHeap)
+    #define BROADCAST_SHARED_PTR(sharedHeap, ptr, root) \
+      do { \
+        BROADCAST(&((ptr).offset), sizeof(size_t), root); \
+        (ptr).heap = sharedHeap; \
+      } while (0)
+    #define SHARED_MEMGET_NB(dst, src, size) __shared_memget_nb(dst, src, size)
+    #define SHARED_MEMPUT_NB(dst, src, size) __shared_memput_nb(dst, src, size)
+    #define SHARED_MEM_WAIT(handle) CHECK_MPI( MPI_Wait(&(handle), MPI_STATUS_IGNORE) )
+    #define SHARED_MEM_TEST(handle) __shared_mem_test(&(handle))
+    #define SHARED_MEM_WAITALL(handles, n) CHECK_MPI( MPI_Waitall(n, handles, MPI_STATUSES_IGNORE) )
+    static inline SharedPtr __shared_ptr_add(SharedPtr ptr, size_t bytes) {
+      ptr.offset += bytes;
+      return ptr;
+    }
+    #define SHARED_PTR_ADD(ptr, bytes) __shared_ptr_add(ptr, bytes)
+    // the window is in the unified model, a sync orders the owner's loads after the RMA of other ranks
+    static inline char *__shared_ptr_local(SharedPtr ptr) {
+      assert(ptr.heap->rank == MYRANK);
+      CHECK_MPI( MPI_Win_sync(ptr.heap->win) );
+      return ptr.heap->base + ptr.offset;
+    }
+    #define SHARED_PTR_LOCAL(ptr) __shared_ptr_local(ptr)
 
   #else // NOT MPI
-    // OpenMP or fake it!
-
-    struct {
-      size_t size, idx;
+    // OpenMP, pthreads or fake it!
+    #include <stdatomic.h>
+
+    /*
+     * With INIT_SHARED_HEAP_SLABS threads do not contend on idx for every allocation: each thread
+     * reserves a slab of slabSize bytes with one atomic_fetch_add and bump allocates from it privately.
+     * Allocations larger than a quarter of a slab go straight to idx.  The unused tail of
+     * a thread's last slab is not given to other threads.
+     *
+     * When the current segment is exhausted one allocating thread mallocs a segment twice as
+     * large and installs it, while the other threads that ran out wait for it instead of
+     * allocating (and first touching) segments of their own.  Older segments are never moved, so
+     * pointers stay valid until the collective CONSOLIDATE_SHARED_HEAP, which copies every segment into one and keeps a
+     * forwarding table for TRANSLATE_SHARED_PTR to map old pointers to their new location.
+     * Segments of NUMA_ALLOC_MIN_SIZE or more are placed on the NUMA node of the thread that initialized
+     * the heap (allocNumaOnNode of NumaAlloc.h), wherever the thread that grows or consolidates it runs:
+     * by libnuma, by first touch from that node or else by mbind, unless the system does not allow it.
+     */
+    #ifndef SHARED_HEAP_SLAB_SIZE
+    #define SHARED_HEAP_SLAB_SIZE 65536
+    #endif
+
+    typedef struct {
+      _Alignas(64) char *next, *end;
+    } _SharedHeapSlab;
+
+    typedef struct _SharedHeapSegment {
+      size_t size;
+      atomic_size_t idx;
+      struct _SharedHeapSegment *prev; // the older segment
+      // data of length size is assumed immediately after this data structure
+    } _SharedHeapSegment;
+
+    typedef struct {
+      char *oldStart, *oldEnd, *newStart;
+    } _SharedHeapForward;
+
+    typedef struct {
+      _Atomic(_SharedHeapSegment *) current;
+      atomic_int growing; // set while one thread allocates the next segment
+      size_t slabSize;
+      int rank, node, numThreads, numForwards; // node of the owner
+      _SharedHeapSlab *slabs; // one per thread
+      _SharedHeapForward *forwards; // sorted by oldStart, from the last consolidation
     } _SharedHeap;
     typedef _SharedHeap *SharedHeap;
     typedef char * SharedPtr;
 
-    static size_t __shared_atomic_fetchadd(SharedPtr ptr, size_t val) {
-      #ifdef GCC_EXTENSION
-        return __sync_fetch_and_add(ptr, val);
-      #endif
-      size_t t;
-      #ifdef OPENMP_3_1
-        #pragma omp atomic capture
-      #else
-        #pragma omp critical(_fetchadd)
-      #endif
-      { t = *ptr; *ptr += val; }
-      return t;
+    static inline uint64_t __shared_atomic_op(SharedPtr ptr, int op, uint64_t val, uint64_t cmp) {
+      _Atomic uint64_t *p = (_Atomic uint64_t *) ptr;
+      switch(op) {
+        case SHARED_ATOMIC_ADD: return atomic_fetch_add(p, val);
+        case SHARED_ATOMIC_AND: return atomic_fetch_and(p, val);
+        case SHARED_ATOMIC_OR: return atomic_fetch_or(p, val);
+        case SHARED_ATOMIC_XOR: return atomic_fetch_xor(p, val);
+        case SHARED_ATOMIC_SWAP: return atomic_exchange(p, val);
+        default: atomic_compare_exchange_strong(p, &cmp, val); return cmp;
+      }
+    }
+
+    // the C11 atomics are blocking
+    typedef int SharedAtomicHandle;
+    static inline SharedAtomicHandle __shared_atomic_nb(SharedPtr ptr, int op, uint64_t val, uint64_t cmp, uint64_t *result) {
+      *result = __shared_atomic_op(ptr, op, val, cmp);
+      return 0;
+    }
+    #define ATOMIC_WAIT(handle) ((void) (handle))
+
+    // 16 byte compare and swap, through libatomic where the compiler does not inline it
+    static SharedAtomic128 __shared_atomic_op128(SharedHeap sharedHeap, SharedPtr ptr, int op, SharedAtomic128 val, SharedAtomic128 cmp) {
+      unsigned __int128 *p = (unsigned __int128 *) ptr, v, c;
+      SharedAtomic128 old;
+      assert(((uintptr_t) ptr) % 16 == 0);
+      memcpy(&v, &val, sizeof(v));
+      memcpy(&c, &cmp, sizeof(c));
+      if (op == SHARED_ATOMIC_SWAP) c = __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+      else __atomic_compare_exchange_n(p, &c, v, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+      memcpy(&old, &c, sizeof(old));
+      return old;
+    }
+
+    // the data of a segment and every reservation from it start on a 16 byte boundary
+    #define SHARED_HEAP_SEGMENT_HEADER_SIZE ALIGNED_ATOMIC128_SIZE( sizeof(_SharedHeapSegment) )
+
+    static inline char *__data_SharedHeapSegment(_SharedHeapSegment *segment) {
+      return ((char *) segment) + SHARED_HEAP_SEGMENT_HEADER_SIZE;
+    }
+
+    static inline size_t __used_SharedHeapSegment(_SharedHeapSegment *segment) {
+      size_t idx = atomic_load_explicit(&(segment->idx), memory_order_relaxed);
+      return idx < segment->size ? idx : segment->size;
+    }
+
+    static _SharedHeapSegment *__init_SharedHeapSegment(size_t size, _SharedHeapSegment *prev, int node) {
+      size = ALIGNED_ATOMIC128_SIZE(size);
+      _SharedHeapSegment *segment = (_SharedHeapSegment *) allocNumaOnNode( size + SHARED_HEAP_SEGMENT_HEADER_SIZE, node );
+      if (segment == NULL) DIE("Could not allocate %lld bytes for SharedHeap\n", (long long) size);
+      segment->size = size;
+      atomic_init(&(segment->idx), 0);
+      segment->prev = prev;
+      return segment;
+    }
+
+    static void __free_SharedHeapSegment(_SharedHeapSegment *segment) {
+      freeNuma(segment, segment->size + SHARED_HEAP_SEGMENT_HEADER_SIZE);
+    }
+
+    // install a segment after full, unless another thread already did.  Only the thread that sets growing
+    // allocates a segment, the others wait for current to move on (or for growing to clear, to try themselves)
+    static void __grow_SharedHeap(SharedHeap sharedHeap, _SharedHeapSegment *full, size_t minSize) {
+      long spins = 0;
+      while (atomic_load(&(sharedHeap->current)) == full) {
+        int idle = 0;
+        if (atomic_compare_exchange_weak(&(sharedHeap->growing), &idle, 1)) {
+          if (atomic_load(&(sharedHeap->current)) == full) {
+            size_t size = 2 * full->size;
+            if (size < minSize + sharedHeap->slabSize) size = minSize + sharedHeap->slabSize;
+            _SharedHeapSegment *segment = __init_SharedHeapSegment(ALIGNED_MEM_SIZE(size), full, sharedHeap->node);
+            atomic_store(&(sharedHeap->current), segment);
+            LOG(2, "Thread %d: grew SharedHeap by %lld bytes\n", MYTHREAD, (long long) segment->size);
+          }
+          atomic_store(&(sharedHeap->growing), 0);
+          return;
+        }
+        if (++spins % 1000 == 0) sched_yield(); // let an oversubscribed grower finish
+      }
+    }
+
+    // returns the start of count bytes of the current segment and sets *end to the end of what was reserved
+    // the reservation is cut short at the end of the segment, but is never shorter than minSize
+    static char *__reserve_SharedHeap(SharedHeap sharedHeap, size_t minSize, size_t count, char **end) {
+      while (1) {
+        _SharedHeapSegment *segment = atomic_load(&(sharedHeap->current));
+        size_t idx = atomic_fetch_add_explicit(&(segment->idx), count, memory_order_relaxed);
+        if (idx + minSize <= segment->size) {
+          char *data = __data_SharedHeapSegment(segment);
+          *end = data + (idx + count <= segment->size ? idx + count : segment->size);
+          return data + idx;
+        }
+        __grow_SharedHeap(sharedHeap, segment, minSize);
+      }
     }
-    #define ATOMIC_FETCHADD __shared_atomic_fetchadd
-    #define ATOMIC_CSWAP TODO
 
     static SharedPtr __alloc_from_SharedHeap(SharedHeap sharedHeap, size_t size) {
       assert(sharedHeap);
+      assert(MYTHREAD < sharedHeap->numThreads);
       size = ALIGNED_MEM_SIZE(size);
-      size_t idx = ATOMIC_FETCHADD(&(sharedHeap->idx), size); \
-      if (idx + size > sharedHeap->size) DIE("Thread %d: attempt to allocate past size of SharedHeap (%lld of %lld)\n", (long long idx), (long long) sharedHeap->size);
-      SharedPtr data = (SharedPtr) sharedHeap;
-      return data + idx + ALIGNED_MEM_SIZE( sizeof(_SharedHeap) );
+      char *end;
+      _SharedHeapSlab *slab = sharedHeap->slabs + MYTHREAD;
+      if (size >= sizeof(SharedAtomic128)) {
+        // anything that can hold a 128 bit word is 16 byte aligned for the lock free 128 bit atomics
+        size = ALIGNED_ATOMIC128_SIZE(size);
+        if (slab->next != NULL) slab->next = (char *) ALIGNED_ATOMIC128_SIZE((uintptr_t) slab->next);
+      }
+      if (slab->next == NULL || slab->next + size > slab->end) {
+        if (size > sharedHeap->slabSize / 4) return __reserve_SharedHeap(sharedHeap, size, ALIGNED_ATOMIC128_SIZE(size), &end);
+        slab->next = __reserve_SharedHeap(sharedHeap, size, sharedHeap->slabSize, &end);
+        slab->end = end;
+      }
+      SharedPtr ptr = slab->next;
+      slab->next += size;
+      return ptr;
     }
 
-    /* only MYTHREAD == rank will allocate the blocks of memory */
-    #define INIT_SHARED_HEAP(sharedHeap, blocks, bytes, rank) \
-      SharedHeap sharedHeap = NULL; \
-      if (MYTHREAD == rank) { \
-        size_t alignedBytes = ALIGNED_MEM_SIZE( bytes ) * blocks; \
-        sharedHeap  = (SharedHeap) malloc( alignedBytes + ALIGNED_MEM_SIZE( sizeof(_SharedHeap) ) ); \
-        if (sharedHeap == NULL) DIE("Could not allocate %lld bytes for SharedHeap\n", (long long) alignedBytes); \
-        sharedHeap->size = alignedBytes; \
-        sharedHeap->idx = 0; \
+    static SharedHeap __init_SharedHeap(size_t alignedBytes, int rank, size_t slabSize) {
+      SharedHeap sharedHeap = (SharedHeap) calloc(1, sizeof(_SharedHeap));
+      if (sharedHeap == NULL) DIE("Could not allocate a SharedHeap\n");
+      sharedHeap->node = getNumaNode();
+      atomic_init(&(sharedHeap->current), __init_SharedHeapSegment(alignedBytes, NULL, sharedHeap->node));
+      atomic_init(&(sharedHeap->growing), 0);
+      sharedHeap->slabSize = ALIGNED_ATOMIC128_SIZE( slabSize > 0 ? slabSize : MEM_ALIGN_SIZE ); // keeps the reservations 16 byte aligned
+      sharedHeap->rank = rank;
+      sharedHeap->numThreads = THREADS;
+      if (posix_memalign((void**) &(sharedHeap->slabs), 64, THREADS * sizeof(_SharedHeapSlab)) != 0) DIE("Could not allocate SharedHeap slabs for %d threads\n", THREADS);
+      memset(sharedHeap->slabs, 0, THREADS * sizeof(_SharedHeapSlab));
+      return sharedHeap;
+    }
+
+    static void __free_SharedHeapSegments(_SharedHeapSegment *segment) {
+      while (segment != NULL) {
+        _SharedHeapSegment *prev = segment->prev;
+        __free_SharedHeapSegment(segment);
+        segment = prev;
       }
+    }
 
+    static void __free_SharedHeap(SharedHeap sharedHeap) {
+      __free_SharedHeapSegments(atomic_load(&(sharedHeap->current)));
+      free(sharedHeap->forwards);
+      free(sharedHeap->slabs);
+      free(sharedHeap);
+    }
+
+    static int __cmp_SharedHeapForward(const void *a, const void *b) {
+      char *x = ((const _SharedHeapForward *) a)->oldStart, *y = ((const _SharedHeapForward *) b)->oldStart;
+      return x < y ? -1 : (x > y ? 1 : 0);
+    }
+
+    // copies every segment into a single one, oldest first, and records where each went
+    static void __consolidate_SharedHeap(SharedHeap sharedHeap) {
+      _SharedHeapSegment *segment, *current = atomic_load(&(sharedHeap->current));
+      int numSegments = 0;
+      size_t used = 0, size = 0;
+      for(segment = current; segment != NULL; segment = segment->prev) {
+        numSegments++;
+        used += __used_SharedHeapSegment(segment);
+        size += segment->size;
+      }
+      free(sharedHeap->forwards);
+      sharedHeap->forwards = NULL;
+      sharedHeap->numForwards = 0;
+      if (numSegments == 1) return;
+
+      // keep the capacity of the newest segment free for later allocations
+      _SharedHeapSegment *consolidated = __init_SharedHeapSegment(ALIGNED_MEM_SIZE(used + current->size - __used_SharedHeapSegment(current)), NULL, sharedHeap->node);
+      _SharedHeapForward *forwards = (_SharedHeapForward *) malloc(numSegments * sizeof(_SharedHeapForward));
+      if (forwards == NULL) DIE("Could not allocate %d SharedHeap forwards\n", numSegments);
+      size_t offset = used;
+      int i = numSegments;
+      for(segment = current; segment != NULL; segment = segment->prev) {
+        size_t segmentUsed = __used_SharedHeapSegment(segment);
+        offset -= segmentUsed;
+        i--;
+        forwards[i].oldStart = __data_SharedHeapSegment(segment);
+        forwards[i].oldEnd = forwards[i].oldStart + segmentUsed;
+        forwards[i].newStart = __data_SharedHeapSegment(consolidated) + offset;
+        memcpy(forwards[i].newStart, forwards[i].oldStart, segmentUsed);
+      }
+      qsort(forwards, numSegments, sizeof(_SharedHeapForward), __cmp_SharedHeapForward);
+      atomic_store(&(consolidated->idx), used); // a sum of multiples of 16, like every segment size
+      __free_SharedHeapSegments(current);
+      atomic_store(&(sharedHeap->current), consolidated);
+      sharedHeap->forwards = forwards;
+      sharedHeap->numForwards = numSegments;
+      memset(sharedHeap->slabs, 0, sharedHeap->numThreads * sizeof(_SharedHeapSlab));
+      LOG(1, "Thread %d: consolidated %d SharedHeap segments, %lld bytes\n", MYTHREAD, numSegments, (long long) used);
+    }
+
+    // where ptr moved to in the last consolidation, ptr itself if it did not move
+    // only for pointers allocated before that consolidation: later segments may reuse the old addresses
+    static SharedPtr __translate_SharedHeap(SharedHeap sharedHeap, SharedPtr ptr) {
+      int lo = 0, hi = sharedHeap->numForwards - 1;
+      while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        _SharedHeapForward *f = sharedHeap->forwards + mid;
+        if (ptr < f->oldStart) hi = mid - 1;
+        else if (ptr >= f->oldEnd) lo = mid + 1;
+        else return f->newStart + (ptr - f->oldStart);
+      }
+      return ptr;
+    }
+
+    /* collective: MYTHREAD == rank allocates the first segment and every thread gets the heap */
+    #define INIT_SHARED_HEAP_SLABS(sharedHeap, blocks, bytes, rank, slabSize) \
+      SharedHeap sharedHeap = NULL; \
+      do { \
+        if (MYTHREAD == rank) sharedHeap = __init_SharedHeap(ALIGNED_MEM_SIZE( bytes ) * (blocks), rank, slabSize); \
+        BROADCAST(&sharedHeap, sizeof(SharedHeap), rank); \
+      } while (0)
+    #define INIT_SHARED_HEAP(sharedHeap, blocks, bytes, rank) INIT_SHARED_HEAP_SLABS(sharedHeap, blocks, bytes, rank, 0)
+
+    /* collective */
     #define FREE_SHARED_HEAP(sharedHeap) \
-      { \
-        free(sharedHeap); \
+      do { \
+        int _owner = MYTHREAD == sharedHeap->rank; \
+        BARRIER; \
+        if (_owner) __free_SharedHeap(sharedHeap); \
         sharedHeap = NULL; \
       } while(0)
 
+    /* collective, no thread may allocate or hold a slab pointer across it */
+    #define CONSOLIDATE_SHARED_HEAP(sharedHeap) \
+      do { \
+        BARRIER; \
+        if (MYTHREAD == sharedHeap->rank) __consolidate_SharedHeap(sharedHeap); \
+        BARRIER; \
+      } while(0)
+
+    #define TRANSLATE_SHARED_PTR(sharedHeap, ptr) __translate_SharedHeap(sharedHeap, ptr)
+
     #define ALLOC_FROM_SHARED_HEAP(sharedHeap, type, varname, count) \
-        SharedPtr varname = __alloc_from_SharedHeap(sharedHeap, sizeof(type) * count)
+        SharedPtr varname = __alloc_from_SharedHeap(sharedHeap, sizeof(type) * (count))
 
     #define SHARED_MEMPUT(dst, src, size) memcpy(dst, src, size)
     #define SHARED_MEMGET(dst, src, size) memcpy(dst, src, size)
+    #define SHARED_HEAP_FLUSH(sharedHeap) do { } while (0)
+
+    // a copy is complete on return
+    typedef int SharedMemHandle;
+    #define SHARED_MEMGET_NB(dst, src, size) (memcpy(dst, src, size), 0)
+    #define SHARED_MEMPUT_NB(dst, src, size) (memcpy(dst, src, size), 0)
+    #define SHARED_MEM_WAIT(handle) ((void) (handle))
+    #define SHARED_MEM_TEST(handle) ((void) (handle), 1)
+    #define SHARED_MEM_WAITALL(handles, n) ((void) (handles), (void) (n))
+    #define BROADCAST_SHARED_PTR(sharedHeap, ptr, root) BROADCAST(&(ptr), sizeof(SharedPtr), root)
+    #define SHARED_PTR_ADD(ptr, bytes) ((ptr) + (bytes))
+    #define SHARED_PTR_LOCAL(ptr) ((char *) (ptr))
   #endif // NOT MPI
 
+  #define ATOMIC_FETCHADD(ptr, val) __shared_atomic_op(ptr, SHARED_ATOMIC_ADD, val, 0)
+  #define ATOMIC_FETCHAND(ptr, val) __shared_atomic_op(ptr, SHARED_ATOMIC_AND, val, 0)
+  #define ATOMIC_FETCHOR(ptr, val) __shared_atomic_op(ptr, SHARED_ATOMIC_OR, val, 0)
+  #define ATOMIC_FETCHXOR(ptr, val) __shared_atomic_op(ptr, SHARED_ATOMIC_XOR, val, 0)
+  #define ATOMIC_SWAP(ptr, val) __shared_atomic_op(ptr, SHARED_ATOMIC_SWAP, val, 0)
+  #define ATOMIC_CSWAP(ptr, oldval, newval) __shared_atomic_op(ptr, SHARED_ATOMIC_CSWAP, newval, oldval)
+
+  #define ATOMIC_FETCHADD_NB(ptr, val, result) __shared_atomic_nb(ptr, SHARED_ATOMIC_ADD, val, 0, result)
+  #define ATOMIC_FETCHAND_NB(ptr, val, result) __shared_atomic_nb(ptr, SHARED_ATOMIC_AND, val, 0, result)
+  #define ATOMIC_FETCHOR_NB(ptr, val, result) __shared_atomic_nb(ptr, SHARED_ATOMIC_OR, val, 0, result)
+  #define ATOMIC_FETCHXOR_NB(ptr, val, result) __shared_atomic_nb(ptr, SHARED_ATOMIC_XOR, val, 0, result)
+  #define ATOMIC_SWAP_NB(ptr, val, result) __shared_atomic_nb(ptr, SHARED_ATOMIC_SWAP, val, 0, result)
+  #define ATOMIC_CSWAP_NB(ptr, oldval, newval, result) __shared_atomic_nb(ptr, SHARED_ATOMIC_CSWAP, newval, oldval, result)
+
 #endif // NOT UPC
 
+static const SharedAtomic128 __zero_SharedAtomic128 = { 0, 0 };
+#define ATOMIC_CSWAP128(sharedHeap, ptr, oldval, newval) __shared_atomic_op128(sharedHeap, ptr, SHARED_ATOMIC_CSWAP, newval, oldval)
+#define ATOMIC_SWAP128(sharedHeap, ptr, val) __shared_atomic_op128(sharedHeap, ptr, SHARED_ATOMIC_SWAP, val, __zero_SharedAtomic128)
+#define ATOMIC_READ128(sharedHeap, ptr) __shared_atomic_op128(sharedHeap, ptr, SHARED_ATOMIC_CSWAP, __zero_SharedAtomic128, __zero_SharedAtomic128)
+
 #if defined (__cplusplus)
 }
 #endif
@@ -0,0 +1,325 @@
+#ifndef THREAD_BARRIER_H_
+#define THREAD_BARRIER_H_
+
+/*
+ * Barriers among the threads of one process, for the OpenMP and pthreads backends of CommonParallel.h
+ *
+ * THREAD_BARRIER_CENTRAL        one shared counter and a sense-reversing release flag
+ * THREAD_BARRIER_DISSEMINATION  log2(P) rounds, in round r thread i signals thread (i + 2^r) % P
+ * THREAD_BARRIER_TOURNAMENT     static binary arrival tree, winners wake their losers on the way back down
+ * THREAD_BARRIER_NUMA           the tournament with the threads ordered by NUMA node, so that the early
+ *                               rounds pair up threads on the same node and only log2(nodes) rounds cross nodes
+ * THREAD_BARRIER_FUTEX          the central barrier, but waiters sleep on a futex after BARRIER_SPIN_COUNT spins
+ *
+ * Every thread calls waitThreadBarrier(b, thread) with its own 0 <= thread < numThreads.
+ * The spinning algorithms yield the cpu after BARRIER_SPIN_COUNT spins, and only the futex barrier
+ * actually sleeps.  When there are more threads than online cpus the waiters give up the cpu at once.
+ * The NUMA ordering is taken from where each thread runs at its first barrier, so it is only
+ * meaningful when the threads are pinned.
+ *
+ * ThreadSplitBarrier is a split-phase barrier that also sums one int64_t from each thread:
+ * notifyThreadSplitBarrier(b, thread, value) arrives and tryThreadSplitBarrier(b, thread, &sum) is
+ * nonzero once every thread has arrived.  A thread must complete one before notifying the next.
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+
+#ifdef __linux__
+  #include <linux/futex.h>
+  #include <sys/syscall.h>
+#endif
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+#ifndef BARRIER_SPIN_COUNT
+#define BARRIER_SPIN_COUNT 10000
+#endif
+
+#define THREAD_BARRIER_MAX_ROUNDS 32
+
+typedef enum {
+    THREAD_BARRIER_CENTRAL, THREAD_BARRIER_DISSEMINATION, THREAD_BARRIER_TOURNAMENT,
+    THREAD_BARRIER_NUMA, THREAD_BARRIER_FUTEX, NUM_THREAD_BARRIER_ALGORITHMS
+} ThreadBarrierAlgorithm;
+
+// private state of each thread, one cache line apart
+typedef struct {
+    _Alignas(64) atomic_int flags[2][THREAD_BARRIER_MAX_ROUNDS]; // dissemination, written by the partners
+    int parity, sense, centralSense, position, node, placed;
+} _ThreadBarrierSlot;
+
+// arrival and release flags of each tournament position
+typedef struct {
+    _Alignas(64) atomic_int arrived, release;
+} _ThreadBarrierFlag;
+
+typedef struct {
+    _Alignas(64) atomic_int count;
+    _Alignas(64) atomic_int sense;  // central release flag and futex generation
+    atomic_int sleepers;
+    int algorithm, numThreads, numRounds, spinCount;
+    _ThreadBarrierSlot *slots;      // by thread
+    _ThreadBarrierFlag *tree;       // by tournament position
+} _ThreadBarrier;
+typedef _ThreadBarrier *ThreadBarrier;
+
+// the arrivals and the sum of one split barrier epoch
+typedef struct {
+    _Alignas(64) atomic_int count;
+    _Atomic int64_t sum;
+} _ThreadSplitCounter;
+
+typedef struct {
+    _Alignas(64) int epoch, notified;
+} _ThreadSplitSlot;
+
+typedef struct {
+    _ThreadSplitCounter counters[3]; // by epoch % 3
+    int numThreads, spinCount;
+    _ThreadSplitSlot *slots;         // by thread
+} _ThreadSplitBarrier;
+typedef _ThreadSplitBarrier *ThreadSplitBarrier;
+
+static inline const char *getThreadBarrierAlgorithmName(int algorithm) {
+    static const char *names[NUM_THREAD_BARRIER_ALGORITHMS] = { "central", "dissemination", "tournament", "numa", "futex" };
+    return (algorithm >= 0 && algorithm < NUM_THREAD_BARRIER_ALGORITHMS) ? names[algorithm] : "unknown";
+}
+
+// returns -1 for a name that is not one of the algorithms above
+static inline int parseThreadBarrierAlgorithm(const char *name) {
+    int i;
+    for(i = 0; name != NULL && i < NUM_THREAD_BARRIER_ALGORITHMS; i++)
+        if (strcmp(name, getThreadBarrierAlgorithmName(i)) == 0) return i;
+    return -1;
+}
+
+static inline void __cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline void __futex_wait(atomic_int *addr, int val) {
+#ifdef __linux__
+    syscall(SYS_futex, (int*) addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    sched_yield();
+#endif
+}
+
+static inline void __futex_wake(atomic_int *addr) {
+#ifdef __linux__
+    syscall(SYS_futex, (int*) addr, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+static inline void _spinUntilThreadBarrier(atomic_int *flag, int value, int spinCount) {
+    int spins = 0;
+    while (atomic_load_explicit(flag, memory_order_acquire) != value) {
+        if (++spins < spinCount) __cpu_relax();
+        else sched_yield();
+    }
+}
+
+static inline int _getNumaNodeThreadBarrier() {
+#if defined(__linux__) && defined(SYS_getcpu)
+    unsigned cpu = 0, node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) return (int) node;
+#endif
+    return 0;
+}
+
+static ThreadBarrier initThreadBarrier(int numThreads, int algorithm) {
+    int i;
+    ThreadBarrier b = NULL;
+    if (numThreads < 1) numThreads = 1;
+    if (algorithm < 0 || algorithm >= NUM_THREAD_BARRIER_ALGORITHMS) algorithm = THREAD_BARRIER_FUTEX;
+    if (posix_memalign((void**) &b, 64, sizeof(_ThreadBarrier)) != 0
+        || posix_memalign((void**) &(b->slots), 64, numThreads * sizeof(_ThreadBarrierSlot)) != 0
+        || posix_memalign((void**) &(b->tree), 64, numThreads * sizeof(_ThreadBarrierFlag)) != 0) {
+        fprintf(stderr, "Could not allocate a barrier for %d threads\n", numThreads);
+        exit(1);
+    }
+    atomic_init(&(b->count), numThreads);
+    atomic_init(&(b->sense), 0);
+    atomic_init(&(b->sleepers), 0);
+    b->algorithm = algorithm;
+    b->numThreads = numThreads;
+    b->spinCount = numThreads > sysconf(_SC_NPROCESSORS_ONLN) ? 1 : BARRIER_SPIN_COUNT;
+    for(b->numRounds = 0; (1 << b->numRounds) < numThreads; b->numRounds++);
+    memset(b->slots, 0, numThreads * sizeof(_ThreadBarrierSlot));
+    memset(b->tree, 0, numThreads * sizeof(_ThreadBarrierFlag));
+    for(i = 0; i < numThreads; i++) {
+        b->slots[i].sense = (algorithm == THREAD_BARRIER_DISSEMINATION); // dissemination starts at sense 1
+        b->slots[i].position = i;
+        b->slots[i].placed = (algorithm != THREAD_BARRIER_NUMA);
+    }
+    return b;
+}
+
+static void freeThreadBarrier(ThreadBarrier b) {
+    if (b == NULL) return;
+    free(b->slots);
+    free(b->tree);
+    free(b);
+}
+
+static inline void _waitCentralThreadBarrier(ThreadBarrier b, _ThreadBarrierSlot *slot) {
+    int sense = slot->centralSense = !slot->centralSense;
+    if (atomic_fetch_sub_explicit(&(b->count), 1, memory_order_acq_rel) == 1) {
+        atomic_store_explicit(&(b->count), b->numThreads, memory_order_relaxed);
+        atomic_store_explicit(&(b->sense), sense, memory_order_release);
+    } else {
+        _spinUntilThreadBarrier(&(b->sense), sense, b->spinCount);
+    }
+}
+
+static inline void _waitFutexThreadBarrier(ThreadBarrier b) {
+    int gen = atomic_load_explicit(&(b->sense), memory_order_acquire);
+    if (atomic_fetch_sub_explicit(&(b->count), 1, memory_order_acq_rel) == 1) {
+        // last to arrive resets the count and releases everyone
+        atomic_store_explicit(&(b->count), b->numThreads, memory_order_relaxed);
+        atomic_store(&(b->sense), gen + 1);
+        if (atomic_load(&(b->sleepers)) > 0) __futex_wake(&(b->sense));
+    } else {
+        int spins = 0;
+        while (atomic_load_explicit(&(b->sense), memory_order_acquire) == gen) {
+            if (++spins < b->spinCount) {
+                __cpu_relax();
+            } else {
+                atomic_fetch_add(&(b->sleepers), 1);
+                __futex_wait(&(b->sense), gen);
+                atomic_fetch_sub(&(b->sleepers), 1);
+            }
+        }
+    }
+}
+
+static inline void _waitDisseminationThreadBarrier(ThreadBarrier b, int thread, _ThreadBarrierSlot *slot) {
+    int r, parity = slot->parity, sense = slot->sense;
+    for(r = 0; r < b->numRounds; r++) {
+        int partner = (thread + (1 << r)) % b->numThreads;
+        atomic_store_explicit(&(b->slots[partner].flags[parity][r]), sense, memory_order_release);
+        _spinUntilThreadBarrier(&(slot->flags[parity][r]), sense, b->spinCount);
+    }
+    if (parity == 1) slot->sense = !sense;
+    slot->parity = 1 - parity;
+}
+
+static inline void _waitTournamentThreadBarrier(ThreadBarrier b, _ThreadBarrierSlot *slot) {
+    int r, p = slot->position, sense = slot->sense = !slot->sense;
+    for(r = 0; r < b->numRounds; r++) {
+        if (p & (1 << r)) {
+            // lost this round: report to the winner and wait to be woken
+            atomic_store_explicit(&(b->tree[p].arrived), sense, memory_order_release);
+            _spinUntilThreadBarrier(&(b->tree[p].release), sense, b->spinCount);
+            break;
+        }
+        if (p + (1 << r) < b->numThreads) _spinUntilThreadBarrier(&(b->tree[p + (1 << r)].arrived), sense, b->spinCount);
+    }
+    // wake the threads beaten on the way up, the farthest first
+    for(r--; r >= 0; r--)
+        if (p + (1 << r) < b->numThreads) atomic_store_explicit(&(b->tree[p + (1 << r)].release), sense, memory_order_release);
+}
+
+// at the first NUMA barrier each thread publishes its node, then places itself after every
+// thread on a lower node (or on the same node with a lower thread id)
+static void _placeNumaThreadBarrier(ThreadBarrier b, int thread, _ThreadBarrierSlot *slot) {
+    int i, position = 0;
+    slot->node = _getNumaNodeThreadBarrier();
+    _waitCentralThreadBarrier(b, slot);
+    for(i = 0; i < b->numThreads; i++) {
+        int node = b->slots[i].node;
+        if (node < slot->node || (node == slot->node && i < thread)) position++;
+    }
+    slot->position = position;
+    slot->placed = 1;
+}
+
+static inline void waitThreadBarrier(ThreadBarrier b, int thread) {
+    _ThreadBarrierSlot *slot = b->slots + thread;
+    if (b->numThreads == 1) return;
+    switch(b->algorithm) {
+        case THREAD_BARRIER_CENTRAL: _waitCentralThreadBarrier(b, slot); break;
+        case THREAD_BARRIER_DISSEMINATION: _waitDisseminationThreadBarrier(b, thread, slot); break;
+        case THREAD_BARRIER_NUMA: if (!slot->placed) _placeNumaThreadBarrier(b, thread, slot); // fall through
+        case THREAD_BARRIER_TOURNAMENT: _waitTournamentThreadBarrier(b, slot); break;
+        default: _waitFutexThreadBarrier(b); break;
+    }
+}
+
+static ThreadSplitBarrier initThreadSplitBarrier(int numThreads) {
+    int i;
+    ThreadSplitBarrier b = NULL;
+    if (numThreads < 1) numThreads = 1;
+    if (posix_memalign((void**) &b, 64, sizeof(_ThreadSplitBarrier)) != 0
+        || posix_memalign((void**) &(b->slots), 64, numThreads * sizeof(_ThreadSplitSlot)) != 0) {
+        fprintf(stderr, "Could not allocate a split barrier for %d threads\n", numThreads);
+        exit(1);
+    }
+    for(i = 0; i < 3; i++) {
+        atomic_init(&(b->counters[i].count), 0);
+        atomic_init(&(b->counters[i].sum), 0);
+    }
+    b->numThreads = numThreads;
+    b->spinCount = numThreads > sysconf(_SC_NPROCESSORS_ONLN) ? 1 : BARRIER_SPIN_COUNT;
+    memset(b->slots, 0, numThreads * sizeof(_ThreadSplitSlot));
+    return b;
+}
+
+static void freeThreadSplitBarrier(ThreadSplitBarrier b) {
+    if (b == NULL) return;
+    free(b->slots);
+    free(b);
+}
+
+// Epoch e counts on counters[e % 3].  Arriving at e also clears counters[(e + 1) % 3]: it was last
+// used by epoch e - 2, which every thread completed before it could notify e - 1, and it is next used
+// by epoch e + 1, which nobody can notify before this thread has arrived at e.
+static inline void notifyThreadSplitBarrier(ThreadSplitBarrier b, int thread, int64_t value) {
+    _ThreadSplitSlot *slot = b->slots + thread;
+    _ThreadSplitCounter *next = b->counters + (slot->epoch + 1) % 3, *mine = b->counters + slot->epoch % 3;
+    if (slot->notified) {
+        fprintf(stderr, "Thread %d notified a split barrier twice\n", thread);
+        exit(1);
+    }
+    atomic_store_explicit(&(next->count), 0, memory_order_relaxed);
+    atomic_store_explicit(&(next->sum), 0, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(mine->sum), value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&(mine->count), 1, memory_order_release);
+    slot->notified = 1;
+}
+
+static inline int tryThreadSplitBarrier(ThreadSplitBarrier b, int thread, int64_t *sum) {
+    _ThreadSplitSlot *slot = b->slots + thread;
+    _ThreadSplitCounter *mine = b->counters + slot->epoch % 3;
+    if (atomic_load_explicit(&(mine->count), memory_order_acquire) != b->numThreads) return 0;
+    if (sum != NULL) *sum = atomic_load_explicit(&(mine->sum), memory_order_relaxed);
+    slot->epoch++;
+    slot->notified = 0;
+    return 1;
+}
+
+static inline void waitThreadSplitBarrier(ThreadSplitBarrier b, int thread, int64_t *sum) {
+    int spins = 0;
+    while (!tryThreadSplitBarrier(b, thread, sum)) {
+        if (++spins < b->spinCount) __cpu_relax();
+        else sched_yield();
+    }
+}
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif // THREAD_BARRIER_H_
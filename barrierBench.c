@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CommonParallel.h"
+#include "ThreadBarrier.h"
+
+/*
+ * Barrier latency of the BARRIER macro, of the split-phase BARRIER_NOTIFY / BARRIER_WAIT (which also
+ * checks the sum it carries) and, when all threads share one process, of each ThreadBarrier.h algorithm
+ * at the current thread count.  Sweep the thread count from the shell, for example:
+ *   for t in 16 32 64 128 256; do OMP_NUM_THREADS=$t ./barrierBench-omp 100000; done
+ *   for n in 2 4 8; do mpirun -np $n ./barrierBench-mpi 100000; done
+ */
+
+#define USAGE "Usage: barrierBench [iterations]"
+
+#define ALG_BARRIER -2
+#define ALG_SPLIT -1
+
+static ThreadBarrier benchBarrier = NULL;
+
+static inline int benchWait(int alg) {
+  int64_t sum;
+  if (alg == ALG_BARRIER) {
+    BARRIER;
+  } else if (alg == ALG_SPLIT) {
+    BARRIER_NOTIFY(MYTHREAD);
+    BARRIER_WAIT(&sum);
+    return sum != (int64_t) THREADS * (THREADS - 1) / 2;
+  } else {
+    waitThreadBarrier(benchBarrier, MYTHREAD);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  INIT(argc, argv);
+
+  int i, alg, numAlgorithms = NUM_THREAD_BARRIER_ALGORITHMS, errors = 0, iterations = argc > 1 ? atoi(argv[1]) : 10000;
+#ifdef MPI_VERSION
+  numAlgorithms = 0; // the ThreadBarrier.h algorithms only synchronize the threads of one process
+#endif
+  if (iterations < 1) {
+    fprintf(stderr, "%s\n", USAGE);
+    EXIT_FUNC(1);
+  }
+  if (!MYTHREAD) {
+    printf("%-8s %-14s %10s %12s\n", "threads", "algorithm", "iterations", "us/barrier");
+    fflush(stdout);
+  }
+
+  for(alg = ALG_BARRIER; alg < numAlgorithms; alg++) {
+    if (alg >= 0 && !MYTHREAD) benchBarrier = initThreadBarrier(THREADS, alg);
+    BARRIER;
+
+    // warm up, then time
+    for(i = 0; i < 100; i++) errors += benchWait(alg);
+    double start = NOW();
+    for(i = 0; i < iterations; i++) errors += benchWait(alg);
+    double elapsed = NOW() - start;
+
+    ALLREDUCE(&elapsed, 1, COLL_DOUBLE, COLL_MAX);
+    if (!MYTHREAD) {
+      printf("%-8d %-14s %10d %12.3f\n", THREADS, alg == ALG_BARRIER ? "BARRIER" : (alg == ALG_SPLIT ? "split" : getThreadBarrierAlgorithmName(alg)), iterations, elapsed * 1e6 / iterations);
+      fflush(stdout);
+    }
+    BARRIER;
+    if (alg >= 0 && !MYTHREAD) {
+      freeThreadBarrier(benchBarrier);
+      benchBarrier = NULL;
+    }
+  }
+
+  ALLREDUCE(&errors, 1, COLL_INT, COLL_SUM);
+  if (errors) DIE("%d split barriers returned the wrong sum\n", errors);
+
+  FINALIZE();
+  return 0;
+}
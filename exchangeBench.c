@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CommonParallel.h"
+#include "Exchange.h"
+
+/*
+ * Throughput of the Exchange: every thread streams records to random destinations through rounds
+ * capped at memoryCap bytes, and every receiver checks that each record is its own, that the records
+ * of each sender arrive in the order they were pushed, and that the sums of their sequence numbers
+ * match what the senders sent (compared through ALLTOALL).
+ * Sweep the thread count from the shell:
+ *   for t in 1 2 4 8 16 32; do OMP_NUM_THREADS=$t ./exchangeBench-omp 1000000 32; done
+ *   for n in 2 4 8; do mpirun -np $n ./exchangeBench-mpi 1000000 32; done
+ */
+
+#define USAGE "Usage: exchangeBench [recordsPerThread [bytesPerRecord [memoryCap]]]"
+
+typedef struct {
+  uint32_t source, dest;
+  uint64_t seq;
+} Record;
+
+static inline uint64_t nextRandom(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+int main(int argc, char **argv) {
+
+  INIT(argc, argv);
+
+  long i, records = argc > 1 ? atol(argv[1]) : 1000000;
+  size_t t, bytes = argc > 2 ? (size_t) atol(argv[2]) : 32, memoryCap = argc > 3 ? (size_t) atol(argv[3]) : 0;
+  if (records < 1 || bytes < sizeof(Record)) {
+    fprintf(stderr, "%s\n", USAGE);
+    EXIT_FUNC(1);
+  }
+  if (!MYTHREAD) {
+    printf("%-8s %8s %12s %8s %12s %12s\n", "threads", "bytes", "records", "rounds", "seconds", "MB/s");
+    fflush(stdout);
+  }
+  uint64_t *sent = (uint64_t *) calloc(3 * THREADS, sizeof(uint64_t)), *expected = sent + THREADS, *got = expected + THREADS;
+  int64_t *last = (int64_t *) malloc(THREADS * sizeof(int64_t));
+  if (sent == NULL || last == NULL) DIE("Could not allocate the checks for %d threads\n", THREADS);
+  for(t = 0; t < (size_t) THREADS; t++) last[t] = -1;
+  uint64_t seed = 0x9E3779B97F4A7C15ULL * (MYTHREAD + 1);
+  int64_t errors = 0, numReceived = 0;
+
+  Exchange ex = initExchange(bytes, memoryCap);
+  BARRIER;
+  double start = NOW();
+  int more, rounds = 0;
+  i = 0;
+  do {
+    while (i < records && !isExchangeFull(ex)) {
+      Record r;
+      r.source = MYTHREAD;
+      r.dest = (uint32_t) (nextRandom(&seed) % THREADS);
+      r.seq = i++;
+      sent[r.dest] += r.seq;
+      memcpy(pushExchange(ex, r.dest), &r, sizeof(Record));
+    }
+    void *received;
+    size_t count;
+    more = exchangeRound(ex, i < records, &received, &count);
+    rounds++;
+    for(t = 0; t < count; t++) {
+      Record r;
+      memcpy(&r, ((char *) received) + t * bytes, sizeof(Record));
+      if (r.dest != (uint32_t) MYTHREAD || r.source >= (uint32_t) THREADS || (int64_t) r.seq <= last[r.source]) {
+        errors++;
+        continue;
+      }
+      last[r.source] = r.seq;
+      got[r.source] += r.seq;
+    }
+    numReceived += count;
+  } while (more);
+  double elapsed = NOW() - start;
+  freeExchange(ex);
+
+  ALLTOALL(sent, expected, sizeof(uint64_t));
+  for(t = 0; t < (size_t) THREADS; t++) if (expected[t] != got[t]) errors++;
+  ALLREDUCE(&numReceived, 1, COLL_INT64, COLL_SUM);
+  if (numReceived != (int64_t) records * THREADS) errors++;
+  ALLREDUCE(&elapsed, 1, COLL_DOUBLE, COLL_MAX);
+  if (!MYTHREAD) {
+    printf("%-8d %8ld %12lld %8d %12.4f %12.2f\n", THREADS, (long) bytes, (long long) numReceived, rounds, elapsed, numReceived * bytes / elapsed / 1e6);
+    fflush(stdout);
+  }
+  free(sent);
+  free(last);
+
+  ALLREDUCE(&errors, 1, COLL_INT64, COLL_SUM);
+  if (errors) DIE("%lld records were lost, misdelivered or out of order\n", (long long) errors);
+
+  FINALIZE();
+  return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CommonParallel.h"
+#include "DistHashMap.h"
+
+/*
+ * k-mer counting on a DistHashMap: every thread samples reads from the same random genome and
+ * counts their k-mers (2 bits per base, k <= 31) with DIST_HASH_ADD, then looks all of them up again
+ * in one bulk lookup, along with as many keys that can not be k-mers.  It checks the counts add up
+ * and prints the histogram of k-mer counts.
+ * Sweep the thread count from the shell:
+ *   for t in 1 2 4 8 16 32; do OMP_NUM_THREADS=$t ./kmerCountBench-omp 100000 100 31; done
+ *   for n in 2 4 8; do mpirun -np $n ./kmerCountBench-mpi 100000 100 31; done
+ */
+
+#define USAGE "Usage: kmerCountBench [readsPerThread [readLength [k [genomeLength]]]]"
+
+#define HISTOGRAM_BINS 10
+
+static inline uint64_t nextRandom(uint64_t *state) {
+  uint64_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return *state = x;
+}
+
+static void printResult(const char *phase, long ops, double elapsed) {
+  ALLREDUCE(&elapsed, 1, COLL_DOUBLE, COLL_MAX);
+  if (!MYTHREAD) {
+    printf("%-8d %-8s %12ld %12.4f %14.2f\n", THREADS, phase, ops * THREADS, elapsed, ops * THREADS / elapsed / 1e6);
+    fflush(stdout);
+  }
+}
+
+int main(int argc, char **argv) {
+
+  INIT(argc, argv);
+
+  long i, j, reads = argc > 1 ? atol(argv[1]) : 100000;
+  int readLength = argc > 2 ? atoi(argv[2]) : 100, k = argc > 3 ? atoi(argv[3]) : 31;
+  long genomeLength = argc > 4 ? atol(argv[4]) : 1000000;
+  if (reads < 1 || k < 1 || k > 31 || readLength < k || genomeLength < readLength) {
+    fprintf(stderr, "%s\n", USAGE);
+    EXIT_FUNC(1);
+  }
+  long kmersPerRead = readLength - k + 1, kmers = reads * kmersPerRead;
+  uint64_t kmerMask = (((uint64_t) 1) << (2 * k)) - 1, seed = 88172645463325252ULL;
+
+  // the same genome on every thread, and different reads
+  char *genome = (char *) malloc(genomeLength);
+  uint64_t *keys = (uint64_t *) malloc((kmers + reads) * sizeof(uint64_t)), *values = (uint64_t *) malloc((kmers + reads) * sizeof(uint64_t));
+  char *found = (char *) malloc(kmers + reads);
+  if (genome == NULL || keys == NULL || values == NULL || found == NULL) DIE("Could not allocate %ld k-mers\n", kmers);
+  for(i = 0; i < genomeLength; i++) genome[i] = (char) (nextRandom(&seed) & 3);
+  seed = 0x9E3779B97F4A7C15ULL * (MYTHREAD + 1);
+  for(i = 0; i < reads; i++) {
+    long start = (long) (nextRandom(&seed) % (uint64_t) (genomeLength - readLength + 1));
+    uint64_t kmer = 0;
+    for(j = 0; j < readLength; j++) {
+      kmer = ((kmer << 2) | genome[start + j]) & kmerMask;
+      if (j >= k - 1) keys[i * kmersPerRead + j - k + 1] = kmer;
+    }
+  }
+  free(genome);
+
+  if (!MYTHREAD) {
+    printf("%-8s %-8s %12s %12s %14s\n", "threads", "phase", "k-mers", "seconds", "Mops/s");
+    fflush(stdout);
+  }
+  DistHashMap map = initDistHashMap(kmers / 2, DIST_HASH_ADD, 0, 0);
+  BARRIER;
+
+  double start = NOW();
+  for(i = 0; i < kmers; i++) updateDistHashMap(map, keys[i], 1);
+  flushDistHashMap(map);
+  printResult("count", kmers, NOW() - start);
+
+  // keys of 2k+1 or more bits are never k-mers
+  for(i = 0; i < reads; i++) keys[kmers + i] = (nextRandom(&seed) | (kmerMask + 1)) & (DIST_HASH_EMPTY_KEY >> 1);
+  BARRIER;
+  start = NOW();
+  size_t numFound = lookupDistHashMap(map, keys, values, found, kmers + reads);
+  printResult("lookup", kmers + reads, NOW() - start);
+
+  int64_t errors = numFound != (size_t) kmers;
+  for(i = 0; i < kmers; i++) if (!found[i] || values[i] < 1) errors++;
+  for(i = kmers; i < kmers + reads; i++) if (found[i]) errors++;
+
+  // every k-mer was counted once
+  uint64_t histogram[HISTOGRAM_BINS + 1], total = 0, distinct = getDistHashMapSize(map);
+  memset(histogram, 0, sizeof(histogram));
+  size_t iter = 0;
+  DistHashEntry *entry;
+  while ((entry = nextLocalDistHashEntry(map, &iter)) != NULL) {
+    total += entry->value;
+    histogram[entry->value < HISTOGRAM_BINS ? entry->value : HISTOGRAM_BINS]++;
+  }
+  ALLREDUCE(&total, 1, COLL_UINT64, COLL_SUM);
+  ALLREDUCE(histogram, HISTOGRAM_BINS + 1, COLL_UINT64, COLL_SUM);
+  if (total != (uint64_t) kmers * THREADS) errors++;
+  if (!MYTHREAD) {
+    printf("%lld distinct of %lld k-mers, count histogram:", (long long) distinct, (long long) total);
+    for(i = 1; i <= HISTOGRAM_BINS; i++) printf(" %s%ld:%lld", i == HISTOGRAM_BINS ? ">=" : "", i, (long long) histogram[i]);
+    printf("\n");
+    fflush(stdout);
+  }
+
+  freeDistHashMap(map);
+  free(keys);
+  free(values);
+  free(found);
+
+  ALLREDUCE(&errors, 1, COLL_INT64, COLL_SUM);
+  if (errors) DIE("%lld k-mers were miscounted or misreported\n", (long long) errors);
+
+  FINALIZE();
+  return 0;
+}
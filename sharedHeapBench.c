@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CommonParallel.h"
+#include "SharedHeap.h"
+
+/*
+ * Allocation throughput of one SharedHeap shared by every thread: with per-thread slabs,
+ * with one atomic per allocation (slab size 0), and with slabs starting from a heap 1/64th
+ * of the size needed so that it has to grow (followed by a checked consolidation) where the
+ * backend can grow.  Each allocation is followed by a one byte SHARED_MEMPUT.
+ * The slab pass then reads every byte back, once with blocking SHARED_MEMGETs and once with
+ * SHARED_MEMGET_NB keeping GET_PIPELINE_DEPTH gets outstanding.
+ * Sweep the thread count from the shell:
+ *   for t in 1 2 4 8 16 32 64 128; do OMP_NUM_THREADS=$t ./sharedHeapBench-omp 1000000 32; done
+ *   for n in 2 4 8; do mpirun -np $n ./sharedHeapBench-mpi 1000000 32; done
+ * With MPI the heap lives on rank 0, so the other ranks allocate remotely.
+ */
+
+#define USAGE "Usage: sharedHeapBench [allocationsPerThread [bytesPerAllocation]]"
+
+#ifndef GET_PIPELINE_DEPTH
+#define GET_PIPELINE_DEPTH 256
+#endif
+
+static void printResult(const char *mode, long ops, long bytes, double elapsed) {
+  ALLREDUCE(&elapsed, 1, COLL_DOUBLE, COLL_MAX);
+  if (!MYTHREAD) {
+    printf("%-8d %-8s %12ld %8ld %12.4f %14.2f\n", THREADS, mode, ops * THREADS, bytes, elapsed, ops * THREADS / elapsed / 1e6);
+    fflush(stdout);
+  }
+}
+
+int main(int argc, char **argv) {
+
+  INIT(argc, argv);
+
+  long i, allocations = argc > 1 ? atol(argv[1]) : 1000000;
+  long bytes = argc > 2 ? atol(argv[2]) : 32;
+  int pass, numPasses = 2, errors = 0;
+#ifdef CONSOLIDATE_SHARED_HEAP
+  numPasses = 3;
+#endif
+  if (allocations < 1 || bytes < 1) {
+    fprintf(stderr, "%s\n", USAGE);
+    EXIT_FUNC(1);
+  }
+  if (!MYTHREAD) {
+    printf("%-8s %-8s %12s %8s %12s %14s\n", "threads", "mode", "allocations", "bytes", "seconds", "Mops/s");
+    fflush(stdout);
+  }
+
+  for(pass = 0; pass < numPasses; pass++) {
+    size_t slabSize = pass == 1 ? 0 : SHARED_HEAP_SLAB_SIZE;
+    // room for every allocation plus the unused tail of each thread's last slab
+    size_t blocks = allocations * THREADS + (slabSize / ALIGNED_MEM_SIZE(bytes) + 1) * THREADS;
+    if (pass == 2) blocks = blocks / 64 + 1;
+    INIT_SHARED_HEAP_SLABS(heap, blocks, bytes, 0, slabSize);
+    SharedPtr *ptrs = NULL;
+    if (pass != 1 && (ptrs = (SharedPtr *) malloc(allocations * sizeof(SharedPtr))) == NULL) DIE("Could not allocate %ld pointers\n", allocations);
+
+    double start = NOW();
+    char c;
+    for(i = 0; i < allocations; i++) {
+      ALLOC_FROM_SHARED_HEAP(heap, char, ptr, bytes);
+      c = (char) (i + MYTHREAD);
+      SHARED_MEMPUT(ptr, &c, 1);
+      if (ptrs) ptrs[i] = ptr;
+      if (i == allocations - 1) {
+        SHARED_HEAP_FLUSH(heap);
+        SHARED_MEMGET(&c, ptr, 1);
+        if (c != (char) (i + MYTHREAD)) errors++;
+      }
+    }
+    printResult(pass == 0 ? "slab" : (pass == 1 ? "atomic" : "grow"), allocations, bytes, NOW() - start);
+
+    if (pass == 0) {
+      char *got = (char *) malloc(allocations);
+      SharedMemHandle handles[GET_PIPELINE_DEPTH];
+      if (got == NULL) DIE("Could not allocate %ld bytes\n", allocations);
+      SHARED_HEAP_FLUSH(heap);
+      BARRIER;
+      start = NOW();
+      for(i = 0; i < allocations; i++) SHARED_MEMGET(got + i, ptrs[i], 1);
+      printResult("get", allocations, 1, NOW() - start);
+      for(i = 0; i < allocations; i++) if (got[i] != (char) (i + MYTHREAD)) errors++;
+
+      memset(got, 0, allocations);
+      BARRIER;
+      start = NOW();
+      for(i = 0; i < allocations; i++) {
+        // reuse the slot of the get issued GET_PIPELINE_DEPTH ago
+        if (i >= GET_PIPELINE_DEPTH) SHARED_MEM_WAIT(handles[i % GET_PIPELINE_DEPTH]);
+        handles[i % GET_PIPELINE_DEPTH] = SHARED_MEMGET_NB(got + i, ptrs[i], 1);
+      }
+      SHARED_MEM_WAITALL(handles, allocations < GET_PIPELINE_DEPTH ? (int) allocations : GET_PIPELINE_DEPTH);
+      printResult("get_nb", allocations, 1, NOW() - start);
+      for(i = 0; i < allocations; i++) if (got[i] != (char) (i + MYTHREAD)) errors++;
+      free(got);
+      free(ptrs);
+      ptrs = NULL;
+    }
+
+#ifdef CONSOLIDATE_SHARED_HEAP
+    if (ptrs) {
+      CONSOLIDATE_SHARED_HEAP(heap);
+      for(i = 0; i < allocations; i++) {
+        SHARED_MEMGET(&c, TRANSLATE_SHARED_PTR(heap, ptrs[i]), 1);
+        if (c != (char) (i + MYTHREAD)) errors++;
+      }
+      free(ptrs);
+    }
+#endif
+    FREE_SHARED_HEAP(heap);
+  }
+
+  ALLREDUCE(&errors, 1, COLL_INT, COLL_SUM);
+  if (errors) DIE("%d allocations did not read back what was put\n", errors);
+
+  FINALIZE();
+  return 0;
+}
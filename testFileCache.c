@@ -19,14 +19,17 @@ int main (int argc, char **argv) {
   int i, try;
   double init = NOW();
   if (!MYTHREAD) {
-    printf("Starting with %d threads\n", THREADS);
+    printf("Starting with %d threads (%d ranks of %d threads)\n", THREADS, RANKS, LOCALTHREADS);
     fflush(stdout);
   }
   BARRIER;
 
   for(i = 1; i < argc; i++) {
+    TIMER_START(argv[i]);
     double tstart = NOW();
-    FileMap fm = initFileMap(argv[i], "r", MYTHREAD, THREADS);
+    TIMER_START("open");
+    FileMap fm = initHierarchicalFileMap(argv[i], "r", MYRANK, RANKS, MYLOCALTHREAD, LOCALTHREADS);
+    TIMER_STOP("open");
     double topen = NOW();
 
     LOG(0,"Thread %d: Opened from %ld up through %ld (%ld). %0.3f s: %s\n", MYTHREAD, fm->myStart, fm->myEnd, fm->filesize, topen - tstart, argv[i] );
@@ -41,6 +44,7 @@ int main (int argc, char **argv) {
 
     size_t lines = 0, bytes = 0;
     double tfirst = NOW();
+    TIMER_START("readFirst");
     while (haveMoreFileMap(fm)) {
         char *line = getLineFileMap(fm);
         if (!line) {
@@ -49,6 +53,7 @@ int main (int argc, char **argv) {
         lines++;
         bytes += getLengthBuffer(fm->buf);
     }
+    TIMER_STOP("readFirst");
     double s_first = NOW() - tfirst;
     LOG(0, "Thread %d: Read %ld lines %ld bytes (%0.1f) in %0.3f s %0.3f MB/s\n", MYTHREAD, lines, bytes, ((double)bytes/(double)lines), s_first, bytes / s_first / 1048576.0);
     BARRIER;
@@ -63,6 +68,7 @@ int main (int argc, char **argv) {
         BARRIER;
         lines = bytes = 0;
         double t = NOW();
+        TIMER_START("reread");
         while (haveMoreFileMap(fm)) {
             char *line = getLineFileMap(fm);
             if (!line) {
@@ -71,12 +77,15 @@ int main (int argc, char **argv) {
             lines++;
             bytes += getLengthBuffer(fm->buf);
         }
+        TIMER_STOP("reread");
         sec = NOW() - t;
         LOG(0,"Thread %d: Try %d, Read %ld lines %ld bytes (%0.1f) in %0.3f s %0.3f MB/s\n", MYTHREAD, try, lines, bytes, ((double)bytes/(double)lines), sec, bytes / sec / 1048576.0);
         BARRIER;
         sec = NOW() - t;
+        int64_t totals[2] = { lines, bytes };
+        ALLREDUCE(totals, 2, COLL_INT64, COLL_SUM);
 
-        SLOG(0,"Time to read attempt %d: %0.3f s %0.3f MB/s\n", try, sec, (double)bytes*THREADS / sec / 1048576.0);
+        SLOG(0,"Time to read attempt %d: %lld lines %lld bytes %0.3f s %0.3f MB/s\n", try, (long long) totals[0], (long long) totals[1], sec, (double) totals[1] / sec / 1048576.0);
         BARRIER;
         if (!MYTHREAD) {
           printf("\n");
@@ -88,9 +97,11 @@ int main (int argc, char **argv) {
     fflush(stderr);
 
     BARRIER;
+    TIMER_STOP(argv[i]);
   }
 
   SLOG(0, "Start to end time: %0.3f s\n", NOW() - init);
+  TIMER_REPORT();
   FINALIZE();
   return 0;
 }
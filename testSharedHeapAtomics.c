@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CommonParallel.h"
+#include "SharedHeap.h"
+
+/*
+ * Conformance test of the SharedHeap atomics: every thread hammers the same words on a heap
+ * owned by the last thread, then thread 0 checks the totals.  Then every thread puts its part of
+ * an array with non-blocking puts, flushes, and the owner checks the array through its local pointer.
+ * Last every thread allocates from a heap sized for exactly the allocations of all threads.
+ */
+
+#define USAGE "Usage: testSharedHeapAtomics [iterations]"
+
+enum { W_ADD, W_CSWAP, W_AND, W_OR, W_XOR, W_SWAP, W_NB, NUM_WORDS };
+#define NB_BATCH 16
+#define NB_PUTS 64
+
+static int checkWord(const char *name, uint64_t got, uint64_t expected) {
+  if (got == expected) return 0;
+  LOG(0, "FAILED %s: %llu expected %llu\n", name, (unsigned long long) got, (unsigned long long) expected);
+  return 1;
+}
+
+int main(int argc, char **argv) {
+
+  int failed = 0;
+  INIT(argc, argv);
+
+  long i, j, iterations = argc > 1 ? atol(argv[1]) : 1000;
+  int errors = 0;
+  if (iterations < 1) {
+    fprintf(stderr, "%s\n", USAGE);
+    EXIT_FUNC(1);
+  }
+  uint64_t bit = ((uint64_t) 1) << (MYTHREAD % 64), bits = 0, xorBits = 0;
+  for(i = 0; i < THREADS; i++) {
+    bits |= ((uint64_t) 1) << (i % 64);
+    xorBits ^= ((uint64_t) 1) << (i % 64);
+  }
+
+  INIT_SHARED_HEAP(heap, 16, NUM_WORDS * sizeof(uint64_t) + sizeof(SharedAtomic128), THREADS - 1);
+  SharedPtr words, wide;
+  uint64_t init[NUM_WORDS] = { 0, 0, ~((uint64_t) 0), 0, 0, 0, 0 };
+  SharedAtomic128 wideInit = { 0, 0 };
+  if (!MYTHREAD) {
+    ALLOC_FROM_SHARED_HEAP(heap, SharedAtomic128, w, 1);
+    ALLOC_FROM_SHARED_HEAP(heap, uint64_t, p, NUM_WORDS);
+    SHARED_MEMPUT(w, &wideInit, sizeof(SharedAtomic128));
+    SHARED_MEMPUT(p, init, sizeof(init));
+    SHARED_HEAP_FLUSH(heap);
+    wide = w;
+    words = p;
+  }
+  BROADCAST_SHARED_PTR(heap, words, 0);
+  BROADCAST_SHARED_PTR(heap, wide, 0);
+  SharedPtr word[NUM_WORDS];
+  for(i = 0; i < NUM_WORDS; i++) word[i] = SHARED_PTR_ADD(words, i * sizeof(uint64_t));
+  BARRIER;
+
+  uint64_t swapped = 0;
+  for(i = 0; i < iterations; i++) {
+    ATOMIC_FETCHADD(word[W_ADD], 1);
+    // increment by compare and swap
+    uint64_t old = 0, seen;
+    while ((seen = ATOMIC_CSWAP(word[W_CSWAP], old, old + 1)) != old) old = seen;
+    // 128 bit increment of both halves, they must always stay consistent
+    SharedAtomic128 cur = ATOMIC_READ128(heap, wide), next;
+    while (1) {
+      if (cur.hi != 2 * cur.lo) errors++;
+      next.lo = cur.lo + 1;
+      next.hi = cur.hi + 2;
+      SharedAtomic128 prev = ATOMIC_CSWAP128(heap, wide, cur, next);
+      if (prev.lo == cur.lo && prev.hi == cur.hi) break;
+      cur = prev;
+    }
+  }
+  ATOMIC_FETCHAND(word[W_AND], ~bit);
+  ATOMIC_FETCHOR(word[W_OR], bit);
+  ATOMIC_FETCHXOR(word[W_XOR], bit);
+  // every value swapped in is swapped out exactly once, by another swap or by the final check
+  swapped += ATOMIC_SWAP(word[W_SWAP], MYTHREAD + 1);
+  for(i = 0; i < iterations; i += NB_BATCH) {
+    uint64_t results[NB_BATCH];
+    SharedAtomicHandle handles[NB_BATCH];
+    for(j = 0; j < NB_BATCH; j++) handles[j] = ATOMIC_FETCHADD_NB(word[W_NB], 1, results + j);
+    for(j = 0; j < NB_BATCH; j++) ATOMIC_WAIT(handles[j]);
+    for(j = 1; j < NB_BATCH; j++) if (results[j] == results[j - 1]) errors++;
+  }
+  SHARED_HEAP_FLUSH(heap);
+  ALLREDUCE(&swapped, 1, COLL_UINT64, COLL_SUM);
+  BARRIER;
+
+  if (!MYTHREAD) {
+    uint64_t got[NUM_WORDS], n = (uint64_t) THREADS * iterations;
+    SharedAtomic128 w = ATOMIC_READ128(heap, wide);
+    SHARED_MEMGET(got, words, sizeof(got));
+    errors += checkWord("fetchadd", got[W_ADD], n);
+    errors += checkWord("cswap", got[W_CSWAP], n);
+    errors += checkWord("fetchand", got[W_AND], ~bits);
+    errors += checkWord("fetchor", got[W_OR], bits);
+    errors += checkWord("fetchxor", got[W_XOR], xorBits);
+    errors += checkWord("swap", swapped + got[W_SWAP], (uint64_t) THREADS * (THREADS + 1) / 2);
+    errors += checkWord("fetchadd_nb", got[W_NB], (uint64_t) THREADS * ((iterations + NB_BATCH - 1) / NB_BATCH) * NB_BATCH);
+    errors += checkWord("cswap128 lo", w.lo, n);
+    errors += checkWord("cswap128 hi", w.hi, 2 * n);
+  }
+
+  // non-blocking puts reach the owner after SHARED_HEAP_FLUSH and a BARRIER
+  INIT_SHARED_HEAP(putHeap, THREADS, NB_PUTS * sizeof(uint64_t), THREADS - 1);
+  SharedPtr array;
+  if (!MYTHREAD) {
+    ALLOC_FROM_SHARED_HEAP(putHeap, uint64_t, a, THREADS * NB_PUTS);
+    array = a;
+  }
+  BROADCAST_SHARED_PTR(putHeap, array, 0);
+  uint64_t values[NB_PUTS];
+  SharedMemHandle putHandles[NB_PUTS];
+  for(j = 0; j < NB_PUTS; j++) {
+    values[j] = MYTHREAD * NB_PUTS + j + 1;
+    putHandles[j] = SHARED_MEMPUT_NB(SHARED_PTR_ADD(array, (MYTHREAD * NB_PUTS + j) * sizeof(uint64_t)), values + j, sizeof(uint64_t));
+  }
+  SHARED_MEM_WAITALL(putHandles, NB_PUTS);
+  SHARED_HEAP_FLUSH(putHeap);
+  BARRIER;
+  if (MYTHREAD == THREADS - 1) {
+    uint64_t *local = (uint64_t *) SHARED_PTR_LOCAL(array);
+    for(j = 0; j < THREADS * NB_PUTS; j++) errors += checkWord("memput_nb", local[j], j + 1);
+  }
+  BARRIER;
+  FREE_SHARED_HEAP(putHeap);
+
+  // a heap sized for exactly the allocations of every thread holds them all
+  INIT_SHARED_HEAP(exactHeap, NB_PUTS * THREADS, sizeof(uint64_t), 0);
+  for(j = 0; j < NB_PUTS; j++) {
+    ALLOC_FROM_SHARED_HEAP(exactHeap, uint64_t, e, 1);
+    SHARED_MEMPUT(e, values + j, sizeof(uint64_t));
+  }
+  SHARED_HEAP_FLUSH(exactHeap);
+  BARRIER;
+  FREE_SHARED_HEAP(exactHeap);
+
+  ALLREDUCE(&errors, 1, COLL_INT, COLL_SUM);
+  if (!MYTHREAD) {
+    printf("%s: %d threads, %ld iterations, %d errors\n", errors ? "FAILED" : "PASSED", THREADS, iterations, errors);
+    failed = errors != 0;
+  }
+  FREE_SHARED_HEAP(heap);
+
+  FINALIZE();
+  return failed;
+}
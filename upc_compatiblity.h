@@ -15,6 +15,10 @@
 #   define UPC_INT64_T int64_t
 #   define UPC_ATOMIC_FADD_I64 bupc_atomicI64_fetchadd_strict
 #   define UPC_ATOMIC_CSWAP_I64 bupc_atomicI64_cswap_strict
+#   define UPC_ATOMIC_FAND_I64 bupc_atomicI64_fetchand_strict
+#   define UPC_ATOMIC_FOR_I64 bupc_atomicI64_fetchor_strict
+#   define UPC_ATOMIC_FXOR_I64 bupc_atomicI64_fetchxor_strict
+#   define UPC_ATOMIC_SWAP_I64 bupc_atomicI64_swap_strict
 #   define USED_FLAG_TYPE int32_t
 #   define UPC_ATOMIC_CSWAP_USED_FLAG bupc_atomicI_cswap_strict
 #   if __UPC_VERSION__ < 201311L
@@ -33,6 +37,10 @@
 #   define UPC_INT64_T long
 #   define UPC_ATOMIC_FADD_I64 _amo_afadd_upc
 #   define UPC_ATOMIC_CSWAP_I64 _amo_acswap_upc
+#   define UPC_ATOMIC_FAND_I64 _amo_afand_upc
+#   define UPC_ATOMIC_FOR_I64 _amo_afor_upc
+#   define UPC_ATOMIC_FXOR_I64 _amo_afxor_upc
+#   define UPC_ATOMIC_SWAP_I64 _amo_aswap_upc
 #   define USED_FLAG_TYPE UPC_INT64_T
 #   define UPC_ATOMIC_CSWAP_USED_FLAG UPC_ATOMIC_CSWAP_I64
 #   define UPC_TICK_T upc_tick_t
@@ -40,6 +48,22 @@
 #   define UPC_TICKS_TO_SECS( t ) (upc_ticks_to_ns( t ) / 1000000000.0)
 #endif
 
+// non-blocking memget / memput: the UPC 1.3 library when the compiler has it, else the Berkeley extensions
+#if defined __UPC_NB__
+#   include <upc_nb.h>
+#   define UPC_HANDLE_T upc_handle_t
+#   define UPC_MEMGET_NB upc_memget_nb
+#   define UPC_MEMPUT_NB upc_memput_nb
+#   define UPC_SYNC upc_sync
+#   define UPC_SYNC_ATTEMPT upc_sync_attempt
+#elif defined USE_BUPC
+#   define UPC_HANDLE_T bupc_handle_t
+#   define UPC_MEMGET_NB bupc_memget_async
+#   define UPC_MEMPUT_NB bupc_memput_async
+#   define UPC_SYNC bupc_waitsync
+#   define UPC_SYNC_ATTEMPT bupc_trysync
+#endif
+
 // This check is necessary to ensure that shared pointers of 16 bytes are unlikely to be corrupted.
 // 8 byte pointers will never be subject to a race condition
 #define IS_VALID_UPC_PTR( ptr ) ( sizeof(shared void *) == 8 ? 1 : ( ptr == NULL || ( upc_threadof(ptr) >= 0 && upc_threadof(ptr) < THREADS && upc_phaseof(ptr) >= 0 && upc_phaseof(ptr) < BS && upc_addrfield(ptr) < 17179869184 ) ) )
@@ -35,9 +35,15 @@
 
 #include <upc.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "upc_utils.h"
 #include "upc_nb_utils.h"
+#include "NumaAlloc.h"
 
 #ifndef UPC_HEAP_BLOCK_SIZE
 #define UPC_HEAP_BLOCK_SIZE 1
@@ -47,14 +53,21 @@
 #define UPC_HEAP_THREAD_BITS 24
 #endif
 
-#define UPC_HEAP_THREAD_MASK ( (UPC_INT64_T) ((UPC_INT64_T)(1<<24) - 1L) )
-#define UPC_HEAP_OFFSET_MASK ( (UPC_INT64_T) !UPC_HEAP_THREAD_MASK )
+#if UPC_HEAP_THREAD_BITS < 1 || UPC_HEAP_THREAD_BITS > 62
+#error "UPC_HEAP_THREAD_BITS must be between 1 and 62"
+#endif
+
+#define UPC_HEAP_THREAD_MASK ( (UPC_INT64_T) ((((UPC_INT64_T) 1) << UPC_HEAP_THREAD_BITS) - 1) )
+#define UPC_HEAP_OFFSET_MASK ( (UPC_INT64_T) ~UPC_HEAP_THREAD_MASK )
 
 // The HeapType is the base unit of a heap
 // The HeapAllocation datastructure is the first bytes of any allocated region
 // HeapPos is a composite int64 with UPC_HEAP_THREAD_BITS (24) low bits set for the thread
-// and 64-UPC_HEAP_THREAD_BITS (40) high bits set for the offset from the start of the Heap
-// offset will always be non-zero as 0 byte offset will be the HeapAllocation memory position itself
+// and 64-UPC_HEAP_THREAD_BITS (40) high bits set for the signed offset from the start of the Heap
+// (grown HeapAllocations may sit below the first one, so offsets can be negative)
+// offset will always be non-zero as 0 byte offset will be the HeapAllocation memory position itself,
+// so a HeapPos of 0 is never a valid position.
+// HeapPosWide holds the thread and offset in a word each, for heaps or jobs too large for the HeapPos bits
 
 typedef shared[] char * SharedBytesPtr;
 typedef char HeapType;
@@ -80,23 +93,98 @@ struct HeapPos {
     UPC_INT64_T heapPos;
 };
 
-#define GET_HEAP_THREAD( heapPos ) ( ( heapPos & UPC_HEAP_THREAD_MASK ) )
-#define GET_HEAP_OFFSET( heapPos ) ( ( heapPos & UPC_HEAP_OFFSET_MASK ) >> UPC_HEAP_THREAD_BITS )
-#define GET_HEAP_POS( thread, offset ) ( (UPC_INT64_T) ((((UPC_INT64_T)thread)&UPC_HEAP_THREAD_MASK) & ( (((UPC_INT64_T)offset)<<UPC_HEAP_THREAD_BITS) & UPC_HEAP_OFFSET_MASK)) )
+// the shifts go through uint64_t, as shifting a negative offset left is undefined.  Shifting right keeps the sign
+#define GET_HEAP_THREAD( heapPos ) ( (UPC_INT64_T) ( (heapPos) & UPC_HEAP_THREAD_MASK ) )
+#define GET_HEAP_OFFSET( heapPos ) ( ( (UPC_INT64_T) (heapPos) ) >> UPC_HEAP_THREAD_BITS )
+#define GET_HEAP_POS( thread, offset ) ( (UPC_INT64_T) ( (((uint64_t) (offset)) << UPC_HEAP_THREAD_BITS) | (((uint64_t) (thread)) & (uint64_t) UPC_HEAP_THREAD_MASK) ) )
+// true when thread and offset survive the round trip through a HeapPos
+#define HEAP_POS_FITS( thread, offset ) ( (thread) >= 0 && (thread) <= UPC_HEAP_THREAD_MASK && ( ((UPC_INT64_T) (offset)) >> (63 - UPC_HEAP_THREAD_BITS) == 0 || ((UPC_INT64_T) (offset)) >> (63 - UPC_HEAP_THREAD_BITS) == -1 ) )
+
+typedef struct HeapPosWide HeapPosWide;
+struct HeapPosWide {
+    UPC_INT64_T thread;
+    UPC_INT64_T offset;
+};
+
+HeapPosWide widenHeapPos(HeapPos heapPos) {
+    HeapPosWide wide;
+    wide.thread = heapPos.heapPos == 0 ? 0 : GET_HEAP_THREAD( heapPos.heapPos );
+    wide.offset = heapPos.heapPos == 0 ? 0 : GET_HEAP_OFFSET( heapPos.heapPos );
+    return wide;
+}
+
+// returns 0 if the position does not fit in a HeapPos
+int narrowHeapPos(HeapPosWide wide, HeapPos *heapPos) {
+    if (!HEAP_POS_FITS(wide.thread, wide.offset)) return 0;
+    heapPos->heapPos = wide.offset == 0 ? 0 : GET_HEAP_POS(wide.thread, wide.offset);
+    return 1;
+}
+
+// for the functions that return a HeapPos: a position that does not fit is fatal
+HeapPos narrowHeapPosOrExit(HeapPosWide wide) {
+    HeapPos heapPos;
+    if (!narrowHeapPos(wide, &heapPos)) {
+        LOG("Thread %d: offset %lld on thread %lld does not fit in a HeapPos of %d thread bits, use the HeapPosWide functions\n", MYTHREAD, (long long) wide.offset, (long long) wide.thread, UPC_HEAP_THREAD_BITS);
+        upc_global_exit(1);
+    }
+    return heapPos;
+}
+
+// One HeapAllocation moved by compactDistHeap: HeapPos offsets in [oldStart, oldEnd) now start at newStart
+typedef struct HeapForward HeapForward;
+struct HeapForward {
+    UPC_INT64_T oldStart, oldEnd, newStart;
+};
+typedef HeapForward *HeapForwardPtr;
+typedef shared[] HeapForward *SharedHeapForwardPtr;
 
 struct DistHeapData {
     // All data is on a single thread
-    SharedHeapAllocationPtr heapHead; // never changes after initialization... all HeapPos are relative to this pointer using heapOffest in bytes
+    SharedHeapAllocationPtr heapHead; // only changes in compactDistHeap... all HeapPos are relative to this pointer using heapOffest in bytes
     SharedHeapAllocationPtr activeHeap; // active and current HeapAllocation head
     UPC_INT64_T requestedIncrease; // used to signal insufficient space.  Threads much check periodically, if used
+    SharedHeapForwardPtr forwards; // from the last compactDistHeap, sorted by oldStart.  NULL if nothing moved
+    UPC_INT64_T numForwards;
 };
 typedef struct DistHeapData DistHeapData;
 typedef shared[UPC_HEAP_BLOCK_SIZE] DistHeapData *DistHeapDataPtr;
 
+typedef struct DistHeapAggregator DistHeapAggregator;
+typedef DistHeapAggregator *DistHeapAggregatorPtr;
+
+// How tryPutData confirms the data it sends, i.e. what HeapAllocation.confirmed means before the next distHeapBarrier
+// NONE:    no fence and no confirm.  confirmed is only valid after distHeapBarrier
+// RELAXED: one fence and one fetch-add per destination HeapAllocation for a whole batch of puts,
+//          sent when the destination moves to a new HeapAllocation, by confirmDistHeapPuts and by distHeapBarrier
+// STRICT:  a fence and a compare-and-swap per put, in allocation order, so everything below confirmed has landed
+typedef enum { DIST_HEAP_CONSISTENCY_NONE, DIST_HEAP_CONSISTENCY_RELAXED, DIST_HEAP_CONSISTENCY_STRICT } DistHeapConsistency;
+
+// Per thread telemetry, counted since constructDistHeap or the last resetDistHeapStats.
+// The received counts and the heap sizes are only filled in by the collective summarizeDistHeapStats
+typedef struct DistHeapStats DistHeapStats;
+struct DistHeapStats {
+    UPC_INT64_T putsSent, bytesSent;         // successful puts by this thread
+    UPC_INT64_T putsReceived, bytesReceived; // into this thread's heap
+    UPC_INT64_T failedAllocs;   // tryAllocRange(Cached) calls by this thread that found no space
+    UPC_INT64_T failedAllocsOn; // ... that found no space on this thread
+    UPC_INT64_T growths, grownBytes; // HeapAllocations added to this thread's heap
+    UPC_INT64_T atomicRetries;  // STRICT confirms that had to wait for an earlier put
+    UPC_INT64_T heapBytes, usedBytes; // of this thread's HeapAllocations
+    UPC_INT64_T barriers;
+    UPC_TICK_T barrierTicks;    // in distHeapBarrier
+};
+
 typedef struct DistHeapHandle DistHeapHandle;
 struct DistHeapHandle {
     DistHeapDataPtr distHeapData; // used for global array 1 per THREAD
     NBBarrier nbb; // used to sync some operations
+    DistHeapAggregatorPtr aggregator; // if not NULL, flushed by distHeapBarrier
+    DistHeapConsistency consistency; // must be the same on every thread
+    SharedHeapAllocationPtr *pendingHeapAlloc; // RELAXED: per destination thread, the HeapAllocation with unconfirmed puts
+    UPC_INT64_T *pendingConfirm; // RELAXED: per destination thread, the bytes not yet confirmed
+    HeapForwardPtr *forwardCache; // per thread, local copies of DistHeapData.forwards, fetched on first use
+    DistHeapStats stats;
+    UPC_INT64_T *putsTo, *bytesTo, *failedTo; // per destination thread, for the received counts of the summary
 };
 typedef DistHeapHandle *DistHeapHandlePtr;
 
@@ -127,11 +215,11 @@ void updateCachedDistHeap(CachedDistHeapHandlePtr cached, int thread) {
 CachedDistHeapHandlePtr constructCachedDistHeap(DistHeapHandlePtr distHeap) {
     CachedDistHeapHandlePtr cachedDistHeap = (CachedDistHeapHandlePtr) malloc(sizeof(CachedDistHeapHandle) + THREADS*sizeof(CachedDistHeapData));
     if (cachedDistHeap == NULL) {
-        LOG("Thread %d: Could not allocate memory for the cached distributed heap: %lld bytes\n", MYTHREAD, THREADS*sizeof(CachedDistHeapHandle));
+        LOG("Thread %d: Could not allocate memory for the cached distributed heap: %lld bytes\n", MYTHREAD, (long long) (sizeof(CachedDistHeapHandle) + THREADS*sizeof(CachedDistHeapData)));
         upc_global_exit(1);
     }
     cachedDistHeap->distHeap = distHeap;
-    cachedDistHeap->cachedDistHeapData = (CachedDistHeapDataPtr) ((char*) cachedDistHeap) + sizeof(CachedDistHeapHandle); // memory directly after CachedDistHeapHandle is the Data array
+    cachedDistHeap->cachedDistHeapData = (CachedDistHeapDataPtr) (((char*) cachedDistHeap) + sizeof(CachedDistHeapHandle)); // memory directly after CachedDistHeapHandle is the Data array
     for(int i = 0; i < THREADS; i++) {
         updateCachedDistHeap(cachedDistHeap, i);
     }
@@ -148,24 +236,31 @@ void destroyCachedDistHeap(CachedDistHeapHandlePtr *_cached) {
     *_cached = NULL;
 }
 
+// a NULL ptr gives the null position
+HeapPosWide getHeapPosWideFromHeapHead(SharedHeapAllocationPtr heapHead, SharedHeapTypePtr ptr) {
+    HeapPosWide wide;
+    wide.thread = 0;
+    wide.offset = 0;
+    if (ptr == NULL) return wide;
+    wide.thread = upc_threadof(ptr);
+    assert( upc_threadof( heapHead ) == wide.thread );
+    wide.offset = (SharedBytesPtr) ptr - (SharedBytesPtr) heapHead;
+    assert( wide.offset != 0 );
+    return wide;
+}
+
+HeapPosWide getHeapPosWideFromDistHeapHandle(DistHeapHandlePtr heapPtr, SharedHeapTypePtr ptr) {
+    return getHeapPosWideFromHeapHead(ptr == NULL ? NULL : heapPtr->distHeapData[upc_threadof(ptr)].heapHead, ptr);
+}
+
 HeapPos getHeapPosFromDistHeapHandle(DistHeapHandlePtr heapPtr, SharedHeapTypePtr ptr) {
-    HeapPos hp;
-    UPC_INT64_T thread = upc_threadof(ptr);
-    assert( upc_threadof( heapPtr->distHeapData[thread].heapHead ) == thread );
-    UPC_INT64_T offset = (SharedBytesPtr)ptr - (SharedBytesPtr) heapPtr->distHeapData[thread].heapHead;
-    hp.heapPos = GET_HEAP_POS(thread,offset);
-    return hp;
+    return narrowHeapPosOrExit(getHeapPosWideFromDistHeapHandle(heapPtr, ptr));
 }
 
+// uses the cached heapHead, which only changes in compactDistHeap
 HeapPos getHeapPosFromCachedDistHeapHandle(CachedDistHeapHandlePtr cachedDistHeapHandle, SharedHeapTypePtr ptr) {
-    HeapPos hp;
-    UPC_INT64_T thread = upc_threadof(ptr);
-    SharedHeapAllocationPtr heapHead = cachedDistHeapHandle->distHeap->distHeapData[thread].heapHead;
-    assert(cachedDistHeapHandle->distHeap->distHeapData[thread].heapHead == heapHead);
-    assert( upc_threadof( heapHead ) == thread );
-    UPC_INT64_T offset = (SharedBytesPtr) ptr - (SharedBytesPtr) heapHead;
-    hp.heapPos = GET_HEAP_POS(thread,offset);
-    return hp;
+    SharedHeapAllocationPtr heapHead = ptr == NULL ? NULL : cachedDistHeapHandle->cachedDistHeapData[upc_threadof(ptr)].heapData.heapHead;
+    return narrowHeapPosOrExit(getHeapPosWideFromHeapHead(heapHead, ptr));
 }
     
 typedef struct HeapIterator HeapIterator;
@@ -187,7 +282,7 @@ long long getHeapAllocationDataStart() {
 SharedHeapTypePtr getSharedHeapTypePtr(SharedHeapIterator it) {
     assert( it->idx < it->copy.size );
     assert( upc_threadof( it->heap ) == it->thread );
-    SharedHeapTypePtr ptr = (SharedHeapTypePtr) (((SharedBytesPtr) it->heap) + it->copy.heapOffset + it->idx);
+    SharedHeapTypePtr ptr = (SharedHeapTypePtr) (((SharedBytesPtr) it->heap) + it->idx);
     assert(upc_threadof(ptr) == it->thread);
     return ptr;
 }
@@ -234,6 +329,35 @@ int heapIteratorHasNext(SharedHeapIterator it, SharedHeapIterator end, long long
     }
 }
 
+// A contiguous run of confirmed data in one of my own HeapAllocations, addressed by a private pointer
+typedef struct HeapSpan HeapSpan;
+struct HeapSpan {
+    HeapType *ptr;
+    UPC_INT64_T bytes;
+};
+
+// Fills up to maxSpans spans of MYTHREAD's heap, one per HeapAllocation and oldest first, and returns
+// how many HeapAllocations there are (call with NULL, 0 to size the array).  Only valid until the heap
+// next grows or is compacted, so call it after distHeapBarrier.
+UPC_INT64_T getLocalHeapSpans(DistHeapHandlePtr distHeap, HeapSpan *spans, UPC_INT64_T maxSpans) {
+    long long dataStart = getHeapAllocationDataStart();
+    UPC_INT64_T numSpans = 0;
+    SharedHeapAllocationPtr heapAlloc;
+    for(heapAlloc = distHeap->distHeapData[MYTHREAD].activeHeap; heapAlloc != NULL; heapAlloc = ((HeapAllocationPtr) heapAlloc)->next) {
+        assert(upc_threadof(heapAlloc) == MYTHREAD);
+        numSpans++;
+    }
+    // the list runs newest to oldest
+    UPC_INT64_T i = numSpans;
+    for(heapAlloc = distHeap->distHeapData[MYTHREAD].activeHeap; heapAlloc != NULL; heapAlloc = ((HeapAllocationPtr) heapAlloc)->next) {
+        HeapAllocationPtr local = (HeapAllocationPtr) heapAlloc;
+        if (--i >= maxSpans) continue;
+        spans[i].ptr = (HeapType*) (((char*) local) + dataStart);
+        spans[i].bytes = local->confirmed - dataStart;
+    }
+    return numSpans;
+}
+
 SharedHeapIterator constructHeapIterator() {
     SharedHeapIterator it = (SharedHeapIterator) upc_alloc(sizeof(HeapIterator));
     if (it == NULL) {
@@ -280,31 +404,30 @@ SharedHeapIterator getHeapEnd(DistHeapHandlePtr heapPtr, int thread) {
 }
 
 
-SharedHeapTypePtr getSharedPtrFromDistHeapHandle(DistHeapHandlePtr heapPtr, HeapPos heapPos) {
-    UPC_INT64_T thread = GET_HEAP_THREAD( heapPos.heapPos );
-    UPC_INT64_T offset = GET_HEAP_OFFSET( heapPos.heapPos );
-    assert(thread >= 0);
-    assert(thread < THREADS);
-    SharedHeapAllocationPtr heapHead = heapPtr->distHeapData[thread].heapHead;
-    assert( upc_threadof(heapHead) == thread );
-
-    SharedHeapTypePtr ptr = (SharedHeapTypePtr) (((SharedBytesPtr) heapHead) + offset);
-    assert( upc_threadof(ptr) == thread );
+// the null position gives NULL
+SharedHeapTypePtr getSharedPtrFromHeapHead(SharedHeapAllocationPtr heapHead, HeapPosWide wide) {
+    if (wide.offset == 0) return NULL;
+    assert( upc_threadof(heapHead) == wide.thread );
+    SharedHeapTypePtr ptr = (SharedHeapTypePtr) (((SharedBytesPtr) heapHead) + wide.offset);
+    assert( upc_threadof(ptr) == wide.thread );
     return ptr;
 }
 
-SharedHeapTypePtr getSharedPtrFromCachedDistHeapHandle(CachedDistHeapHandlePtr cachedDistHeapHandle, HeapPos heapPos) {
-    UPC_INT64_T thread = GET_HEAP_THREAD( heapPos.heapPos );
-    UPC_INT64_T offset = GET_HEAP_OFFSET( heapPos.heapPos );
-    assert(thread >= 0);
-    assert(thread < THREADS);
-    SharedHeapAllocationPtr heapHead = cachedDistHeapHandle->distHeap->distHeapData[thread].heapHead;
-    assert( cachedDistHeapHandle->distHeap->distHeapData[thread].heapHead == heapHead);
-    assert( upc_threadof(heapHead) == thread );
+SharedHeapTypePtr getSharedPtrFromHeapPosWide(DistHeapHandlePtr heapPtr, HeapPosWide wide) {
+    assert(wide.thread >= 0);
+    assert(wide.thread < THREADS);
+    return getSharedPtrFromHeapHead(wide.offset == 0 ? NULL : heapPtr->distHeapData[wide.thread].heapHead, wide);
+}
 
-    SharedHeapTypePtr ptr = (((SharedBytesPtr) heapHead) + offset);
-    assert( upc_threadof(ptr) == thread );
-    return ptr;
+SharedHeapTypePtr getSharedPtrFromDistHeapHandle(DistHeapHandlePtr heapPtr, HeapPos heapPos) {
+    return getSharedPtrFromHeapPosWide(heapPtr, widenHeapPos(heapPos));
+}
+
+SharedHeapTypePtr getSharedPtrFromCachedDistHeapHandle(CachedDistHeapHandlePtr cachedDistHeapHandle, HeapPos heapPos) {
+    HeapPosWide wide = widenHeapPos(heapPos);
+    assert(wide.thread >= 0);
+    assert(wide.thread < THREADS);
+    return getSharedPtrFromHeapHead(wide.offset == 0 ? NULL : cachedDistHeapHandle->cachedDistHeapData[wide.thread].heapData.heapHead, wide);
 }
 
 SharedHeapAllocationPtr constructHeapAllocation( UPC_INT64_T mySize, SharedHeapTypePtr origin ) {
@@ -318,7 +441,9 @@ SharedHeapAllocationPtr constructHeapAllocation( UPC_INT64_T mySize, SharedHeapT
        upc_global_exit(1);
     }
     assert(upc_threadof(heapAlloc) == MYTHREAD);
-    heapAlloc->heapOffset = origin == NULL ? 0 : ((SharedBytesPtr) origin) - ((SharedBytesPtr) heapAlloc);
+    // the owner touches its heap first, so pages the runtime has not placed yet go to its NUMA node
+    touchNumaPages((char *) heapAlloc, heapAllocSize);
+    heapAlloc->heapOffset = origin == NULL ? 0 : ((SharedBytesPtr) heapAlloc) - ((SharedBytesPtr) origin);
     heapAlloc->size = dataStart + dataSize;
     heapAlloc->offset = dataStart;
     heapAlloc->confirmed = dataStart;
@@ -344,12 +469,28 @@ DistHeapHandlePtr constructDistHeap(UPC_INT64_T mySize) {
     } 
     assert(upc_threadof(distHeapData+MYTHREAD) == MYTHREAD);
     distHeapData[MYTHREAD].requestedIncrease = 0;
+    distHeapData[MYTHREAD].forwards = NULL;
+    distHeapData[MYTHREAD].numForwards = 0;
     SharedHeapAllocationPtr heapAlloc = constructHeapAllocation(mySize, NULL);
     assert(upc_threadof(heapAlloc) == MYTHREAD);
     distHeapData[MYTHREAD].heapHead = heapAlloc;
     distHeapData[MYTHREAD].activeHeap = heapAlloc;
     distHandle->distHeapData = distHeapData;
     distHandle->nbb = initNBBarrier();
+    distHandle->aggregator = NULL;
+    distHandle->consistency = DIST_HEAP_CONSISTENCY_STRICT;
+    distHandle->pendingHeapAlloc = (SharedHeapAllocationPtr*) calloc(THREADS, sizeof(SharedHeapAllocationPtr));
+    distHandle->pendingConfirm = (UPC_INT64_T*) calloc(THREADS, sizeof(UPC_INT64_T));
+    distHandle->forwardCache = (HeapForwardPtr*) calloc(THREADS, sizeof(HeapForwardPtr));
+    memset(&(distHandle->stats), 0, sizeof(DistHeapStats));
+    distHandle->putsTo = (UPC_INT64_T*) calloc(3*THREADS, sizeof(UPC_INT64_T));
+    if (distHandle->pendingHeapAlloc == NULL || distHandle->pendingConfirm == NULL || distHandle->forwardCache == NULL || distHandle->putsTo == NULL) {
+       LOG("Thread %d: Could not allocate memory for DistHeapHandle", MYTHREAD);
+       upc_global_exit(1);
+       return NULL;
+    }
+    distHandle->bytesTo = distHandle->putsTo + THREADS;
+    distHandle->failedTo = distHandle->bytesTo + THREADS;
     upc_fence;
     return distHandle;
 }
@@ -375,12 +516,21 @@ void destroyDistHeap(DistHeapHandlePtr *_distHeap) {
     DistHeapHandlePtr distHeap = *_distHeap;
     assert(distHeap != NULL);
     if (distHeap->nbb != NULL) { destroyNBBarrier( &(distHeap->nbb) ); }
-    SharedHeapAllocationPtr heapAlloc = distHeap->distHeapData[MYTHREAD].heapHead;
+    // the list runs from the active HeapAllocation back to the head
+    SharedHeapAllocationPtr heapAlloc = distHeap->distHeapData[MYTHREAD].activeHeap;
     assert(heapAlloc != NULL);
     destroyHeapAlloc(&heapAlloc);
     distHeap->distHeapData[MYTHREAD].heapHead = NULL;
     distHeap->distHeapData[MYTHREAD].activeHeap = NULL;
+    if (distHeap->distHeapData[MYTHREAD].forwards != NULL) upc_free(distHeap->distHeapData[MYTHREAD].forwards);
     upc_all_free(distHeap->distHeapData);
+    for(int i = 0; i < THREADS; i++) {
+        free(distHeap->forwardCache[i]);
+    }
+    free(distHeap->forwardCache);
+    free(distHeap->pendingHeapAlloc);
+    free(distHeap->pendingConfirm);
+    free(distHeap->putsTo); // bytesTo and failedTo are in the same allocation
     *_distHeap = NULL;
 }
 
@@ -392,6 +542,15 @@ struct AllocatedHeap {
     UPC_INT64_T count;
 };
 
+// With no confirmations the one put that straddles the end of a HeapAllocation records where the data stops.
+// Only that put can see myOffset <= size < myOffset + bytes, so it stores over whatever an earlier distHeapBarrier
+// or consistency mode left in confirmed, and distHeapBarrier leaves a HeapAllocation with offset > size alone
+void markHeapAllocationRaceOut(DistHeapHandlePtr distHeap, SharedHeapAllocationPtr heapAlloc, UPC_INT64_T myOffset, UPC_INT64_T size) {
+    if (distHeap->consistency == DIST_HEAP_CONSISTENCY_NONE && myOffset <= size) {
+        heapAlloc->confirmed = myOffset;
+    }
+}
+
 void checkMyHeap(DistHeapHandlePtr distHeap) {
     UPC_POLL;
     assert(upc_threadof(distHeap->distHeapData + MYTHREAD) == MYTHREAD);
@@ -415,6 +574,8 @@ void checkMyHeap(DistHeapHandlePtr distHeap) {
         assert(requestedIncrease == distHeap->distHeapData[MYTHREAD].requestedIncrease);
         UPC_ATOMIC_CSWAP_I64( &(distHeap->distHeapData[MYTHREAD].requestedIncrease), requestedIncrease, 0);
         upc_fence;
+        distHeap->stats.growths++;
+        distHeap->stats.grownBytes += growSize;
     }
 }
 
@@ -437,7 +598,7 @@ AllocatedHeap tryAllocRange(DistHeapHandlePtr distHeap, UPC_INT64_T thread, UPC_
         assert(heapAlloc->offset >= myOffset + requestedIncrease);
         if (myOffset + requestedIncrease <= localHeapAlloc.size) {
           // Success! return allocated information
-          ret.ptr = ((SharedBytesPtr) heapAlloc) + heapAlloc->heapOffset + myOffset;
+          ret.ptr = ((SharedBytesPtr) heapAlloc) + myOffset;
           ret.heapAlloc = heapAlloc;
           ret.count = count;
         } else {
@@ -445,6 +606,7 @@ AllocatedHeap tryAllocRange(DistHeapHandlePtr distHeap, UPC_INT64_T thread, UPC_
           // Do not correct because of possible race condition
           // signal for more HeapAllocations
           LOG("Thread %d: tryAllocRange raced out of space. requesting %lld more bytes on thread %lld (got %lld of %lld)\n", MYTHREAD, (long long) requestedIncrease, (long long) thread, (long long) myOffset, (long long) localHeapAlloc.size);
+          markHeapAllocationRaceOut(distHeap, heapAlloc, myOffset, localHeapAlloc.size);
           UPC_ATOMIC_CSWAP_I64( &(distHeap->distHeapData[thread].requestedIncrease), 0, requestedIncrease);
           UPC_POLL;
         }
@@ -454,30 +616,69 @@ AllocatedHeap tryAllocRange(DistHeapHandlePtr distHeap, UPC_INT64_T thread, UPC_
         UPC_ATOMIC_CSWAP_I64( &(distHeap->distHeapData[thread].requestedIncrease), 0, requestedIncrease);
         UPC_POLL;
     }
+    if (ret.count == 0) {
+        distHeap->stats.failedAllocs++;
+        distHeap->failedTo[thread]++;
+    }
 
     checkMyHeap(distHeap);
     return ret;
 }
 
-// returns NULL if unsuccessful, pointer to the start of the put data of count HeapTypes if successful
-SharedHeapTypePtr tryPutData(DistHeapHandlePtr distHeap, UPC_INT64_T thread, HeapType *data, UPC_INT64_T count) {
-    AllocatedHeap allocated = tryAllocRange(distHeap, thread, count);
+// RELAXED: one fence, then confirm everything sent to thread (or to every thread if thread < 0)
+void confirmDistHeapPutsTo(DistHeapHandlePtr distHeap, int thread) {
+    int fenced = 0;
+    for(int i = (thread < 0 ? 0 : thread); i < (thread < 0 ? THREADS : thread + 1); i++) {
+        if (distHeap->pendingConfirm[i] == 0) continue;
+        if (!fenced) { upc_fence; fenced = 1; }
+        UPC_ATOMIC_FADD_I64( &(distHeap->pendingHeapAlloc[i]->confirmed), distHeap->pendingConfirm[i] );
+        distHeap->pendingConfirm[i] = 0;
+        distHeap->pendingHeapAlloc[i] = NULL;
+    }
+}
+
+void confirmDistHeapPuts(DistHeapHandlePtr distHeap) {
+    confirmDistHeapPutsTo(distHeap, -1);
+}
+
+// sets how later puts are confirmed.  Collective: every thread must select the same mode between distHeapBarriers
+void setDistHeapConsistency(DistHeapHandlePtr distHeap, DistHeapConsistency consistency) {
+    confirmDistHeapPuts(distHeap);
+    distHeap->consistency = consistency;
+}
+
+// sends data to a range returned by tryAllocRange or tryAllocRangeCached and confirms it
+SharedHeapTypePtr putAllocatedData(DistHeapHandlePtr distHeap, AllocatedHeap allocated, HeapType *data, UPC_INT64_T count) {
     if (allocated.count == count) {
         assert(allocated.ptr != NULL);
-        assert(upc_threadof(allocated.ptr) == thread);
-        assert(upc_threadof(allocated.ptr + count) == thread);
+        assert(upc_threadof(allocated.ptr) == upc_threadof(allocated.heapAlloc));
+        assert(upc_threadof(allocated.ptr + count) == upc_threadof(allocated.heapAlloc));
 
         // send the data
         upc_memput(allocated.ptr, data, count*sizeof(HeapType));
 
         // confirm the send
-// TODO implement consistency none: no confirmed, relaxed: fadd vs strict: while(!cmpswp)
-        upc_fence;
-        UPC_INT64_T confirmed = UPC_ATOMIC_FADD_I64( &(allocated.heapAlloc->confirmed), count*sizeof(HeapType) ); 
-        assert(confirmed + count*sizeof(HeapType) <= allocated.heapAlloc->size);
-        assert(confirmed <= allocated.heapAlloc->offset);
-        assert(allocated.heapAlloc->confirmed >= confirmed+count*sizeof(HeapType));
-        return allocated.ptr; 
+        UPC_INT64_T bytes = count*sizeof(HeapType);
+        int thread = upc_threadof(allocated.heapAlloc);
+        distHeap->stats.putsSent++;
+        distHeap->stats.bytesSent += bytes;
+        distHeap->putsTo[thread]++;
+        distHeap->bytesTo[thread] += bytes;
+        if (distHeap->consistency == DIST_HEAP_CONSISTENCY_STRICT) {
+            // wait for the puts allocated before this one, so confirmed only ever covers landed data
+            UPC_INT64_T myOffset = ((SharedBytesPtr) allocated.ptr) - ((SharedBytesPtr) allocated.heapAlloc);
+            UPC_INT64_T confirmed;
+            upc_fence;
+            loop_until( confirmed = UPC_ATOMIC_CSWAP_I64( &(allocated.heapAlloc->confirmed), myOffset, myOffset + bytes ); distHeap->stats.atomicRetries += (confirmed != myOffset), confirmed == myOffset );
+            assert(myOffset + bytes <= allocated.heapAlloc->size);
+        } else if (distHeap->consistency == DIST_HEAP_CONSISTENCY_RELAXED) {
+            if (distHeap->pendingHeapAlloc[thread] != allocated.heapAlloc) {
+                confirmDistHeapPutsTo(distHeap, thread);
+                distHeap->pendingHeapAlloc[thread] = allocated.heapAlloc;
+            }
+            distHeap->pendingConfirm[thread] += bytes;
+        }
+        return allocated.ptr;
     } else {
         // Failure!
         assert(allocated.count == 0);
@@ -485,17 +686,416 @@ SharedHeapTypePtr tryPutData(DistHeapHandlePtr distHeap, UPC_INT64_T thread, Hea
     }
 }
 
+// returns NULL if unsuccessful, pointer to the start of the put data of count HeapTypes if successful
+SharedHeapTypePtr tryPutData(DistHeapHandlePtr distHeap, UPC_INT64_T thread, HeapType *data, UPC_INT64_T count) {
+    return putAllocatedData(distHeap, tryAllocRange(distHeap, thread, count), data, count);
+}
+
+// As tryAllocRange, but the size check uses the cached copy of the active HeapAllocation.
+// Its size never changes and its offset only grows, so the cached offset is a lower bound that
+// is advanced by every fetch-add: the cache is only refreshed (two remote reads) when it says the
+// heap is full, which is also when the thread may have grown a new active HeapAllocation.
+// A stale cache can still pass the check and race out of the old HeapAllocation, so a race out
+// refreshes the cache and retries on the new one before it asks the thread to grow.
+AllocatedHeap tryAllocRangeCached(CachedDistHeapHandlePtr cached, UPC_INT64_T thread, UPC_INT64_T count) {
+    assert(thread >= 0);
+    assert(thread < THREADS);
+    CachedDistHeapDataPtr cachedThread = cached->cachedDistHeapData + thread;
+    AllocatedHeap ret;
+    ret.ptr = NULL;
+    ret.heapAlloc = NULL;
+    ret.count = 0;
+    UPC_INT64_T requestedIncrease = count * sizeof(HeapType);
+    if (cachedThread->activeHeapCopy.size < cachedThread->activeHeapCopy.offset + requestedIncrease) {
+        updateCachedDistHeap(cached, thread);
+    }
+    SharedHeapAllocationPtr heapAlloc = cachedThread->activeHeap;
+    assert(heapAlloc != NULL);
+    assert(upc_threadof(heapAlloc) == thread);
+    if (cachedThread->activeHeapCopy.size >= cachedThread->activeHeapCopy.offset + requestedIncrease) {
+        UPC_INT64_T myOffset = UPC_ATOMIC_FADD_I64( &(heapAlloc->offset), requestedIncrease );
+        assert(myOffset >= cachedThread->activeHeapCopy.offset);
+        cachedThread->activeHeapCopy.offset = myOffset + requestedIncrease;
+        if (myOffset + requestedIncrease <= cachedThread->activeHeapCopy.size) {
+          ret.ptr = ((SharedBytesPtr) heapAlloc) + myOffset;
+          ret.heapAlloc = heapAlloc;
+          ret.count = count;
+        } else {
+          LOG("Thread %d: tryAllocRangeCached raced out of space. requesting %lld more bytes on thread %lld (got %lld of %lld)\n", MYTHREAD, (long long) requestedIncrease, (long long) thread, (long long) myOffset, (long long) cachedThread->activeHeapCopy.size);
+          markHeapAllocationRaceOut(cached->distHeap, heapAlloc, myOffset, cachedThread->activeHeapCopy.size);
+          // the cache may have been stale: only ask for growth if the thread has not already grown
+          updateCachedDistHeap(cached, thread);
+          if (cachedThread->activeHeap != heapAlloc) {
+              return tryAllocRangeCached(cached, thread, count);
+          }
+          UPC_ATOMIC_CSWAP_I64( &(cached->distHeap->distHeapData[thread].requestedIncrease), 0, requestedIncrease);
+          UPC_POLL;
+        }
+    } else {
+        LOG("Thread %d: tryAllocRangeCached requesting %lld more bytes on thread %lld (found %lld of %lld)\n", MYTHREAD, (long long) requestedIncrease, (long long) thread, (long long) cachedThread->activeHeapCopy.offset, (long long) cachedThread->activeHeapCopy.size);
+        UPC_ATOMIC_CSWAP_I64( &(cached->distHeap->distHeapData[thread].requestedIncrease), 0, requestedIncrease);
+        UPC_POLL;
+    }
+    if (ret.count == 0) {
+        cached->distHeap->stats.failedAllocs++;
+        cached->distHeap->failedTo[thread]++;
+    }
+
+    checkMyHeap(cached->distHeap);
+    return ret;
+}
+
+// returns NULL if unsuccessful, pointer to the start of the put data of count HeapTypes if successful
+SharedHeapTypePtr tryPutDataCached(CachedDistHeapHandlePtr cached, UPC_INT64_T thread, HeapType *data, UPC_INT64_T count) {
+    return putAllocatedData(cached->distHeap, tryAllocRangeCached(cached, thread, count), data, count);
+}
+
+// Coalesces puts to each destination thread in a local buffer, so that a full buffer costs one
+// tryPutData (one allocation, one memput and one confirm) instead of one per element.
+// Buffers are sent when full, by flushDistHeapAggregator and by distHeapBarrier.
+// Aggregated data is only guaranteed to be in place after the next distHeapBarrier, and
+// its location is not returned, so it is for data that is read by scanning the heap.
+struct DistHeapAggregator {
+    DistHeapHandlePtr distHeap;
+    UPC_INT64_T bufferSize; // in bytes, per destination thread
+    UPC_INT64_T *used;      // bytes waiting for each destination thread
+    HeapType *buffers;      // THREADS buffers of bufferSize bytes
+};
+
+DistHeapAggregatorPtr constructDistHeapAggregator(DistHeapHandlePtr distHeap, UPC_INT64_T bufferSize) {
+    assert(distHeap != NULL);
+    assert(distHeap->aggregator == NULL);
+    assert(bufferSize > 0);
+    DistHeapAggregatorPtr agg = (DistHeapAggregatorPtr) malloc(sizeof(DistHeapAggregator) + THREADS*sizeof(UPC_INT64_T));
+    HeapType *buffers = (HeapType*) malloc(THREADS*bufferSize*sizeof(HeapType));
+    if (agg == NULL || buffers == NULL) {
+        LOG("Thread %d: Could not allocate %lld bytes for a DistHeapAggregator\n", MYTHREAD, (long long) (THREADS*bufferSize*sizeof(HeapType)));
+        upc_global_exit(1);
+    }
+    agg->distHeap = distHeap;
+    agg->bufferSize = bufferSize;
+    agg->used = (UPC_INT64_T*) (((char*) agg) + sizeof(DistHeapAggregator)); // memory directly after DistHeapAggregator is the used array
+    agg->buffers = buffers;
+    for(int i = 0; i < THREADS; i++) {
+        agg->used[i] = 0;
+    }
+    distHeap->aggregator = agg;
+    return agg;
+}
+
+// sends whatever is waiting for thread, retrying until the destination has grown enough
+void flushDistHeapAggregatorThread(DistHeapAggregatorPtr agg, UPC_INT64_T thread) {
+    assert(agg != NULL);
+    UPC_INT64_T count = agg->used[thread] / sizeof(HeapType);
+    if (count == 0) return;
+    SharedHeapTypePtr ptr;
+    loop_until( ptr = tryPutData(agg->distHeap, thread, agg->buffers + thread*agg->bufferSize, count), ptr != NULL );
+    agg->used[thread] = 0;
+}
+
+void flushDistHeapAggregator(DistHeapAggregatorPtr agg) {
+    assert(agg != NULL);
+    // start with the next thread to spread the flushes over the destinations
+    for(int i = 1; i <= THREADS; i++) {
+        flushDistHeapAggregatorThread(agg, (MYTHREAD + i) % THREADS);
+    }
+}
+
+// copies count HeapTypes from data into the buffer for thread, sending the buffer first if it is too full.
+// A put larger than the buffer is sent directly
+void aggregatePutData(DistHeapAggregatorPtr agg, UPC_INT64_T thread, HeapType *data, UPC_INT64_T count) {
+    assert(agg != NULL);
+    assert(thread >= 0);
+    assert(thread < THREADS);
+    UPC_INT64_T bytes = count * sizeof(HeapType);
+    if (agg->used[thread] + bytes > agg->bufferSize) {
+        flushDistHeapAggregatorThread(agg, thread);
+    }
+    if (bytes > agg->bufferSize) {
+        SharedHeapTypePtr ptr;
+        loop_until( ptr = tryPutData(agg->distHeap, thread, data, count), ptr != NULL );
+        return;
+    }
+    memcpy(((char*) (agg->buffers + thread*agg->bufferSize)) + agg->used[thread], data, bytes);
+    agg->used[thread] += bytes;
+}
+
+// sends anything still buffered
+void destroyDistHeapAggregator(DistHeapAggregatorPtr *_agg) {
+    assert(_agg != NULL);
+    DistHeapAggregatorPtr agg = *_agg;
+    assert(agg != NULL);
+    flushDistHeapAggregator(agg);
+    if (agg->distHeap->aggregator == agg) agg->distHeap->aggregator = NULL;
+    free(agg->buffers);
+    agg->buffers = NULL;
+    agg->used = NULL; // no need to free (allocated as part of DistHeapAggregator)
+    free(agg);
+    *_agg = NULL;
+}
+
 // explicit barrier that allows completed threads to contiue to grow their allocation until all
 // threads have completed
 void distHeapBarrier(DistHeapHandlePtr distHeap) {
 
-    loop_until( checkMyHeap(distHeap) , tryNBBarrier(distHeap->nbb) == THREADS );
-    upc_barrier; // do not reset until all threads have finished trying
-    resetNBBarrier(distHeap->nbb);
+    UPC_TICK_T start = UPC_TICKS_NOW();
+    if (distHeap->aggregator != NULL) flushDistHeapAggregator(distHeap->aggregator);
+    confirmDistHeapPuts(distHeap);
 
+    // tryNBBarrier moves on to the next epoch once it succeeds, so the condition must not call it again
+    UPC_INT64_T arrived;
+    loop_until( checkMyHeap(distHeap); arrived = tryNBBarrier(distHeap->nbb), arrived == THREADS );
+    if (distHeap->consistency == DIST_HEAP_CONSISTENCY_NONE) {
+        // every allocation has been made, so confirm my HeapAllocations up to the end of the data
+        for(SharedHeapAllocationPtr heapAlloc = distHeap->distHeapData[MYTHREAD].activeHeap; heapAlloc != NULL; heapAlloc = heapAlloc->next) {
+            assert(upc_threadof(heapAlloc) == MYTHREAD);
+            if (heapAlloc->offset <= heapAlloc->size) heapAlloc->confirmed = heapAlloc->offset;
+        }
+        upc_barrier; // the confirmed offsets are only set once every thread has finished them
+    }
+    // the NBBarrier moves on to its next epoch by itself, so there is no reset and no blocking barrier here
+    distHeap->stats.barriers++;
+    distHeap->stats.barrierTicks += UPC_TICKS_NOW() - start;
 }
 
+// clears the telemetry of this thread (collective, if the summary should only cover what follows)
+void resetDistHeapStats(DistHeapHandlePtr distHeap) {
+    memset(&(distHeap->stats), 0, sizeof(DistHeapStats));
+    memset(distHeap->putsTo, 0, 3*THREADS*sizeof(UPC_INT64_T));
+}
 
-/* TODO implement tryAllocRangeCached and tryPutDataCached */
+#ifndef DIST_HEAP_STATS_HOTSPOTS
+#define DIST_HEAP_STATS_HOTSPOTS 5
+#endif
+
+// the load histogram bins bytesReceived by its ratio to the average: below 1/4, 1/2, 1, 2, 4, 8 and above
+#define DIST_HEAP_STATS_BINS 7
+
+typedef struct DistHeapHotspot DistHeapHotspot;
+struct DistHeapHotspot {
+    UPC_INT64_T bytesReceived, failedAllocsOn;
+    int thread;
+};
+
+// most bytes first
+int compareDistHeapHotspot(const void *a, const void *b) {
+    UPC_INT64_T x = ((const DistHeapHotspot*) a)->bytesReceived, y = ((const DistHeapHotspot*) b)->bytesReceived;
+    return x > y ? -1 : (x < y ? 1 : 0);
+}
+
+// collective.  Fills in the received counts and the heap sizes of this thread's stats and returns them.
+// If out is not NULL, thread 0 writes the min, average and max of every counter over the threads, the
+// histogram of the bytes each thread received relative to the average, and the threads that received
+// the most (the hot spots of a skewed distribution), with the allocations that failed on them
+DistHeapStats summarizeDistHeapStats(DistHeapHandlePtr distHeap, FILE *out) {
+    DistHeapStats *mine = &(distHeap->stats);
+    // the received counts are the sums of what every thread sent to each one
+    shared[1] UPC_INT64_T *received = (shared[1] UPC_INT64_T*) upc_all_alloc(3*THREADS, sizeof(UPC_INT64_T));
+    shared[1] DistHeapStats *all = (shared[1] DistHeapStats*) upc_all_alloc(THREADS, sizeof(DistHeapStats));
+    if (received == NULL || all == NULL) {
+        LOG("Thread %d: Could not allocate %lld bytes for the DistHeap stats\n", MYTHREAD, (long long) (THREADS * (3*sizeof(UPC_INT64_T) + sizeof(DistHeapStats))));
+        upc_global_exit(1);
+    }
+    // received[MYTHREAD + k*THREADS] is on MYTHREAD for every k
+    received[MYTHREAD] = 0;
+    received[MYTHREAD + THREADS] = 0;
+    received[MYTHREAD + 2*THREADS] = 0;
+    upc_barrier;
+    for(int i = 1; i <= THREADS; i++) {
+        int t = (MYTHREAD + i) % THREADS;
+        if (distHeap->putsTo[t] != 0) UPC_ATOMIC_FADD_I64( &(received[t]), distHeap->putsTo[t] );
+        if (distHeap->bytesTo[t] != 0) UPC_ATOMIC_FADD_I64( &(received[t + THREADS]), distHeap->bytesTo[t] );
+        if (distHeap->failedTo[t] != 0) UPC_ATOMIC_FADD_I64( &(received[t + 2*THREADS]), distHeap->failedTo[t] );
+    }
+    upc_barrier;
+    mine->putsReceived = received[MYTHREAD];
+    mine->bytesReceived = received[MYTHREAD + THREADS];
+    mine->failedAllocsOn = received[MYTHREAD + 2*THREADS];
+    mine->heapBytes = mine->usedBytes = 0;
+    for(SharedHeapAllocationPtr heapAlloc = distHeap->distHeapData[MYTHREAD].activeHeap; heapAlloc != NULL; heapAlloc = heapAlloc->next) {
+        assert(upc_threadof(heapAlloc) == MYTHREAD);
+        mine->heapBytes += heapAlloc->size;
+        mine->usedBytes += (heapAlloc->offset < heapAlloc->size ? heapAlloc->offset : heapAlloc->size) - getHeapAllocationDataStart();
+    }
+    all[MYTHREAD] = *mine;
+    upc_barrier;
+
+    if (MYTHREAD == 0 && out != NULL) {
+        DistHeapStats *stats = (DistHeapStats*) malloc(THREADS * sizeof(DistHeapStats));
+        if (stats == NULL) {
+            LOG("Thread %d: Could not allocate %lld bytes for the DistHeap stats\n", MYTHREAD, (long long) (THREADS * sizeof(DistHeapStats)));
+            upc_global_exit(1);
+        }
+        for(int t = 0; t < THREADS; t++) stats[t] = all[t];
+
+        const char *names[] = { "puts sent", "bytes sent", "puts received", "bytes received", "failed allocs", "failed allocs on",
+                                "growths", "grown bytes", "atomic retries", "heap bytes", "used bytes", "barriers" };
+        const size_t offsets[] = { offsetof(DistHeapStats, putsSent), offsetof(DistHeapStats, bytesSent), offsetof(DistHeapStats, putsReceived),
+                                   offsetof(DistHeapStats, bytesReceived), offsetof(DistHeapStats, failedAllocs), offsetof(DistHeapStats, failedAllocsOn),
+                                   offsetof(DistHeapStats, growths), offsetof(DistHeapStats, grownBytes), offsetof(DistHeapStats, atomicRetries),
+                                   offsetof(DistHeapStats, heapBytes), offsetof(DistHeapStats, usedBytes), offsetof(DistHeapStats, barriers) };
+        fprintf(out, "DistHeap stats over %d threads\n%-18s %14s %14s %14s %8s\n", THREADS, "counter", "min", "avg", "max", "max on");
+        for(int f = 0; f < (int) (sizeof(offsets) / sizeof(offsets[0])); f++) {
+            UPC_INT64_T min = 0, max = 0, sum = 0;
+            int maxThread = 0;
+            for(int t = 0; t < THREADS; t++) {
+                UPC_INT64_T val = *(UPC_INT64_T*) (((char*) (stats + t)) + offsets[f]);
+                if (t == 0 || val < min) min = val;
+                if (t == 0 || val > max) { max = val; maxThread = t; }
+                sum += val;
+            }
+            fprintf(out, "%-18s %14lld %14.1f %14lld %8d\n", names[f], (long long) min, (double) sum / THREADS, (long long) max, maxThread);
+        }
+        double minSecs = 0.0, maxSecs = 0.0, sumSecs = 0.0;
+        int maxThread = 0;
+        for(int t = 0; t < THREADS; t++) {
+            double secs = UPC_TICKS_TO_SECS(stats[t].barrierTicks);
+            if (t == 0 || secs < minSecs) minSecs = secs;
+            if (t == 0 || secs > maxSecs) { maxSecs = secs; maxThread = t; }
+            sumSecs += secs;
+        }
+        fprintf(out, "%-18s %14.6f %14.6f %14.6f %8d\n", "barrier seconds", minSecs, sumSecs / THREADS, maxSecs, maxThread);
+
+        UPC_INT64_T totalBytes = 0, histogram[DIST_HEAP_STATS_BINS] = { 0 };
+        for(int t = 0; t < THREADS; t++) totalBytes += stats[t].bytesReceived;
+        double average = (double) totalBytes / THREADS;
+        for(int t = 0; t < THREADS; t++) {
+            int bin = 0;
+            double limit = 0.25;
+            while (bin < DIST_HEAP_STATS_BINS - 1 && average > 0.0 && stats[t].bytesReceived >= limit * average) { bin++; limit *= 2.0; }
+            histogram[bin]++;
+        }
+        const char *bins[DIST_HEAP_STATS_BINS] = { "<1/4", "<1/2", "<1", "<2", "<4", "<8", ">=8" };
+        fprintf(out, "threads by bytes received / average:");
+        for(int b = 0; b < DIST_HEAP_STATS_BINS; b++) fprintf(out, " %s:%lld", bins[b], (long long) histogram[b]);
+        fprintf(out, "\n");
+
+        DistHeapHotspot *hotspots = (DistHeapHotspot*) malloc(THREADS * sizeof(DistHeapHotspot));
+        if (hotspots == NULL) {
+            LOG("Thread %d: Could not allocate %lld bytes for the DistHeap stats\n", MYTHREAD, (long long) (THREADS * sizeof(DistHeapHotspot)));
+            upc_global_exit(1);
+        }
+        for(int t = 0; t < THREADS; t++) {
+            hotspots[t].bytesReceived = stats[t].bytesReceived;
+            hotspots[t].failedAllocsOn = stats[t].failedAllocsOn;
+            hotspots[t].thread = t;
+        }
+        qsort(hotspots, THREADS, sizeof(DistHeapHotspot), compareDistHeapHotspot);
+        fprintf(out, "hot spots:");
+        for(int i = 0; i < THREADS && i < DIST_HEAP_STATS_HOTSPOTS; i++) {
+            fprintf(out, " thread %d %.1f%% of bytes (%.2fx average, %lld failed allocs on it)%s", hotspots[i].thread,
+                    totalBytes > 0 ? 100.0 * hotspots[i].bytesReceived / totalBytes : 0.0, average > 0.0 ? hotspots[i].bytesReceived / average : 0.0,
+                    (long long) hotspots[i].failedAllocsOn, i + 1 < THREADS && i + 1 < DIST_HEAP_STATS_HOTSPOTS ? ";" : "\n");
+        }
+        fflush(out);
+        free(hotspots);
+        free(stats);
+    }
+    upc_barrier;
+    upc_all_free(all);
+    upc_all_free(received);
+    return *mine;
+}
+
+
+int compareHeapForward(const void *a, const void *b) {
+    UPC_INT64_T x = ((const HeapForward*) a)->oldStart, y = ((const HeapForward*) b)->oldStart;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// collective, after distHeapBarrier. Copies the confirmed data of each thread's HeapAllocations, oldest first,
+// into one new HeapAllocation that becomes both the head and the active heap, and frees the old ones.
+// HeapPos handles made before the compaction must be passed through translateHeapPos before the next one,
+// and any CachedDistHeapHandle must be refreshed with updateCachedDistHeap.
+void compactDistHeap(DistHeapHandlePtr distHeap) {
+    upc_barrier; // no more puts in flight
+    DistHeapData myData = distHeap->distHeapData[MYTHREAD];
+    long long dataStart = getHeapAllocationDataStart();
+    UPC_INT64_T numSegments = 0, total = 0;
+    for(SharedHeapAllocationPtr heapAlloc = myData.activeHeap; heapAlloc != NULL; heapAlloc = heapAlloc->next) {
+        assert(upc_threadof(heapAlloc) == MYTHREAD);
+        assert(heapAlloc->confirmed <= heapAlloc->size);
+        numSegments++;
+        total += heapAlloc->confirmed - dataStart;
+    }
+    if (myData.forwards != NULL) {
+        upc_free(myData.forwards);
+        myData.forwards = NULL;
+    }
+    myData.numForwards = 0;
+
+    if (numSegments > 1) {
+        SharedHeapForwardPtr forwards = (SharedHeapForwardPtr) upc_alloc(numSegments * sizeof(HeapForward));
+        if (forwards == NULL) {
+            LOG("Thread %d: Could not upc_alloc %lld bytes for the heap forwarding table\n", MYTHREAD, (long long) (numSegments * sizeof(HeapForward)));
+            upc_global_exit(1);
+        }
+        HeapForwardPtr myForwards = (HeapForwardPtr) forwards; // local, so use a private pointer
+        SharedHeapAllocationPtr compacted = constructHeapAllocation(total / sizeof(HeapType), NULL);
+        char *dst = ((char*) compacted) + dataStart;
+
+        // the list runs newest to oldest, so fill the new allocation from its end
+        UPC_INT64_T newEnd = dataStart + total, i = numSegments;
+        for(SharedHeapAllocationPtr heapAlloc = myData.activeHeap; heapAlloc != NULL; heapAlloc = heapAlloc->next) {
+            UPC_INT64_T bytes = heapAlloc->confirmed - dataStart;
+            newEnd -= bytes;
+            memcpy(dst + newEnd - dataStart, ((char*) heapAlloc) + dataStart, bytes);
+            i--;
+            myForwards[i].oldStart = heapAlloc->heapOffset + dataStart;
+            myForwards[i].oldEnd = heapAlloc->heapOffset + heapAlloc->confirmed;
+            myForwards[i].newStart = newEnd;
+        }
+        assert(i == 0 && newEnd == dataStart);
+        qsort(myForwards, numSegments, sizeof(HeapForward), compareHeapForward);
+        compacted->offset = compacted->confirmed = dataStart + total;
+
+        destroyHeapAlloc(&(myData.activeHeap));
+        myData.heapHead = myData.activeHeap = compacted;
+        myData.forwards = forwards;
+        myData.numForwards = numSegments;
+    }
+    distHeap->distHeapData[MYTHREAD] = myData;
+    for(int t = 0; t < THREADS; t++) {
+        free(distHeap->forwardCache[t]);
+        distHeap->forwardCache[t] = NULL;
+    }
+    upc_fence;
+    upc_barrier;
+}
+
+// returns where a position made before the last compactDistHeap points now
+HeapPosWide translateHeapPosWide(DistHeapHandlePtr distHeap, HeapPosWide wide) {
+    UPC_INT64_T thread = wide.thread;
+    UPC_INT64_T offset = wide.offset;
+    assert(thread >= 0);
+    assert(thread < THREADS);
+    if (offset == 0) return wide; // the null position
+    UPC_INT64_T numForwards = distHeap->distHeapData[thread].numForwards;
+    if (numForwards == 0) return wide; // nothing moved
+    HeapForwardPtr forwards = distHeap->forwardCache[thread];
+    if (forwards == NULL) {
+        forwards = distHeap->forwardCache[thread] = (HeapForwardPtr) malloc(numForwards * sizeof(HeapForward));
+        if (forwards == NULL) {
+            LOG("Thread %d: Could not allocate %lld bytes for a heap forwarding table\n", MYTHREAD, (long long) (numForwards * sizeof(HeapForward)));
+            upc_global_exit(1);
+        }
+        upc_memget(forwards, distHeap->distHeapData[thread].forwards, numForwards * sizeof(HeapForward));
+    }
+    UPC_INT64_T lo = 0, hi = numForwards - 1;
+    while (lo < hi) {
+        UPC_INT64_T mid = (lo + hi + 1) / 2;
+        if (forwards[mid].oldStart <= offset) lo = mid; else hi = mid - 1;
+    }
+    if (offset < forwards[lo].oldStart || offset >= forwards[lo].oldEnd) {
+        LOG("Thread %d: HeapPos offset %lld on thread %lld is not in any compacted HeapAllocation\n", MYTHREAD, (long long) offset, (long long) thread);
+        upc_global_exit(1);
+    }
+    wide.offset = forwards[lo].newStart + offset - forwards[lo].oldStart;
+    return wide;
+}
+
+HeapPos translateHeapPos(DistHeapHandlePtr distHeap, HeapPos heapPos) {
+    return narrowHeapPosOrExit(translateHeapPosWide(distHeap, widenHeapPos(heapPos)));
+}
 
 #endif
@@ -0,0 +1,97 @@
+//
+//  upc_dist_memory_heap_bench.c
+//
+//  Per-put latency of tryPutData under each DistHeapConsistency mode
+//  Usage: upc_dist_memory_heap_bench [putsPerThread [bytesPerPut [printStats]]]
+//
+
+/* The MIT License
+
+  Copyright (c) 2015 Rob Egan
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of 
+  this software and associated documentation files (the "Software"), to deal in 
+  the Software without restriction, including without limitation the rights to 
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies 
+  of the Software, and to permit persons to whom the Software is furnished to do 
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <upc.h>
+
+#include "upc_dist_memory_heap.h"
+
+shared double elapsed[THREADS];
+
+// the slowest thread, as seen by thread 0
+double maxElapsed(double mine) {
+	elapsed[MYTHREAD] = mine;
+	upc_barrier;
+	double max = 0.0;
+	if (MYTHREAD == 0) {
+		for(int i = 0; i < THREADS; i++) if (elapsed[i] > max) max = elapsed[i];
+	}
+	upc_barrier;
+	return max;
+}
+
+int main(int argc, char **argv) {
+	long long puts = argc > 1 ? atoll(argv[1]) : 100000;
+	long long bytes = argc > 2 ? atoll(argv[2]) : 24;
+	int printStats = argc > 3 ? atoi(argv[3]) : 0;
+	const char *names[3] = { "none", "relaxed", "strict" };
+	if (puts < 1 || bytes < 1) {
+		if (MYTHREAD == 0) fprintf(stderr, "Usage: upc_dist_memory_heap_bench [putsPerThread [bytesPerPut [printStats]]]\n");
+		upc_global_exit(1);
+	}
+	HeapType *data = (HeapType*) calloc(bytes, sizeof(HeapType));
+	if (data == NULL) {
+		LOG("Thread %d: Could not allocate %lld bytes\n", MYTHREAD, bytes);
+		upc_global_exit(1);
+	}
+	if (MYTHREAD == 0) printf("%-8s %-8s %12s %8s %12s %12s\n", "threads", "mode", "puts", "bytes", "us/put", "us/barrier");
+
+	for(int mode = DIST_HEAP_CONSISTENCY_NONE; mode <= DIST_HEAP_CONSISTENCY_STRICT; mode++) {
+		// every thread receives puts elements, so the heaps never grow
+		DistHeapHandlePtr dh = constructDistHeap(puts * bytes);
+		setDistHeapConsistency(dh, (DistHeapConsistency) mode);
+		upc_barrier;
+
+		UPC_TICK_T start = UPC_TICKS_NOW();
+		for(long long i = 0; i < puts; i++) {
+			SharedHeapTypePtr ptr;
+			loop_until( ptr = tryPutData(dh, (MYTHREAD + i) % THREADS, data, bytes), ptr != NULL );
+		}
+		UPC_TICK_T putsDone = UPC_TICKS_NOW();
+		distHeapBarrier(dh);
+		UPC_TICK_T end = UPC_TICKS_NOW();
+
+		double putSecs = maxElapsed(UPC_TICKS_TO_SECS(putsDone - start));
+		double barrierSecs = maxElapsed(UPC_TICKS_TO_SECS(end - putsDone));
+		if (MYTHREAD == 0) {
+			printf("%-8d %-8s %12lld %8lld %12.3f %12.3f\n", THREADS, names[mode], puts * THREADS, bytes, putSecs * 1e6 / puts, barrierSecs * 1e6);
+			fflush(stdout);
+		}
+		if (printStats) summarizeDistHeapStats(dh, stdout);
+		// every mode has to leave the same confirmed data behind
+		assert(dh->distHeapData[MYTHREAD].activeHeap->confirmed == getHeapAllocationDataStart() + puts * bytes);
+		upc_barrier;
+		destroyDistHeap(&dh);
+	}
+	free(data);
+	return 0;
+}
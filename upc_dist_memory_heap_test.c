@@ -51,6 +51,8 @@ struct _mytype {
 typedef struct _mytype mytype;
 typedef shared[] mytype *sharedMyTypePtr;
 
+shared long long reached[THREADS];
+
 //UPC_SHARED_MEMORY_HEAP_INIT_STATIC(stat, mytype)
 //UPC_SHARED_MEMORY_HEAP_INIT_DYNAMIC(dyn, mytype)
 
@@ -95,6 +97,7 @@ int main() {
 		}
 		assert(lastPos != NULL);
 		assert(upc_threadof(lastPos) == destthread);
+		assert(getSharedPtrFromDistHeapHandle(dh, getHeapPosFromDistHeapHandle(dh, lastPos)) == lastPos);
 		for(long long j = 0; j < step ; j++) {
 			assert( ((sharedMyTypePtr) (lastPos+j))->thread == MYTHREAD);
 			assert( ((sharedMyTypePtr) (lastPos+j))->idx == i*step+j);
@@ -147,5 +150,149 @@ int main() {
 	destroyHeapIterator(&end); 
 	destroyDistHeap(&dh);
 
+	// test aggregated puts: every element to a different thread, buffered 8 elements per destination
+	dh = constructDistHeap(mytypesize*mysize);
+	DistHeapAggregatorPtr agg = constructDistHeapAggregator(dh, 8*mytypesize);
+	for(long long i = 0; i < mysize; i++) {
+		aggregatePutData(agg, (MYTHREAD+i)%THREADS, (HeapType*) (x+i), mytypesize);
+	}
+	distHeapBarrier(dh); // flushes the partial buffers
+	upc_barrier;
+	heapHead = dh->distHeapData[MYTHREAD].heapHead;
+	assert(heapHead == dh->distHeapData[MYTHREAD].activeHeap); // sized for everything, so only one allocation event
+	assert(heapHead->offset == heapHead->confirmed);
+	long long received = (heapHead->confirmed - getHeapAllocationDataStart()) / mytypesize;
+	assert(received == mysize);
+	mytype *myreceived3 = (mytype*) (((SharedBytesPtr) heapHead) + getHeapAllocationDataStart());
+	for(long long i = 0; i < received; i++) {
+		LOG("Thread %d: aggregated i=%lld received.thread=%d received.idx=%lld\n", MYTHREAD, i, myreceived3[i].thread, myreceived3[i].idx);
+		assert((myreceived3[i].thread + myreceived3[i].idx) % THREADS == MYTHREAD);
+	}
+	destroyDistHeapAggregator(&agg);
+	upc_barrier;
+	destroyDistHeap(&dh);
+
+	// test cached puts into heaps that start too small, so the cache has to follow them as they grow
+	dh = constructDistHeap(mytypesize*4);
+	CachedDistHeapHandlePtr cdh = constructCachedDistHeap(dh);
+	HeapPos *positions = (HeapPos*) malloc(mysize * sizeof(HeapPos));
+	assert(positions != NULL);
+	for(long long i = 0; i < mysize; i++) {
+		int destthread = (MYTHREAD+i)%THREADS;
+		while( NULL == (lastPos = tryPutDataCached(cdh, destthread, (HeapType*) (x+i), mytypesize))) {
+			LOG("Thread %d: Attempt to put cached element %lld to %d failed!\n", MYTHREAD, i, destthread);
+		}
+		assert(upc_threadof(lastPos) == destthread);
+		assert( ((sharedMyTypePtr) lastPos)->thread == MYTHREAD);
+		assert( ((sharedMyTypePtr) lastPos)->idx == i);
+		positions[i] = getHeapPosFromDistHeapHandle(dh, lastPos);
+		assert(getSharedPtrFromHeapPosWide(dh, widenHeapPos(positions[i])) == lastPos);
+	}
+	distHeapBarrier(dh);
+	upc_barrier;
+	received = 0;
+	for(SharedHeapAllocationPtr heapAlloc = dh->distHeapData[MYTHREAD].activeHeap; heapAlloc != NULL; heapAlloc = heapAlloc->next) {
+		assert(upc_threadof(heapAlloc) == MYTHREAD);
+		assert(heapAlloc->confirmed <= heapAlloc->size);
+		received += (heapAlloc->confirmed - getHeapAllocationDataStart()) / mytypesize;
+	}
+	assert(received == mysize);
+	// every element was one put, and the heaps that started too small had to grow on request
+	DistHeapStats stats = summarizeDistHeapStats(dh, stdout);
+	assert(stats.putsSent == mysize && stats.bytesSent == mysize * mytypesize);
+	assert(stats.putsReceived == mysize && stats.bytesReceived == mysize * mytypesize);
+	assert(stats.usedBytes == mysize * mytypesize);
+	assert(stats.growths > 0 && stats.failedAllocsOn > 0);
+	assert(stats.barriers == 1);
+
+	// scan the grown heaps through private pointers
+	long long numSpans = getLocalHeapSpans(dh, NULL, 0);
+	HeapSpan *spans = (HeapSpan*) malloc(numSpans * sizeof(HeapSpan));
+	assert(spans != NULL);
+	assert(getLocalHeapSpans(dh, spans, numSpans) == numSpans);
+	received = 0;
+	for(long long s = 0; s < numSpans; s++) {
+		assert(spans[s].bytes % mytypesize == 0);
+		mytype *elements = (mytype*) spans[s].ptr;
+		for(long long i = 0; i < spans[s].bytes / mytypesize; i++) {
+			assert((elements[i].thread + elements[i].idx) % THREADS == MYTHREAD);
+		}
+		received += spans[s].bytes / mytypesize;
+	}
+	assert(received == mysize);
+	free(spans);
+
+	// compact the grown heaps into one HeapAllocation each, in the order the data arrived
+	compactDistHeap(dh);
+	heapHead = dh->distHeapData[MYTHREAD].heapHead;
+	assert(heapHead == dh->distHeapData[MYTHREAD].activeHeap);
+	assert(heapHead->next == NULL);
+	assert(heapHead->confirmed == getHeapAllocationDataStart() + mysize * mytypesize);
+	HeapSpan span;
+	assert(getLocalHeapSpans(dh, &span, 1) == 1);
+	assert(span.bytes == mysize * mytypesize);
+	mytype *compacted = (mytype*) span.ptr;
+	for(long long i = 0; i < mysize; i++) {
+		assert((compacted[i].thread + compacted[i].idx) % THREADS == MYTHREAD);
+	}
+	// positions taken before the compaction still find my elements once translated
+	for(long long i = 0; i < mysize; i++) {
+		sharedMyTypePtr moved = (sharedMyTypePtr) getSharedPtrFromDistHeapHandle(dh, translateHeapPos(dh, positions[i]));
+		assert(upc_threadof(moved) == (MYTHREAD+i)%THREADS);
+		assert(moved->thread == MYTHREAD);
+		assert(moved->idx == i);
+	}
+	free(positions);
+	destroyCachedDistHeap(&cdh);
+	upc_barrier;
+	destroyDistHeap(&dh);
+
+	// without confirmations, heaps that start too small are filled across two distHeapBarriers and keep everything
+	dh = constructDistHeap(mytypesize*4);
+	setDistHeapConsistency(dh, DIST_HEAP_CONSISTENCY_NONE);
+	for(long long i = 0; i < mysize; i++) {
+		if (i == mysize / 2) distHeapBarrier(dh);
+		while( NULL == (lastPos = tryPutData(dh, (MYTHREAD+i)%THREADS, (HeapType*) (x+i), mytypesize))) {
+			LOG("Thread %d: Attempt to put unconfirmed element %lld failed!\n", MYTHREAD, i);
+		}
+	}
+	distHeapBarrier(dh);
+	upc_barrier;
+	numSpans = getLocalHeapSpans(dh, NULL, 0);
+	spans = (HeapSpan*) malloc(numSpans * sizeof(HeapSpan));
+	assert(spans != NULL);
+	assert(getLocalHeapSpans(dh, spans, numSpans) == numSpans);
+	received = 0;
+	for(long long s = 0; s < numSpans; s++) {
+		mytype *elements = (mytype*) spans[s].ptr;
+		for(long long i = 0; i < spans[s].bytes / mytypesize; i++) {
+			assert((elements[i].thread + elements[i].idx) % THREADS == MYTHREAD);
+		}
+		received += spans[s].bytes / mytypesize;
+	}
+	assert(received == mysize);
+	free(spans);
+	upc_barrier;
+	destroyDistHeap(&dh);
+
+	// the split-phase tree barrier sums what every thread notifies, over and over without resets
+	NBTreeBarrier nbt = initNBTreeBarrier();
+	for(long long i = 0; i < 100; i++) {
+		notifyNBTreeBarrier(nbt, MYTHREAD + i);
+		assert(waitNBTreeBarrier(nbt) == (long long) THREADS * (THREADS - 1) / 2 + i * THREADS);
+	}
+	destroyNBTreeBarrier(&nbt);
+
+	// the NBBarrier is reused epoch after epoch without resets, and what was written before arriving is seen
+	NBBarrier nbb = initNBBarrier();
+	for(long long i = 1; i <= 100; i++) {
+		reached[MYTHREAD] = i;
+		while (tryNBBarrier(nbb) != THREADS);
+		for(int t = 0; t < THREADS; t++) {
+			assert(reached[t] >= i);
+		}
+	}
+	destroyNBBarrier(&nbb);
+
 	return 0;
 }
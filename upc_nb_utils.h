@@ -33,26 +33,28 @@
 #include "upc_utils.h"
 #include <assert.h>
 
+/*
+ * Non-blocking barrier: tryNBBarrier returns THREADS once every thread has called it in the current epoch.
+ * Each mark holds the latest epoch its thread has reached, and a thread moves to the next epoch as soon
+ * as it sees the current one complete, so an NBBarrier can be reused straight away without any reset.
+ * Writes made before a thread's first tryNBBarrier of an epoch are visible to the threads that see it complete.
+ */
 typedef struct _NBBarrier *NBBarrier;
 struct _NBBarrier {
-  shared[1] UPC_INT64_T *marks;
-  unsigned char *cachedMarks;
+  shared[1] UPC_INT64_T *marks; // the latest epoch each thread has reached
+  UPC_INT64_T *cachedMarks;     // the latest mark seen for each thread
+  UPC_INT64_T epoch;            // the epoch this thread is in
+  UPC_INT64_T tries;
 };
 
+// epochs need no reset, this is only kept so that existing callers still build
 void resetNBBarrier(NBBarrier nbb) {
     assert(nbb != NULL);
-    assert(nbb->marks != NULL);
-    assert(upc_threadof( &(nbb->marks[MYTHREAD])) == MYTHREAD);
-    nbb->marks[MYTHREAD] = 0;
-    upc_fence;
-    for(int i = 0; i < THREADS; i++) {
-        nbb->cachedMarks[i] = 0;
-    }
 }
 
-// initializes a NBBarrier
+// initializes a NBBarrier, collectively
 NBBarrier initNBBarrier() {
-    NBBarrier nbb = (NBBarrier) malloc(sizeof(struct _NBBarrier) + sizeof(unsigned char) * THREADS);
+    NBBarrier nbb = (NBBarrier) malloc(sizeof(struct _NBBarrier) + sizeof(UPC_INT64_T) * THREADS);
     if (nbb == NULL) {
         LOG("Could not allocate a NBBarrier!\n");
         upc_global_exit(1);
@@ -62,8 +64,15 @@ NBBarrier initNBBarrier() {
         LOG("Could not allocate NBBarrier!\n");
         upc_global_exit(1);
     }
-    nbb->cachedMarks = (unsigned char*) (((char*) nbb) + sizeof(struct _NBBarrier));
-    resetNBBarrier(nbb);
+    nbb->cachedMarks = (UPC_INT64_T*) (((char*) nbb) + sizeof(struct _NBBarrier));
+    for(int i = 0; i < THREADS; i++) {
+        nbb->cachedMarks[i] = 0;
+    }
+    nbb->epoch = 1;
+    nbb->tries = 0;
+    assert(upc_threadof( &(nbb->marks[MYTHREAD])) == MYTHREAD);
+    nbb->marks[MYTHREAD] = 0;
+    upc_barrier; // every mark is cleared before anyone tries
     return nbb;
 }
 
@@ -73,6 +82,7 @@ void destroyNBBarrier(NBBarrier *_nbb) {
     assert(nbb != NULL);
     assert(nbb->marks != NULL);
     assert(nbb->cachedMarks != NULL);
+    upc_barrier; // tryNBBarrier does not block, so other threads may still be reading the marks
     upc_all_free(nbb->marks);
     nbb->marks = NULL;
     nbb->cachedMarks = NULL; // no need to free nbb->cachedMarks as it was allocated as part of NBBarrier itself
@@ -80,22 +90,26 @@ void destroyNBBarrier(NBBarrier *_nbb) {
     *_nbb = NULL;
 }
 
-// returns THREADS when all threads have called tryNBBarrier at least once, <THREADS when incomplete
+// returns THREADS when all threads have called tryNBBarrier at least once in this epoch, <THREADS when incomplete
 UPC_INT64_T tryNBBarrier(NBBarrier nbb) {
     assert(nbb != NULL);
     assert(nbb->marks != NULL);
     assert(upc_threadof( &(nbb->marks[MYTHREAD])) == MYTHREAD);
 
+    if (nbb->cachedMarks[MYTHREAD] < nbb->epoch) {
+        upc_fence; // publish everything written before arriving
+        nbb->marks[MYTHREAD] = nbb->cachedMarks[MYTHREAD] = nbb->epoch;
+        upc_fence;
+    }
     UPC_INT64_T ret = 0;
     int fails = 0;
     // avoid load imbalances, testing new failed thread each iteration
-    UPC_INT64_T offset = nbb->marks[MYTHREAD]++ + MYTHREAD;
+    UPC_INT64_T offset = nbb->tries++ + MYTHREAD;
     for(UPC_INT64_T i = offset; i < offset+THREADS; i++) {
         int testThread = i % THREADS;
-        if ( nbb->cachedMarks[testThread] > 0 ) {
+        if ( nbb->cachedMarks[testThread] >= nbb->epoch ) {
             ret++;
-        } else if ( nbb->marks[testThread] > 0 ) {
-            nbb->cachedMarks[testThread] = 1;
+        } else if ( (nbb->cachedMarks[testThread] = nbb->marks[testThread]) >= nbb->epoch ) {
             ret++;
         } else {
             fails++;
@@ -103,9 +117,128 @@ UPC_INT64_T tryNBBarrier(NBBarrier nbb) {
         if (fails > 0) break;
     }
     assert( fails > 0 || ret == THREADS);
+    if (ret == THREADS) {
+        upc_fence; // see everything written before the other threads arrived
+        nbb->epoch++;
+    }
     return ret;
 } 
 
+/*
+ * Split-phase tree barrier that also sums one value from every thread:
+ *   notifyNBTreeBarrier(nbt, value)   arrive
+ *   tryNBTreeBarrier(nbt, &sum)       1 once every thread has arrived, then sum is the total
+ *   waitNBTreeBarrier(nbt)            polls tryNBTreeBarrier and returns the sum
+ * Threads arrive up a binomial tree (thread i reports to i - 2^r where 2^r is its lowest set bit) and
+ * are released back down it.  Children write into their parent's slots, so a poll only reads local
+ * memory and each barrier costs O(log THREADS) remote writes per thread.  Every flag holds the epoch it
+ * belongs to, so nothing is ever reset.
+ */
+#define NB_TREE_MAX_ROUNDS 32
+#define NB_TREE_ARRIVED(round) (round)
+#define NB_TREE_PAYLOAD(round) (NB_TREE_MAX_ROUNDS + (round))
+#define NB_TREE_RELEASE (2*NB_TREE_MAX_ROUNDS)
+#define NB_TREE_RESULT (2*NB_TREE_MAX_ROUNDS + 1)
+#define NB_TREE_SLOTS (2*NB_TREE_MAX_ROUNDS + 2)
+
+typedef struct _NBTreeBarrier *NBTreeBarrier;
+struct _NBTreeBarrier {
+  strict shared[NB_TREE_SLOTS] UPC_INT64_T *slots; // NB_TREE_SLOTS per thread
+  UPC_INT64_T epoch; // of the barrier in flight or last completed
+  UPC_INT64_T sum;   // of my subtree so far, then the result
+  int round;         // the next child to wait for
+  int parentRound;   // the round in which I report to my parent (the number of rounds on thread 0)
+  int state;         // 0 complete, 1 waiting for children, 2 waiting for release
+};
+
+#define NB_TREE_SLOT(nbt, thread, idx) ((nbt)->slots[(thread) * NB_TREE_SLOTS + (idx)])
+
+NBTreeBarrier initNBTreeBarrier() {
+    NBTreeBarrier nbt = (NBTreeBarrier) malloc(sizeof(struct _NBTreeBarrier));
+    if (nbt == NULL) {
+        LOG("Could not allocate a NBTreeBarrier!\n");
+        upc_global_exit(1);
+    }
+    nbt->slots = (strict shared[NB_TREE_SLOTS] UPC_INT64_T *) upc_all_alloc(THREADS, NB_TREE_SLOTS * sizeof(UPC_INT64_T));
+    if (nbt->slots == NULL) {
+        LOG("Could not allocate NBTreeBarrier!\n");
+        upc_global_exit(1);
+    }
+    for(int i = 0; i < NB_TREE_SLOTS; i++) {
+        NB_TREE_SLOT(nbt, MYTHREAD, i) = 0;
+    }
+    nbt->epoch = 0;
+    nbt->sum = 0;
+    nbt->round = 0;
+    nbt->state = 0;
+    for(nbt->parentRound = 0; (1 << nbt->parentRound) < THREADS && (MYTHREAD & (1 << nbt->parentRound)) == 0; nbt->parentRound++);
+    assert(nbt->parentRound < NB_TREE_MAX_ROUNDS);
+    upc_barrier; // every slot is cleared before anyone arrives
+    return nbt;
+}
+
+void destroyNBTreeBarrier(NBTreeBarrier *_nbt) {
+    assert(_nbt != NULL);
+    NBTreeBarrier nbt = *_nbt;
+    assert(nbt != NULL);
+    assert(nbt->state == 0);
+    upc_all_free(nbt->slots);
+    nbt->slots = NULL;
+    free(nbt);
+    *_nbt = NULL;
+}
+
+int tryNBTreeBarrier(NBTreeBarrier nbt, UPC_INT64_T *result) {
+    assert(nbt != NULL);
+    if (nbt->state == 1) {
+        // gather my children, nearest first
+        for( ; nbt->round < nbt->parentRound; nbt->round++) {
+            if (MYTHREAD + (1 << nbt->round) >= THREADS) continue;
+            if (NB_TREE_SLOT(nbt, MYTHREAD, NB_TREE_ARRIVED(nbt->round)) < nbt->epoch) return 0;
+            nbt->sum += NB_TREE_SLOT(nbt, MYTHREAD, NB_TREE_PAYLOAD(nbt->round));
+        }
+        if (MYTHREAD == 0) {
+            nbt->state = 3; // the root releases straight away
+        } else {
+            int parent = MYTHREAD - (1 << nbt->parentRound);
+            NB_TREE_SLOT(nbt, parent, NB_TREE_PAYLOAD(nbt->parentRound)) = nbt->sum;
+            NB_TREE_SLOT(nbt, parent, NB_TREE_ARRIVED(nbt->parentRound)) = nbt->epoch;
+            nbt->state = 2;
+        }
+    }
+    if (nbt->state == 2) {
+        if (NB_TREE_SLOT(nbt, MYTHREAD, NB_TREE_RELEASE) < nbt->epoch) return 0;
+        nbt->sum = NB_TREE_SLOT(nbt, MYTHREAD, NB_TREE_RESULT);
+        nbt->state = 3;
+    }
+    if (nbt->state == 3) {
+        // release my children, farthest first
+        for(int r = nbt->parentRound - 1; r >= 0; r--) {
+            int child = MYTHREAD + (1 << r);
+            if (child >= THREADS) continue;
+            NB_TREE_SLOT(nbt, child, NB_TREE_RESULT) = nbt->sum;
+            NB_TREE_SLOT(nbt, child, NB_TREE_RELEASE) = nbt->epoch;
+        }
+        nbt->state = 0;
+    }
+    if (result != NULL) *result = nbt->sum;
+    return 1;
+}
+
+void notifyNBTreeBarrier(NBTreeBarrier nbt, UPC_INT64_T value) {
+    assert(nbt != NULL);
+    assert(nbt->state == 0); // the last one must have completed
+    nbt->epoch++;
+    nbt->sum = value;
+    nbt->round = 0;
+    nbt->state = 1;
+    tryNBTreeBarrier(nbt, NULL); // a leaf reports at once
+}
 
+UPC_INT64_T waitNBTreeBarrier(NBTreeBarrier nbt) {
+    UPC_INT64_T result;
+    loop_until( ((void)0), tryNBTreeBarrier(nbt, &result) );
+    return result;
+}
 
 #endif